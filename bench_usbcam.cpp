@@ -0,0 +1,318 @@
+// Measures capture and decoding and prints the results as JSON, so that
+// releases, cameras and buffer settings can be compared.
+// NOTES
+//   The capture phase locks and unlocks frames as fast as they come and
+// measures how long each usbcam_lock waits, the capture-to-lock latency
+// (see §STATS in usbcam.h), the frame rate, dropped frames and the CPU
+// time (of all threads) per frame. It keeps a copy of the first frames,
+// which the decode phase then decodes into every output format at every
+// scale, on one thread. Point -d at a recording and pass -p to run
+// without a camera (see §PLAYBACK); -p fast measures how fast frames can
+// be handed out at all.
+// compiling
+//   g++ -O2 bench_usbcam.cpp -o bench_usbcam -lv4l2 -lturbojpeg -ljpeg -pthread
+// running
+//   ./bench_usbcam -d /dev/video0 -w 800 -h 600 -b 3 -n 600 -o result.json
+//   ./bench_usbcam -d video000.avi -p fast -w 800 -h 600
+// options
+//   -d device    camera or recording (/dev/video0)
+//   -w width     (800)
+//   -h height    (600)
+//   -b buffers   (3)
+//   -n frames    frames to capture (300)
+//   -t           use a capture thread (§CAPTURE THREAD)
+//   -j threads   decode on this many threads while capturing (§DECODE THREADS)
+//   -p mode      replay -d instead, "realtime" or "fast" (§PLAYBACK)
+//   -s samples   frames to keep for the decode phase, 0 skips it (30)
+//   -o file      write the JSON here instead of stdout (usbcam prints warnings to stdout)
+
+#include "usbcam.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define max_samples 256
+
+double seconds_now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+double cpu_seconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Sorts values and gives the p'th percentile (nearest rank)
+double percentile(double *values, int count, double p)
+{
+    if (count == 0)
+        return 0.0;
+    qsort(values, count, sizeof(double), compare_doubles);
+    int i = (int)(p/100.0*count + 0.5) - 1;
+    if (i < 0) i = 0;
+    if (i >= count) i = count - 1;
+    return values[i];
+}
+
+void print_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\') fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+struct sample_t
+{
+    unsigned char *data;
+    unsigned int size;
+};
+
+struct output_format_t
+{
+    const char *name;
+    int pixel_format; // TJPF_*, or -1 for planar YUV
+};
+
+// Decodes every sample at least twice and for at least min_seconds,
+// and writes the time per frame as a JSON object
+void bench_decode(FILE *out, output_format_t format, int scale, sample_t *samples, int num_samples, int width, int height)
+{
+    int subsamp = TJSAMP_420;
+    int jpg_width, jpg_height;
+    if (usbcam_jpeg_header(samples[0].data, samples[0].size, &jpg_width, &jpg_height, &subsamp))
+    {
+        width = jpg_width;
+        height = jpg_height;
+    }
+    tjscalingfactor factor = { 1, scale };
+    int w = TJSCALED(width, factor);
+    int h = TJSCALED(height, factor);
+
+    unsigned char *pixels = NULL;
+    unsigned char *planes[3] = {0};
+    int strides[3] = {0};
+    if (format.pixel_format >= 0)
+        pixels = (unsigned char*)malloc(w*h*tjPixelSize[format.pixel_format]);
+    else
+    {
+        for (int i = 0; i < (subsamp == TJSAMP_GRAY ? 1 : 3); i++)
+        {
+            strides[i] = tjPlaneWidth(i, w, subsamp);
+            planes[i] = (unsigned char*)malloc(strides[i]*tjPlaneHeight(i, h, subsamp));
+        }
+    }
+
+    const double min_seconds = 0.25;
+    const int max_times = 4096;
+    static double times[max_times];
+    int count = 0;
+    int failed = 0;
+    double started = seconds_now();
+    for (int round = 0; count < max_times && (round < 2 || seconds_now() - started < min_seconds); round++)
+    {
+        for (int i = 0; i < num_samples && count < max_times; i++)
+        {
+            double t1 = seconds_now();
+            bool ok;
+            if (format.pixel_format >= 0)
+                ok = usbcam_jpeg_to_pixels(w, h, format.pixel_format, pixels, samples[i].data, samples[i].size);
+            else
+                ok = usbcam_jpeg_to_yuv(w, h, planes, strides, samples[i].data, samples[i].size);
+            double t2 = seconds_now();
+            if (!ok)
+                failed++;
+            times[count++] = (t2-t1)*1e3;
+        }
+    }
+
+    double sum = 0.0;
+    for (int i = 0; i < count; i++)
+        sum += times[i];
+    fprintf(out, "      {\"format\": \"%s\", \"scale\": \"1/%d\", \"width\": %d, \"height\": %d, \"decodes\": %d, \"failed\": %d, "
+                 "\"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f}",
+            format.name, scale, w, h, count, failed, count ? sum/count : 0.0,
+            percentile(times, count, 50), percentile(times, count, 99), percentile(times, count, 100));
+
+    free(pixels);
+    for (int i = 0; i < 3; i++)
+        free(planes[i]);
+}
+
+int main(int argc, char **argv)
+{
+    usbcam_opt_t opt = {0};
+    opt.device_name = "/dev/video0";
+    opt.pixel_format = V4L2_PIX_FMT_MJPEG;
+    opt.width = 800;
+    opt.height = 600;
+    opt.buffers = 3;
+    int num_frames = 300;
+    int num_samples = 30;
+    const char *output = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i+1 < argc ? argv[i+1] : NULL;
+        if (strcmp(arg, "-t") == 0) { opt.threaded = 1; continue; }
+        if (!value || arg[0] != '-' || strlen(arg) != 2)
+        {
+            fprintf(stderr, "usage: %s [-d device] [-w width] [-h height] [-b buffers] [-n frames] [-t] [-j threads]"
+                            " [-p realtime|fast] [-s samples] [-o file]\n", argv[0]);
+            return 1;
+        }
+        switch (arg[1])
+        {
+            case 'd': opt.device_name = value; break;
+            case 'w': opt.width = atoi(value); break;
+            case 'h': opt.height = atoi(value); break;
+            case 'b': opt.buffers = atoi(value); break;
+            case 'n': num_frames = atoi(value); break;
+            case 'j': opt.decode_threads = atoi(value); break;
+            case 's': num_samples = atoi(value); break;
+            case 'o': output = value; break;
+            case 'p': opt.playback = strcmp(value, "fast") == 0 ? usbcam_playback_fast : usbcam_playback_realtime; break;
+            default: fprintf(stderr, "unknown option %s\n", arg); return 1;
+        }
+        i++;
+    }
+    if (num_samples > max_samples)
+        num_samples = max_samples;
+    if (num_frames < 1)
+        num_frames = 1;
+
+    usbcam_t *cam = usbcam_open(opt);
+    if (!cam)
+        return 1;
+
+    //
+    // capture phase
+    //
+    double *wait_ms = (double*)malloc(num_frames*sizeof(double));
+    sample_t samples[max_samples];
+    int kept = 0;
+    int frames = 0;
+    int errors = 0;
+    usbcam_reset_stats(cam);
+    double cpu_start = cpu_seconds();
+    double started = seconds_now();
+    while (frames < num_frames)
+    {
+        usbcam_frame_t frame;
+        double t1 = seconds_now();
+        int r = opt.decode_threads ? usbcam_lock_rgb(cam, &frame) : usbcam_lock_frame(cam, &frame);
+        double t2 = seconds_now();
+        if (r < 0)
+        {
+            // the end of a recording, or an unplugged camera
+            errors++;
+            break;
+        }
+        wait_ms[frames++] = (t2-t1)*1e3;
+        if (!opt.decode_threads && kept < num_samples)
+        {
+            samples[kept].data = (unsigned char*)malloc(frame.size);
+            samples[kept].size = frame.size;
+            memcpy(samples[kept].data, frame.data, frame.size);
+            kept++;
+        }
+        if (opt.decode_threads)
+            usbcam_unlock_rgb(cam, &frame);
+        else
+            usbcam_release_frame(cam, &frame);
+    }
+    double elapsed = seconds_now() - started;
+    double cpu = cpu_seconds() - cpu_start;
+    usbcam_stats_t stats;
+    usbcam_get_stats(cam, &stats);
+    usbcam_close(cam);
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out)
+    {
+        fprintf(stderr, "could not open %s\n", output);
+        return 1;
+    }
+    fprintf(out, "{\n");
+    fprintf(out, "  \"config\": {\"device\": ");
+    print_json_string(out, opt.device_name);
+    fprintf(out, ", \"width\": %u, \"height\": %u, \"buffers\": %u, \"threaded\": %d, "
+                 "\"decode_threads\": %d, \"playback\": %d, \"frames\": %d},\n",
+            opt.width, opt.height, opt.buffers, opt.threaded, opt.decode_threads, opt.playback, num_frames);
+    fprintf(out, "  \"capture\": {\n");
+    fprintf(out, "    \"frames\": %d,\n", frames);
+    fprintf(out, "    \"seconds\": %.4f,\n", elapsed);
+    fprintf(out, "    \"fps\": %.3f,\n", elapsed > 0.0 ? frames/elapsed : 0.0);
+    fprintf(out, "    \"cpu_ms_per_frame\": %.4f,\n", frames ? cpu*1e3/frames : 0.0);
+    fprintf(out, "    \"lock_wait_ms\": {\"p50\": %.4f, \"p99\": %.4f, \"max\": %.4f},\n",
+            percentile(wait_ms, frames, 50), percentile(wait_ms, frames, 99), percentile(wait_ms, frames, 100));
+    fprintf(out, "    \"latency_ms\": {\"mean\": %.4f, \"max\": %.4f, \"histogram\": [",
+            stats.delivered ? stats.latency_sum_us/1e3/stats.delivered : 0.0, stats.latency_max_us/1e3);
+    for (int i = 0; i < usbcam_latency_bins; i++)
+        fprintf(out, "%s%llu", i ? ", " : "", stats.latency[i]);
+    fprintf(out, "]},\n");
+    fprintf(out, "    \"delivered\": %llu,\n", stats.delivered);
+    fprintf(out, "    \"skipped\": %llu,\n", stats.skipped);
+    fprintf(out, "    \"dropped_by_driver\": %llu,\n", stats.sequence_gaps);
+    fprintf(out, "    \"corrupted\": %llu,\n", stats.corrupted);
+    fprintf(out, "    \"errors\": %d\n", errors);
+    fprintf(out, "  },\n");
+
+    //
+    // decode phase
+    //
+    fprintf(out, "  \"decode\": {\n");
+    fprintf(out, "    \"samples\": %d,\n", kept);
+    fprintf(out, "    \"results\": [");
+    if (kept > 0)
+    {
+        output_format_t formats[] = {
+            { "rgb", TJPF_RGB },
+            { "bgrx", TJPF_BGRX },
+            { "gray", TJPF_GRAY },
+            { "yuv", -1 }
+        };
+        int scales[] = { 1, 2, 4, 8 };
+        int first = 1;
+        for (size_t f = 0; f < sizeof(formats)/sizeof(formats[0]); f++)
+        {
+            for (size_t s = 0; s < sizeof(scales)/sizeof(scales[0]); s++)
+            {
+                fprintf(out, first ? "\n" : ",\n");
+                bench_decode(out, formats[f], scales[s], samples, kept, opt.width, opt.height);
+                first = 0;
+            }
+        }
+        fprintf(out, "\n    ");
+    }
+    fprintf(out, "]\n");
+    fprintf(out, "  }\n");
+    fprintf(out, "}\n");
+    if (out != stdout)
+        fclose(out);
+
+    for (int i = 0; i < kept; i++)
+        free(samples[i].data);
+    free(wait_ms);
+    return 0;
+}
@@ -3,13 +3,15 @@ decompress_jpg=0
 stream_video=0
 print_timestamps=1
 write_to_file=0
+playback=0      # (0=camera, 1=replay camera_name in real time, 2=as fast as possible)
 camera_name=/dev/video0
 camera_width=800
 camera_height=600
 camera_buffers=3
+camera_fps=0    # (0=camera default; camera_width=0 and camera_height=0 pick the fastest mode)
 
 # ELP FISHEYE CAMERA CONTROLS
-# (v4l2-ctl -d/dev/video0 -L)
+# (./app -l, or v4l2-ctl -d/dev/video0 -L)
 powerline=0     # (0=off, 1 = 50Hz, 2 = 60Hz)
 whitebalance=1  # (0=off, 1=on)
 sharpness=2     # (min=0    max=6   step=1 default=2)
@@ -22,44 +24,31 @@ gain=0          # (min=0    max=100 step=1 default=0)
 exposure=45     # (min=1    max=5000 step=1 default=157)
 
 #
+# The controls are set by the app itself (see §CONTROLS in usbcam.h),
+# in this order. Uncomment the ones you want to change.
 #
-#
-
-# echo "Turning off exposure auto priority"
-#     v4l2-ctl -d $camera_name -c exposure_auto_priority=0
-echo "Setting exposure to manual"
-    v4l2-ctl -d $camera_name -c exposure_auto=1
-echo "Setting exposure time to $exposure"
-    v4l2-ctl -d $camera_name -c exposure_absolute=$exposure
-# echo "Setting sharpness to $sharpness"
-#     v4l2-ctl -d $camera_name -c sharpness=$sharpness
-# echo "Setting brightness to $brightness"
-#     v4l2-ctl -d $camera_name -c brightness=$brightness
-# echo "Setting contrast to $contrast"
-#     v4l2-ctl -d $camera_name -c contrast=$contrast
-# echo "Setting saturation to $saturation"
-#     v4l2-ctl -d $camera_name -c saturation=$saturation
-# echo "Setting hue to $hue"
-#     v4l2-ctl -d $camera_name -c hue=$hue
-# echo "Setting gamma to $gamma"
-#     v4l2-ctl -d $camera_name -c gamma=$gamma
-# echo "Setting gain to $gain"
-#     v4l2-ctl -d $camera_name -c gain=$gain
-# echo "Setting power line frequency to $powerline"
-#     v4l2-ctl -d $camera_name -c power_line_frequency=$powerline
-# echo "Setting automatic white balance to $whitebalance"
-#     v4l2-ctl -d $camera_name -c white_balance_temperature_auto=$whitebalance
+CONTROLS=""
+CONTROLS="$CONTROLS -c exposure_auto=1"
+CONTROLS="$CONTROLS -c exposure_absolute=$exposure"
+# CONTROLS="$CONTROLS -c exposure_auto_priority=0"
+# CONTROLS="$CONTROLS -c sharpness=$sharpness"
+# CONTROLS="$CONTROLS -c brightness=$brightness"
+# CONTROLS="$CONTROLS -c contrast=$contrast"
+# CONTROLS="$CONTROLS -c saturation=$saturation"
+# CONTROLS="$CONTROLS -c hue=$hue"
+# CONTROLS="$CONTROLS -c gamma=$gamma"
+# CONTROLS="$CONTROLS -c gain=$gain"
+# CONTROLS="$CONTROLS -c power_line_frequency=$powerline"
+# CONTROLS="$CONTROLS -c white_balance_temperature_auto=$whitebalance"
 
 #
 # compile and run
 #
-DEFINES="-DCAMERA_NAME=\"$camera_name\"
-         -DCAMERA_WIDTH=$camera_width
-         -DCAMERA_HEIGHT=$camera_height
-         -DCAMERA_BUFFERS=$camera_buffers
-         -DNUM_FRAMES=$num_frames
+DEFINES="-DNUM_FRAMES=$num_frames
          -DDECOMPRESS_JPG=$decompress_jpg
          -DSTREAM_VIDEO=$stream_video
          -DPRINT_TIMESTAMPS=$print_timestamps
-         -DWRITE_TO_FILE=$write_to_file"
-g++ $DEFINES test_usbcam.cpp -o app -lv4l2 -lturbojpeg && ./app
+         -DWRITE_TO_FILE=$write_to_file
+         -DPLAYBACK=$playback"
+g++ $DEFINES test_usbcam.cpp -o app -lv4l2 -lturbojpeg -ljpeg -pthread &&
+./app -d $camera_name -w $camera_width -h $camera_height -b $camera_buffers -f $camera_fps $CONTROLS
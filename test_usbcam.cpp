@@ -1,5 +1,12 @@
 // compiling
-//   g++ test_usbcam.cpp -o app -lv4l2 -lturbojpeg && ./app
+//   g++ test_usbcam.cpp -o app -lv4l2 -lturbojpeg -ljpeg -pthread && ./app
+// running
+//   ./app [-d device] [-w width] [-h height] [-b buffers] [-f fps] [-c control=value]... [-l]
+//   -w 0 -h 0 picks the fastest MJPEG mode (see §FORMATS)
+//   -c sets a control by its v4l2-ctl name, e.g. -c exposure_absolute=45 (see §CONTROLS)
+//   -l lists the camera's modes and controls
+// the CAMERA_* defines below are the defaults
+// for throughput, latency and decode measurements use bench_usbcam.cpp
 
 #ifndef NUM_FRAMES
 #define NUM_FRAMES       0
@@ -16,6 +23,12 @@
 #ifndef WRITE_TO_FILE
 #define WRITE_TO_FILE    0
 #endif
+#ifndef RECORD_VIDEO
+#define RECORD_VIDEO     0
+#endif
+#ifndef PLAYBACK
+#define PLAYBACK         0 // 1 replays CAMERA_NAME (a recording) in real time, 2 as fast as possible
+#endif
 #ifndef CAMERA_NAME
 #define CAMERA_NAME      "/dev/video0"
 #endif
@@ -29,6 +42,7 @@
 #define CAMERA_BUFFERS   3
 #endif
 
+#define VDB_THREADS // stream from threads of this process rather than forked ones
 #include "vdb_release.h"
 #include "usbcam.h"
 #include <stdint.h>
@@ -38,15 +52,67 @@
 uint64_t get_nanoseconds()
 {
     struct timespec ts = {};
-    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts); // the clock that camera timestamps use, see §TIMESTAMPS
     uint64_t result = ((uint64_t)ts.tv_sec)*1000000000 +
                       ((uint64_t)ts.tv_nsec);
     return result;
 }
 
+volatile sig_atomic_t quit = 0;
+
 void ctrlc(int)
 {
+    #if RECORD_VIDEO==1
+    quit = 1; // let the loop finish the recording
+    #else
     exit(0);
+    #endif
+}
+
+void list_modes_and_controls(const char *device_name)
+{
+    usbcam_control_info_t controls[64];
+    int n = usbcam_enum_controls(controls, 64);
+    for (int i = 0; i < n && i < 64; i++)
+    {
+        int value = 0;
+        usbcam_get_control(controls[i].id, &value);
+        printf("%-32s %6d (min=%d max=%d step=%d default=%d)\n", controls[i].name, value,
+               controls[i].minimum, controls[i].maximum, controls[i].step, controls[i].default_value);
+    }
+
+    usbcam_mode_t modes[256];
+    n = usbcam_enum_modes(device_name, modes, 256);
+    for (int i = 0; i < n && i < 256; i++)
+    {
+        unsigned int f = modes[i].pixel_format;
+        printf("%c%c%c%c %4ux%-4u", f & 0xff, (f >> 8) & 0xff, (f >> 16) & 0xff, f >> 24, modes[i].width, modes[i].height);
+        if (modes[i].interval_numerator)
+            printf(" %6.2f fps", (float)modes[i].interval_denominator/modes[i].interval_numerator);
+        printf("\n");
+    }
+}
+
+// The mode with the most frames per second, and the most pixels of those
+int find_fastest_mode(const char *device_name, unsigned int pixel_format, usbcam_mode_t *best)
+{
+    usbcam_mode_t modes[256];
+    int n = usbcam_enum_modes(device_name, modes, 256);
+    int found = 0;
+    for (int i = 0; i < n && i < 256; i++)
+    {
+        usbcam_mode_t m = modes[i];
+        if (m.pixel_format != pixel_format || !m.interval_numerator)
+            continue;
+        double fps = (double)m.interval_denominator/m.interval_numerator;
+        double best_fps = found ? (double)best->interval_denominator/best->interval_numerator : 0.0;
+        if (!found || fps > best_fps || (fps == best_fps && m.width*m.height > best->width*best->height))
+        {
+            *best = m;
+            found = 1;
+        }
+    }
+    return found;
 }
 
 int main(int argc, char **argv)
@@ -59,23 +125,106 @@ int main(int argc, char **argv)
     opt.width = CAMERA_WIDTH;
     opt.height = CAMERA_HEIGHT;
     opt.buffers = CAMERA_BUFFERS;
+    opt.reconnect = 1;
+    opt.playback = PLAYBACK;
 
-    usbcam_init(opt);
+    const char *controls[64];
+    int num_controls = 0;
+    int list = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-l") == 0) { list = 1; continue; }
+        if (i+1 >= argc || argv[i][0] != '-')
+        {
+            printf("usage: %s [-d device] [-w width] [-h height] [-b buffers] [-f fps] [-c control=value]... [-l]\n", argv[0]);
+            return 1;
+        }
+        const char *value = argv[++i];
+        switch (argv[i-1][1])
+        {
+            case 'd': opt.device_name = value; break;
+            case 'w': opt.width = atoi(value); break;
+            case 'h': opt.height = atoi(value); break;
+            case 'b': opt.buffers = atoi(value); break;
+            case 'f': opt.fps = atoi(value); break;
+            case 'c': if (num_controls < 64) controls[num_controls++] = value; break;
+            default: printf("unknown option %s\n", argv[i-1]); return 1;
+        }
+    }
+
+    if (!opt.playback && (opt.width == 0 || opt.height == 0))
+    {
+        usbcam_mode_t mode;
+        if (!find_fastest_mode(opt.device_name, opt.pixel_format, &mode))
+        {
+            printf("%s has no MJPEG modes\n", opt.device_name);
+            return 1;
+        }
+        opt.width = mode.width;
+        opt.height = mode.height;
+        opt.fps = (mode.interval_denominator + mode.interval_numerator/2)/mode.interval_numerator;
+        printf("Using %ux%u at %u fps\n", opt.width, opt.height, opt.fps);
+    }
+
+    if (usbcam_init(opt) < 0)
+        return 1;
+
+    if (list)
+    {
+        list_modes_and_controls(opt.device_name);
+        usbcam_cleanup();
+        return 0;
+    }
+
+    // in the order given, e.g. exposure_auto=1 before exposure_absolute=45
+    for (int i = 0; i < num_controls; i++)
+    {
+        char name[64];
+        int value;
+        if (sscanf(controls[i], "%63[^=]=%d", name, &value) != 2)
+        {
+            printf("controls are given as name=value, not %s\n", controls[i]);
+            continue;
+        }
+        int id = usbcam_find_control(name);
+        if (id > 0 && usbcam_set_control(id, value) == 0)
+            printf("Set %s to %d\n", name, value);
+    }
+
+    const int Ix = opt.width;
+    const int Iy = opt.height;
+    unsigned char *rgb = (unsigned char*)malloc(Ix*Iy*3);
+    #if WRITE_TO_FILE==1 || STREAM_VIDEO==1
+    unsigned int jpg_capacity = Ix*Iy*2 + 1024;
+    unsigned char *jpg = (unsigned char*)malloc(jpg_capacity); // reused for every frame, see §MJPG
+    #endif
+
+    #if RECORD_VIDEO==1
+    usbcam_recorder_opt_t ropt = {0};
+    ropt.path = "video%03d.avi";
+    ropt.width = opt.width;
+    ropt.height = opt.height;
+    usbcam_recorder_t *rec = usbcam_recorder_open(ropt);
+    if (!rec)
+        return 1;
+    #endif
 
     #if NUM_FRAMES==0
-    for (int i = 0; ; i++)
+    for (int i = 0; !quit; i++)
     #else
-    for (int i = 0; i < NUM_FRAMES; i++)
+    for (int i = 0; i < NUM_FRAMES && !quit; i++)
     #endif
     {
-        const int Ix = CAMERA_WIDTH;
-        const int Iy = CAMERA_HEIGHT;
-        static unsigned char rgb[Ix*Iy*3];
         {
             unsigned char *jpg_data;
             unsigned int jpg_size;
             timeval timestamp;
-            usbcam_lock(&jpg_data, &jpg_size, &timestamp);
+            if (usbcam_lock(&jpg_data, &jpg_size, &timestamp) < 0)
+            {
+                // unplugged, wait for it to come back
+                usleep(100*1000);
+                continue;
+            }
 
             printf("%5d. ", i);
 
@@ -94,14 +243,13 @@ int main(int argc, char **argv)
 
             #if STREAM_VIDEO==1
             {
-                static uint64_t last_t = get_nanoseconds();
-                uint64_t t = get_nanoseconds();
-                float dt = (t-last_t)/1e9;
-                if (dt > 1.0f && vdb_begin())
+                // the browser decodes the JPEG, so every frame can go out;
+                // vdb_begin skips frames only while its send ring is full
+                if (vdb_begin())
                 {
-                    vdb_imageRGB8(rgb, Ix, Iy);
+                    unsigned int size = usbcam_mjpg_to_jpg(jpg_data, jpg_size, jpg, jpg_capacity);
+                    vdb_imageJPEG(size ? jpg : jpg_data, size ? size : jpg_size);
                     vdb_end();
-                    last_t = t;
                 }
             }
             #endif
@@ -109,13 +257,23 @@ int main(int argc, char **argv)
             #if WRITE_TO_FILE==1
             {
                 char filename[256];
+                unsigned int size = usbcam_mjpg_to_jpg(jpg_data, jpg_size, jpg, jpg_capacity);
                 sprintf(filename, "video%04d.jpg", i);
                 FILE *f = fopen(filename, "w+");
-                fwrite(jpg_data, jpg_size, 1, f);
+                fwrite(size ? jpg : jpg_data, size ? size : jpg_size, 1, f);
                 fclose(f);
             }
             #endif
 
+            #if RECORD_VIDEO==1
+            {
+                // usbcam_lock timestamps are CLOCK_MONOTONIC on any recent driver, see §TIMESTAMPS
+                long long t = usbcam_timestamp_ns(timestamp, V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC);
+                if (usbcam_record(rec, jpg_data, jpg_size, t, i) == -ENOBUFS)
+                    printf("(not recorded) ");
+            }
+            #endif
+
             usbcam_unlock();
 
             #if PRINT_TIMESTAMPS==1
@@ -144,7 +302,22 @@ int main(int argc, char **argv)
         }
     }
 
+    usbcam_stats_t stats;
+    usbcam_get_stats(&stats);
+    printf("delivered %llu, skipped %llu, dropped by driver %llu, corrupted %llu\n",
+           stats.delivered, stats.skipped, stats.sequence_gaps, stats.corrupted);
+    if (stats.delivered > 0)
+        printf("latency: mean %.2f ms, max %.2f ms\n", stats.latency_sum_us/1e3/stats.delivered, stats.latency_max_us/1e3);
+
+    #if RECORD_VIDEO==1
+    usbcam_recorder_close(rec);
+    #endif
+
     usbcam_cleanup();
+    free(rgb);
+    #if WRITE_TO_FILE==1 || STREAM_VIDEO==1
+    free(jpg);
+    #endif
 
     return 0;
 }
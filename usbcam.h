@@ -2,6 +2,31 @@
 // github.com/lightbits
 //
 // Changelog
+// (31) Low latency tuning: pinned and realtime capture threads, buffer counts from measured hold times (usbcam_tune_buffers)
+// (30) Synchronized capture from several cameras, matched by timestamp (usbcam_sync_*)
+// (29) Pluggable JPEG decoders, with V4L2 mem2mem hardware decoding and turbojpeg fallback (usbcam_set_decoder)
+// (28) Pool of aligned, reference counted images to decode into and keep (usbcam_pool_create, usbcam_keep_rgb)
+// (27) Pick a scaling factor turbojpeg has and decode into a sized image (usbcam_scaled_size, usbcam_jpeg_to_image)
+// (26) Decode only a region of interest of a JPEG (usbcam_jpeg_to_rgb_roi)
+// (25) Switch mode or buffer count without closing the camera (usbcam_reconfigure)
+// (24) Camera controls, frame rate and mode enumeration at runtime (usbcam_set_control, usbcam_enum_modes)
+// (23) Replay recordings through the same API, in real time or as fast as possible (usbcam_opt_t.playback)
+// (22) Record MJPEG to AVI files on a background thread, with rotation (usbcam_recorder_*)
+// (21) MJPG->JPG conversion into a reusable (or the same) buffer (usbcam_mjpg_to_jpg)
+// (20) Timestamp source flags and CLOCK_MONOTONIC nanoseconds (usbcam_timestamp_ns)
+// (19) Frame drop, sequence gap and latency counters (usbcam_get_stats)
+// (18) Non-blocking usbcam_try_lock with a timeout, and usbcam_fd for your own event loop
+// (17) Errors are returned instead of exiting, optional reconnect (usbcam_opt_t.reconnect)
+// (16) Capture into caller-owned memory (usbcam_opt_t.memory: USERPTR or DMABUF)
+// (15) Export capture buffers as DMABUF fds (usbcam_opt_t.export_dmabuf)
+// (14) YUYV->gray, YUYV->RGB and NV12->RGB conversion with SSE2/AVX2/NEON paths
+// (13) Decode to gray, planar YUV or any turbojpeg pixel format
+// (12) Parallel MJPEG->RGB decoding on worker threads (usbcam_opt_t.decode_threads)
+// (11) Reuse one decompressor per thread in usbcam_jpeg_to_rgb (still thread-safe)
+// (10) Hold several frames at once with usbcam_lock_frame/usbcam_release_frame
+// (9) Optional background capture thread (usbcam_opt_t.threaded)
+// (8) Event loop over several cameras with epoll (usbcam_epoll_*)
+// (7) Multiple cameras through usbcam_t handles (usbcam_open/usbcam_close)
 // (6) Don't preserve decompressor instance in usbcam_jpeg_to_rgb (thread-safety)
 // (5) Automatically unlock previous frame on usbcam_lock if user forgot (and warn)
 // (4) Buffer count is unsigned
@@ -12,21 +37,237 @@
 // See §BUILDING for build instructions
 
 #include <sys/time.h>
+#include <stddef.h>
+
+// See §MEMORY
+#define usbcam_memory_mmap    0
+#define usbcam_memory_userptr 1
+#define usbcam_memory_dmabuf  2
+
+// See §PLAYBACK
+#define usbcam_playback_off      0
+#define usbcam_playback_realtime 1
+#define usbcam_playback_fast     2
+
 struct usbcam_opt_t
 {
     const char *device_name;
-    unsigned int buffers; // See §BUFFERS
+    unsigned int buffers; // See §BUFFERS, 0 picks the fewest that work (see §LOW LATENCY)
     unsigned int pixel_format; // See §PIXELFORMATS
     unsigned int width;
     unsigned int height;
+    int threaded; // See §CAPTURE THREAD
+    int decode_threads; // See §DECODE THREADS
+    int decode_width; // 0 means width
+    int decode_height; // 0 means height
+    int decode_format; // TJPF_* pixel format, 0 means RGB. See §OUTPUT FORMATS
+    int decode_keep; // decoded frames you can keep with usbcam_keep_rgb, see §IMAGE POOL
+    int export_dmabuf; // See §DMABUF
+    int memory; // usbcam_memory_*, see §MEMORY
+    void *arena; // usbcam_memory_userptr: memory for all the buffers
+    size_t arena_size;
+    const int *dmabuf_fds; // usbcam_memory_dmabuf: one fd per buffer
+    int reconnect; // See §ERRORS
+    int playback; // usbcam_playback_*, device_name is then a recording, see §PLAYBACK
+    unsigned int fps; // frames per second, 0 leaves the camera's default, see §FORMATS
+    unsigned long long cpu_mask; // cores to run the capture or decode threads on, 0 is any, see §LOW LATENCY
+    int realtime_priority; // SCHED_FIFO priority for those threads, 0 is off, see §LOW LATENCY
+};
+
+// See §MULTIPLE CAMERAS and §ERRORS
+struct usbcam_t;
+usbcam_t *usbcam_open(usbcam_opt_t opt);
+void usbcam_close(usbcam_t *cam);
+int usbcam_lock(usbcam_t *cam, unsigned char **data, unsigned int *size, timeval *timestamp);
+int usbcam_unlock(usbcam_t *cam);
+int usbcam_is_lost(usbcam_t *cam);
+
+// See §FRAMES
+struct usbcam_frame_t
+{
+    unsigned int   index; // V4L2 buffer index
+    unsigned char *data;
+    unsigned int   size;
+    timeval        timestamp;
+    unsigned int   sequence; // Driver frame counter
+    int            dmabuf_fd; // -1 unless export_dmabuf is set, see §DMABUF
+    unsigned int   flags; // V4L2_BUF_FLAG_*, see §TIMESTAMPS
+};
+int usbcam_lock_frame(usbcam_t *cam, usbcam_frame_t *frame);
+int usbcam_retain_frame(usbcam_t *cam, usbcam_frame_t *frame);
+int usbcam_release_frame(usbcam_t *cam, usbcam_frame_t *frame);
+
+// See §DECODE THREADS
+int usbcam_lock_rgb(usbcam_t *cam, usbcam_frame_t *frame);
+int usbcam_unlock_rgb(usbcam_t *cam, usbcam_frame_t *frame);
+
+// See §POLLING
+int usbcam_try_lock(usbcam_t *cam, int timeout_us, unsigned char **data, unsigned int *size, timeval *timestamp);
+int usbcam_try_lock_frame(usbcam_t *cam, usbcam_frame_t *frame, int timeout_us);
+int usbcam_try_lock_rgb(usbcam_t *cam, usbcam_frame_t *frame, int timeout_us);
+int usbcam_fd(usbcam_t *cam);
+
+// See §TIMESTAMPS
+long long usbcam_timestamp_ns(const usbcam_frame_t *frame);
+long long usbcam_timestamp_ns(timeval timestamp, unsigned int flags);
+
+// See §STATS
+#define usbcam_latency_bins 12
+struct usbcam_stats_t
+{
+    unsigned long long delivered; // frames you got
+    unsigned long long skipped; // frames we requeued because a newer one was ready
+    unsigned long long sequence_gaps; // frames the driver dropped (gaps in v4l2_buffer.sequence)
+    unsigned long long corrupted; // V4L2_BUF_FLAG_ERROR, or failed to decode
+    unsigned long long latency[usbcam_latency_bins]; // capture-to-lock histogram, see §STATS
+    unsigned long long latency_sum_us;
+    unsigned long long latency_max_us;
+    unsigned long long done; // frames that were decoded, or that you released
+    unsigned long long done_latency[usbcam_latency_bins]; // capture-to-done histogram, see §STATS
+    unsigned long long done_latency_sum_us;
+    unsigned long long done_latency_max_us;
+};
+int usbcam_get_stats(usbcam_t *cam, usbcam_stats_t *stats);
+void usbcam_reset_stats(usbcam_t *cam);
+
+// See §LOW LATENCY
+int usbcam_tune_buffers(usbcam_t *cam);
+
+// See §CONTROLS
+struct usbcam_control_t
+{
+    unsigned int id; // V4L2_CID_*
+    int value;
+};
+struct usbcam_control_info_t
+{
+    unsigned int id;
+    char name[32]; // e.g. "exposure_absolute", as v4l2-ctl calls it
+    int type; // V4L2_CTRL_TYPE_*
+    int minimum, maximum, step, default_value;
+};
+int usbcam_set_control(usbcam_t *cam, unsigned int id, int value);
+int usbcam_get_control(usbcam_t *cam, unsigned int id, int *value);
+int usbcam_set_controls(usbcam_t *cam, const usbcam_control_t *controls, int count);
+int usbcam_query_control(usbcam_t *cam, unsigned int id, usbcam_control_info_t *info);
+int usbcam_enum_controls(usbcam_t *cam, usbcam_control_info_t *controls, int max_controls);
+int usbcam_find_control(usbcam_t *cam, const char *name);
+
+// See §FORMATS
+struct usbcam_mode_t
+{
+    unsigned int pixel_format;
+    unsigned int width, height;
+    unsigned int interval_numerator, interval_denominator; // seconds per frame, 0/0 if unknown
 };
+int usbcam_enum_modes(const char *device_name, usbcam_mode_t *modes, int max_modes);
+int usbcam_set_fps(usbcam_t *cam, unsigned int fps);
+
+// See §RECONFIGURE
+int usbcam_try_mode(usbcam_t *cam, const usbcam_mode_t *mode);
+int usbcam_reconfigure(usbcam_t *cam, const usbcam_mode_t *mode, unsigned int buffers);
+
+// See §EVENT LOOP
+struct usbcam_epoll_t;
+typedef void (*usbcam_callback_t)(usbcam_t *cam, unsigned char *data, unsigned int size, timeval timestamp, void *userdata);
+usbcam_epoll_t *usbcam_epoll_create();
+void usbcam_epoll_destroy(usbcam_epoll_t *ep);
+int usbcam_epoll_add(usbcam_epoll_t *ep, usbcam_t *cam, usbcam_callback_t callback, void *userdata);
+int usbcam_epoll_remove(usbcam_epoll_t *ep, usbcam_t *cam);
+int usbcam_epoll_wait(usbcam_epoll_t *ep, int timeout_ms);
 
+// See §SYNC GROUPS
+#define usbcam_sync_max_depth 8
+struct usbcam_sync_t;
+usbcam_sync_t *usbcam_sync_create(usbcam_t **cams, int count, long long tolerance_ns, int depth);
+void usbcam_sync_destroy(usbcam_sync_t *sync);
+int usbcam_sync_lock(usbcam_sync_t *sync, usbcam_frame_t *frames, int timeout_us);
+int usbcam_sync_unlock(usbcam_sync_t *sync);
+
+// These operate on a default camera instance
 void usbcam_cleanup();
-void usbcam_init(usbcam_opt_t opt);
-void usbcam_lock(unsigned char **data, unsigned int *size, timeval *timestamp);
-void usbcam_unlock();
+int usbcam_init(usbcam_opt_t opt);
+int usbcam_lock(unsigned char **data, unsigned int *size, timeval *timestamp);
+int usbcam_unlock();
+int usbcam_get_stats(usbcam_stats_t *stats);
+int usbcam_set_control(unsigned int id, int value);
+int usbcam_get_control(unsigned int id, int *value);
+int usbcam_enum_controls(usbcam_control_info_t *controls, int max_controls);
+int usbcam_find_control(const char *name);
+int usbcam_reconfigure(const usbcam_mode_t *mode, unsigned int buffers);
+int usbcam_tune_buffers();
 // See §DECOMPRESSION
 bool usbcam_jpeg_to_rgb(int desired_width, int desired_height, unsigned char *rgb, unsigned char *jpg_data, unsigned int jpg_size);
+// See §OUTPUT FORMATS
+bool usbcam_jpeg_to_gray(int desired_width, int desired_height, unsigned char *gray, unsigned char *jpg_data, unsigned int jpg_size);
+bool usbcam_jpeg_to_pixels(int desired_width, int desired_height, int pixel_format, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size);
+bool usbcam_jpeg_to_yuv(int desired_width, int desired_height, unsigned char **planes, int *strides, unsigned char *jpg_data, unsigned int jpg_size);
+bool usbcam_jpeg_header(unsigned char *jpg_data, unsigned int jpg_size, int *width, int *height, int *subsamp);
+// See §SCALING
+struct usbcam_pool_t;
+struct usbcam_image_t
+{
+    unsigned char *data; // height rows of width*tjPixelSize[pixel_format] bytes
+    int width, height;
+    int pixel_format; // TJPF_*
+    int stride; // bytes from one row to the next
+    size_t capacity; // bytes allocated at data
+    usbcam_pool_t *pool; // NULL unless it came from a pool, see §IMAGE POOL
+    int index; // in the pool
+};
+bool usbcam_scaled_size(int width, int height, int min_width, int min_height, int *scaled_width, int *scaled_height);
+bool usbcam_jpeg_to_image(int min_width, int min_height, int pixel_format, usbcam_image_t *image, unsigned char *jpg_data, unsigned int jpg_size);
+void usbcam_free_image(usbcam_image_t *image);
+// See §IMAGE POOL
+#define usbcam_pool_hugepages 1 // back the pool with 2 MB pages
+#define usbcam_pool_packed    2 // rows tightly packed instead of 64-byte aligned
+usbcam_pool_t *usbcam_pool_create(int width, int height, int pixel_format, int count, int flags);
+void usbcam_pool_destroy(usbcam_pool_t *pool);
+int usbcam_pool_acquire(usbcam_pool_t *pool, usbcam_image_t *image);
+int usbcam_jpeg_to_pool(usbcam_pool_t *pool, usbcam_image_t *image, unsigned char *jpg_data, unsigned int jpg_size);
+void usbcam_retain_image(usbcam_image_t *image);
+void usbcam_release_image(usbcam_image_t *image);
+int usbcam_keep_rgb(usbcam_t *cam, usbcam_frame_t *frame, usbcam_image_t *image);
+// See §REGION OF INTEREST
+bool usbcam_jpeg_to_rgb_roi(int desired_width, int desired_height, int x, int y, int width, int height, unsigned char *rgb, unsigned char *jpg_data, unsigned int jpg_size);
+bool usbcam_jpeg_to_pixels_roi(int desired_width, int desired_height, int x, int y, int width, int height, int pixel_format, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size);
+// See §DECODERS
+struct usbcam_decoder_t
+{
+    const char *name; // what usbcam_set_decoder takes
+    void *(*open)(const char *device); // state for the calling thread, NULL if it can't decode here
+    void (*close)(void *state);
+    // 0, -ENOTSUP to let turbojpeg decode this one, or another -errno to stop using it
+    int (*decode)(void *state, int width, int height, int pitch, int pixel_format, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size);
+};
+extern const usbcam_decoder_t usbcam_decoder_turbojpeg;
+extern const usbcam_decoder_t usbcam_decoder_v4l2;
+int usbcam_register_decoder(const usbcam_decoder_t *decoder);
+int usbcam_set_decoder(const char *name);
+const char *usbcam_decoder_name();
+// See §MJPG
+unsigned int usbcam_mjpg_to_jpg(unsigned char *mjpg, unsigned int mjpg_size, unsigned char *jpg, unsigned int jpg_capacity);
+int usbcam_mjpg_huffman_offset(const unsigned char *mjpg, unsigned int mjpg_size);
+const unsigned char *usbcam_mjpg_huffman(unsigned int *size);
+// See §RECORDING
+struct usbcam_recorder_opt_t
+{
+    const char *path; // e.g. "video%03d.avi", %d is replaced by the file number
+    unsigned int width, height; // written to the AVI header
+    unsigned long long max_file_size; // bytes per file, 0 means 1 GB (at most 2 GB)
+    unsigned int buffer_size; // bytes of frames waiting to be written, 0 means 32 MB
+    int preallocate; // reserve max_file_size on disk when a file is started
+};
+struct usbcam_recorder_t;
+usbcam_recorder_t *usbcam_recorder_open(usbcam_recorder_opt_t opt);
+int usbcam_record(usbcam_recorder_t *rec, const unsigned char *data, unsigned int size, long long timestamp_ns, unsigned int sequence);
+int usbcam_record_frame(usbcam_recorder_t *rec, const usbcam_frame_t *frame);
+unsigned long long usbcam_recorder_dropped(usbcam_recorder_t *rec);
+int usbcam_recorder_close(usbcam_recorder_t *rec);
+// See §RAW FORMATS
+void usbcam_yuyv_to_gray(int width, int height, int stride, const unsigned char *yuyv, unsigned char *gray);
+void usbcam_yuyv_to_rgb(int width, int height, int stride, const unsigned char *yuyv, unsigned char *rgb);
+void usbcam_nv12_to_rgb(int width, int height, int stride, const unsigned char *nv12, unsigned char *rgb);
 
 //
 // USER MANUAL
@@ -38,7 +279,8 @@ bool usbcam_jpeg_to_rgb(int desired_width, int desired_height, unsigned char *rg
 // process one frame and the camera gives one frame every 30 ms,
 // then it will fill up three buffers while you process. If you
 // requested less than three buffers you will not get the latest
-// frame when you ask for the next frame!
+// frame when you ask for the next frame! usbcam_tune_buffers can
+// measure this and pick the count for you, see §LOW LATENCY.
 //
 // §PIXELFORMATS
 // A common format is V4L2_PIX_FMT_MJPEG.
@@ -48,13 +290,620 @@ bool usbcam_jpeg_to_rgb(int desired_width, int desired_height, unsigned char *rg
 // You can find out what formats your camera supports with
 //   v4l2-ctl -d /dev/video0 --list-formats-ext
 //
+// §FORMATS
+// usbcam_enum_modes lists every pixel format, frame size and frame
+// interval that a camera has, without opening it for capture, so that
+// you can choose one at startup:
+//   usbcam_mode_t modes[256];
+//   int n = usbcam_enum_modes("/dev/video0", modes, 256);
+//   for (int i = 0; i < n && i < 256; i++)
+//     ... modes[i].interval_denominator/modes[i].interval_numerator fps
+// It returns how many modes there are, which can be more than you had
+// room for, or -errno. Cameras that take any size or interval in a
+// range are listed with the smallest and the largest.
+// Set opt.fps to choose the frame rate when the camera is opened (most
+// cameras only have a few for each size, and pick the closest).
+// usbcam_set_fps changes it later, but many drivers refuse this while
+// streaming (-EBUSY). The frame rate also drops by itself in low light
+// if the camera is allowed to lengthen the exposure; turn off
+// exposure_auto_priority (see §CONTROLS) to stop that.
+//
+// §CONTROLS
+// Exposure, gain, white balance and the like are controls, with ids
+// V4L2_CID_* from videodev2.h. You can change them while streaming, for
+// example to adjust exposure every frame:
+//   usbcam_set_control(cam, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL);
+//   usbcam_set_control(cam, V4L2_CID_EXPOSURE_ABSOLUTE, 45);
+// usbcam_set_controls sets several at once (VIDIOC_S_EXT_CTRLS), so
+// that they take effect on the same frame where the driver supports it,
+// e.g. exposure and gain together. Cameras have their own controls too;
+// usbcam_enum_controls lists them all, with their range, and
+// usbcam_find_control looks one up by the name that v4l2-ctl -L shows:
+//   int id = usbcam_find_control(cam, "white_balance_temperature_auto");
+//   if (id > 0) usbcam_set_control(cam, id, 0);
+// They all return -errno on failure, e.g. -EINVAL for a control the
+// camera doesn't have or a value out of range, and -ENODEV if the camera
+// is lost. Controls are not restored when the camera reconnects (see
+// §ERRORS), so set them again once usbcam_is_lost returns false.
+//
+// §RECONFIGURE
+// usbcam_reconfigure switches to another mode (any of usbcam_enum_modes,
+// or NULL to keep the one you have) and/or buffer count (0 keeps it)
+// without closing the camera, e.g. a small preview that goes to full
+// resolution for a snapshot and back:
+//   usbcam_mode_t full = { V4L2_PIX_FMT_MJPEG, 1920, 1080, 0, 0 };
+//   if (usbcam_try_mode(cam, &full) == 0) ... // once, up front
+//   usbcam_reconfigure(cam, &full, 0);
+// The device stays open, so controls keep their values and nobody else
+// can grab it in between, and nothing has to be set up again but the
+// stream itself. V4L2 can't change the format while there are buffers,
+// so the stream is stopped and the buffers reallocated; only adding
+// buffers in the same mode is done while streaming (VIDIOC_CREATE_BUFS,
+// for mmap memory, when the driver has it). usbcam_try_mode asks the
+// camera whether it has a mode without touching the stream, and
+// usbcam_reconfigure does the same before stopping anything, so a mode
+// it doesn't have fails with -EINVAL and the old one keeps running.
+// If the new mode fails later, the old one is restored; if that fails
+// too, or the camera is unplugged, it returns -ENODEV and the camera is
+// lost (see §ERRORS), reconnecting in the old mode.
+// Opened with decode threads, the decoded frames follow the new size
+// unless you set opt.decode_width and opt.decode_height. Frames of the
+// old mode are dropped. Unlock everything first (-EBUSY otherwise), and
+// don't lock frames from other threads while it runs. It doesn't work
+// on recordings (-ENOTTY).
+//
+// §MULTIPLE CAMERAS
+// usbcam_init, usbcam_lock, usbcam_unlock and usbcam_cleanup all
+// operate on one default camera. To stream from several cameras in
+// the same process, open each one with usbcam_open, which returns a
+// handle that you pass to usbcam_lock and usbcam_unlock, and close
+// it with usbcam_close when you are done. Each handle owns its own
+// device and mmap'd buffers, so frames can be read directly out of
+// each camera's buffers without copying. A handle should only be
+// used by one thread at a time.
+//   usbcam_t *left = usbcam_open(left_opt);
+//   usbcam_t *right = usbcam_open(right_opt);
+//   usbcam_lock(left, &left_data, &left_size, &left_timestamp);
+//   usbcam_lock(right, &right_data, &right_size, &right_timestamp);
+//   ...
+//   usbcam_unlock(left);
+//   usbcam_unlock(right);
+// The two frames above are each camera's newest, not necessarily from
+// the same moment. To get frames that line up, see §SYNC GROUPS.
+//
+// §ERRORS
+// Every function that can fail returns 0 when it succeeds and a
+// negative errno code when it doesn't (usbcam_open returns NULL), and
+// prints a message saying why. Nothing calls exit, so a camera that
+// fails doesn't take the rest of your process down with it.
+//   if (usbcam_lock(cam, &data, &size, &timestamp) < 0)
+//       ... skip this camera for now
+// A camera that is unplugged, or whose driver starts returning EIO,
+// is considered lost: every call returns -ENODEV and usbcam_is_lost
+// returns true. Without reconnect, close it (or call usbcam_init
+// again) to try again. If you set reconnect in usbcam_opt_t, a
+// background thread for that camera instead tears down the old
+// buffers and keeps running the same usbcam_init steps until the
+// camera is back, waiting longer between each attempt (up to a few
+// seconds). Nothing else waits for it: locks on that camera keep
+// returning -ENODEV until it is back, and other cameras are served
+// as usual. The old buffers are only unmapped after you have
+// released every frame you held from them.
+//
+// §POLLING
+// usbcam_lock sleeps until there is a frame. If your loop has other
+// things to do, use usbcam_try_lock instead, which gives up after
+// timeout_us microseconds and returns -EAGAIN (0 doesn't wait at all,
+// and a negative timeout waits forever, like usbcam_lock). There are
+// also usbcam_try_lock_frame and usbcam_try_lock_rgb, which work the
+// same way for §FRAMES and §DECODE THREADS.
+//   if (usbcam_try_lock(cam, 2000, &data, &size, &timestamp) == 0)
+//       ...
+// To wait for frames in your own poll, select or epoll loop instead,
+// add the fd you get from usbcam_fd and call usbcam_try_lock(cam, 0,
+// ...) when it is readable (POLLIN). That only works without a
+// capture thread or decode threads, since they take the frames before
+// you would see them. If the camera reconnects (see §ERRORS) it gets a
+// new fd. The device is opened with O_NONBLOCK either way.
+//
+// §FRAMES
+// usbcam_lock only lets you hold one frame at a time, and locking a
+// new one unlocks the previous. If you want to work on several frames
+// at once, for example to decode one frame on one thread while you
+// analyse the previous one on another, use usbcam_lock_frame instead.
+// Each call dequeues a new frame and gives you a usbcam_frame_t that
+// points directly into the mmap'd buffer. The buffer stays yours until
+// you pass the frame to usbcam_release_frame, which requeues only that
+// buffer. If you hand a frame to more than one consumer, each extra
+// consumer should call usbcam_retain_frame, and the buffer is requeued
+// when the last one releases it. Frames can be released from any thread.
+// Every frame you hold is a buffer the driver can't fill, so request
+// enough buffers for the frames you hold plus the ones in §BUFFERS.
+//   usbcam_frame_t a, b;
+//   usbcam_lock_frame(cam, &a);
+//   usbcam_lock_frame(cam, &b);
+//   ...
+//   usbcam_release_frame(cam, &a);
+//   usbcam_release_frame(cam, &b);
+//
+// §DMABUF
+// If you set export_dmabuf in usbcam_opt_t, each capture buffer is
+// also exported as a DMABUF file descriptor (VIDIOC_EXPBUF), which
+// you get in usbcam_frame_t.dmabuf_fd from usbcam_lock_frame. You can
+// hand that fd to anything that imports DMABUFs, such as a hardware
+// JPEG decoder, an encoder, EGL (EGL_LINUX_DMA_BUF_EXT) or CUDA, and
+// it will read the frame straight out of the capture buffer without
+// a copy through the CPU. The fd is owned by usbcam and stays valid
+// until usbcam_close, but the contents are only yours while you hold
+// the frame. The driver must support VIDIOC_EXPBUF (most drivers built
+// on videobuf2 do, including uvcvideo); if it doesn't, usbcam_init fails.
+//
+// §MEMORY
+// By default (usbcam_memory_mmap) the driver allocates the buffers and
+// we map them into your address space. You can also let the driver
+// write frames into memory that you own, by setting memory in
+// usbcam_opt_t:
+// * usbcam_memory_userptr: Pass an arena of arena_size bytes, e.g. one
+//   that is aligned, backed by huge pages, pinned or allocated on the
+//   right NUMA node. It is split into one page-aligned slice per buffer,
+//   each big enough for one frame (sizeimage). usbcam_init fails if the
+//   arena is too small. Frames point into the arena, and the memory
+//   must stay valid until usbcam_cleanup.
+// * usbcam_memory_dmabuf: Pass one DMABUF fd per buffer in dmabuf_fds,
+//   e.g. allocated by a GPU, an encoder or a DMA heap. We try to map
+//   each one so that frame data is readable from the CPU, but if the
+//   exporter doesn't allow that, data is NULL and you only have
+//   usbcam_frame_t.dmabuf_fd. The fds stay yours.
+// The driver must support the mode (VIDIOC_REQBUFS fails otherwise).
+// export_dmabuf only works with usbcam_memory_mmap.
+//
+// §CAPTURE THREAD
+// If you set threaded in usbcam_opt_t, a thread is started for the
+// camera that dequeues every frame as soon as the driver is done with
+// it, and publishes the newest one in a mailbox. usbcam_lock then
+// takes the newest frame out of the mailbox without making any calls
+// to the driver, and only sleeps if you already got the newest frame.
+// Frames that you never locked are requeued by the capture thread.
+// usbcam_unlock still requeues the frame you held. The capture thread
+// holds one buffer in the mailbox and you hold one, so you need at
+// least three buffers in this mode. See §BUFFERS.
+//
+// §DECODE THREADS
+// If decoding a frame takes longer than the time between two frames,
+// decoding on the thread that calls usbcam_lock will lose frames. Set
+// decode_threads in usbcam_opt_t to start that many workers that take
+// turns dequeuing MJPEG frames and decode them to RGB in parallel,
+// each with its own decompressor and output buffer. The RGB output is
+// decode_width x decode_height (see §DECOMPRESSION), in decode_format
+// (see §OUTPUT FORMATS). usbcam_lock_rgb
+// gives you a decoded frame and usbcam_unlock_rgb gives it back. Frames
+// are delivered in capture order: you get the newest frame for which
+// every older frame is done decoding, so you never get a frame that
+// is older than the previous one. Frames that you skip over because
+// you fell behind are dropped. Each worker holds a buffer while it
+// decodes, so you need more buffers than workers. Don't use
+// usbcam_lock or usbcam_lock_frame on the same camera in this mode.
+// To keep a decoded frame for longer, see §IMAGE POOL.
+//   opt.decode_threads = 3;
+//   opt.buffers = 6;
+//   usbcam_t *cam = usbcam_open(opt);
+//   usbcam_frame_t rgb;
+//   usbcam_lock_rgb(cam, &rgb);
+//   ... rgb.data is decode_width*decode_height*3 bytes (for RGB)
+//   usbcam_unlock_rgb(cam, &rgb);
+//
+// §TIMESTAMPS
+// The timestamp of a frame is whatever the driver put in the buffer,
+// and drivers don't agree on what that is. usbcam_frame_t.flags has
+// the buffer flags, where two fields tell you:
+// * Which clock (flags & V4L2_BUF_FLAG_TIMESTAMP_MASK): usually
+//   V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC, i.e. CLOCK_MONOTONIC, which is
+//   what you should compare against (not CLOCK_REALTIME or
+//   gettimeofday, which jump when the system time is adjusted). Very
+//   old drivers say V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN and use wall time.
+// * Which moment (flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK): the start of
+//   exposure (V4L2_BUF_FLAG_TSTAMP_SRC_SOE, uvcvideo does this) or when
+//   the last byte of the frame arrived (V4L2_BUF_FLAG_TSTAMP_SRC_EOF).
+//   An EOF timestamp is later than the light hit the sensor by the
+//   exposure and readout time, which can be tens of milliseconds, so
+//   subtract your estimate of that before fusing with other sensors.
+// usbcam_timestamp_ns gives you the timestamp in nanoseconds on the
+// CLOCK_MONOTONIC epoch whatever the clock was, converting wall time
+// with the current offset between the two clocks. It doesn't move EOF
+// timestamps, since only you know your exposure. The same conversion
+// is available for the timeval you get from usbcam_lock, together
+// with flags that you get from usbcam_lock_frame.
+//   usbcam_frame_t frame;
+//   usbcam_lock_frame(cam, &frame);
+//   long long t = usbcam_timestamp_ns(&frame);
+//   if ((frame.flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK) == V4L2_BUF_FLAG_TSTAMP_SRC_EOF)
+//       t -= exposure_ns + readout_ns;
+//
+// §STATS
+// usbcam_get_stats tells you where your frames went since the camera
+// was opened (or since usbcam_reset_stats), which is what you need to
+// pick the number of buffers (see §BUFFERS) for a deployment:
+// * delivered: frames you got from a lock, or in an epoll callback.
+// * skipped: frames that were captured fine, but that you never saw
+//   because a newer one was ready when you asked (or, with a capture
+//   or decode thread, arrived before you asked). Lots of these just
+//   mean the camera is faster than you.
+// * sequence_gaps: frames the driver dropped, because it had no empty
+//   buffer to put them in (or the USB bus lost them). If this grows
+//   you need more buffers, or to unlock frames sooner.
+// * corrupted: frames the driver flagged with V4L2_BUF_FLAG_ERROR, or
+//   that the decode threads failed to decode. They are still handed
+//   to you by usbcam_lock, since a partial frame may be better than
+//   none.
+// * latency: histogram of the time from capture (buf.timestamp) to
+//   the moment you got the frame, in CLOCK_MONOTONIC (converted as
+//   in §TIMESTAMPS). latency[0] counts frames under 1 ms, latency[i]
+//   those in [2^(i-1), 2^i) ms and the last bin everything above.
+// * done_latency: the same, but until the frame was done with: when
+//   the decode threads finished decoding it, or when you released a
+//   frame from usbcam_lock_frame (or usbcam_unlock, or an epoll
+//   callback returned). done counts those frames. With decode threads
+//   this is capture to decoded RGB; without them it includes whatever
+//   you did with the frame, which is as close to end-to-end as we see.
+// The counters can be read from any thread while the camera runs.
+//
+// §LOW LATENCY
+// For closed-loop control, what matters is how old a frame is when you
+// are done with it (done_latency in §STATS). Three things help:
+// * Set cpu_mask in usbcam_opt_t to the cores (bit i is CPU i) that the
+//   capture or decode threads may run on, e.g. ones isolated from the
+//   rest of the system, so they aren't moved around or queued behind
+//   other work, and realtime_priority to run them with SCHED_FIFO at
+//   that priority (1-99), so they run as soon as a frame is in. That
+//   needs CAP_SYS_NICE or an RLIMIT_RTPRIO, and only warns if you
+//   don't have it. Both are applied again when the camera reconnects.
+//   Your own thread is yours to pin (pthread_setaffinity_np).
+// * Set buffers to 0 to start with the fewest buffers that work: two,
+//   three with a capture thread, or one more than the decode threads.
+//   Fewer buffers means less to dequeue on every usbcam_lock, and fewer
+//   old frames queued up for the decode threads, but too few and the
+//   driver has nowhere to put new frames while you hold the old ones
+//   (see §BUFFERS).
+// * Call usbcam_tune_buffers every now and then, with no frames held,
+//   and it sets the buffer count from what it measured since the last
+//   call: the longest you (or a decode thread) held a frame, the most
+//   frames you held at once, and the time between frames. Without a
+//   capture thread, that is one buffer for every frame captured while
+//   you hold one, plus the ones you hold and one for the driver to
+//   fill. A capture thread requeues frames for you, so it needs only
+//   your frames plus two, however long you take. It returns the new
+//   count, -EAGAIN until it has seen enough frames, or whatever
+//   usbcam_reconfigure (see §RECONFIGURE) returned. Adding buffers
+//   doesn't stop the stream, but removing them does, so it only
+//   removes them when there are two or more to spare.
+//   opt.buffers = 0;
+//   opt.threaded = 1;
+//   opt.cpu_mask = 1 << 3;
+//   opt.realtime_priority = 50;
+//   usbcam_t *cam = usbcam_open(opt);
+//   ...
+//   if (frame_number % 300 == 0)
+//       usbcam_tune_buffers(cam);
+//
+// §EVENT LOOP
+// Instead of having one thread per camera sit in usbcam_lock, you
+// can serve all cameras from one thread. Register each camera with
+// a callback in a usbcam_epoll_t and call usbcam_epoll_wait in a
+// loop. It sleeps until at least one camera has a frame (or until
+// timeout_ms has passed, -1 waits forever), and then calls the
+// callback of every ready camera with its latest frame. The frame
+// is only valid inside the callback; it is requeued when the
+// callback returns. usbcam_epoll_wait returns the number of frames
+// that were handed to callbacks, or a negative errno code. A camera
+// that is lost (see §ERRORS) is taken out of the loop, and put back
+// in by the first usbcam_epoll_wait after it has reconnected, so use
+// a timeout if you only have one camera. Don't call usbcam_lock on a
+// camera while it is registered.
+//   usbcam_epoll_t *ep = usbcam_epoll_create();
+//   usbcam_epoll_add(ep, left, on_frame, &left_state);
+//   usbcam_epoll_add(ep, right, on_frame, &right_state);
+//   while (running)
+//       usbcam_epoll_wait(ep, -1);
+//   usbcam_epoll_destroy(ep);
+//
+// §SYNC GROUPS
+// Locking each camera on its own gives you each camera's newest frame,
+// which for stereo can be from different moments. A usbcam_sync_t
+// locks frames from each camera in the group as they come in, keeps
+// the last few (depth, 3 if you pass 0), and usbcam_sync_lock gives
+// you the newest tuple where every frame's timestamp (converted as in
+// §TIMESTAMPS) is within tolerance_ns of the first camera's frame.
+// frames must have room for one frame per camera, in the order you
+// gave the cameras. Frames that are older than the tuple, or that
+// can't be matched anymore, are requeued as soon as we know, so the
+// drivers can keep filling them. usbcam_sync_unlock gives the tuple
+// back (retain a frame first to keep it, see §FRAMES), and locking the
+// next tuple unlocks the previous (and warns). It returns -EAGAIN if
+// no tuple lined up by timeout_us, and the error of the camera if one
+// failed, for example -ENODEV while it is lost (see §ERRORS).
+// Cameras that aren't triggered together capture at different phases,
+// so set tolerance_ns to at least half the frame interval, or you may
+// never get a tuple. The cameras must be streaming, without decode
+// threads, and each one needs depth buffers plus the ones in §BUFFERS
+// and §CAPTURE THREAD. Frames the group locked count as delivered in
+// §STATS, matched or not. Don't lock frames from the cameras yourself
+// while they are in a group.
+//   usbcam_t *cams[2] = { left, right };
+//   usbcam_sync_t *sync = usbcam_sync_create(cams, 2, 5000000, 0);
+//   usbcam_frame_t frames[2];
+//   if (usbcam_sync_lock(sync, frames, 100000) == 0)
+//   {
+//       ... frames[0] is from left, frames[1] from right
+//       usbcam_sync_unlock(sync);
+//   }
+//   usbcam_sync_destroy(sync);
+//
 // §DECOMPRESSION
 // You can specify a desired resolution which does not need to
 // match the resolution given in usbcam_init. This will make
 // turbojpeg use its internal downscaling capabilities while
 // also reducing decompression time. If you specfy the same
-// resolution no downscaling happens.
+// resolution no downscaling happens. turbojpeg can only scale by
+// n/8, so the desired resolution must be one that it gives (two
+// thirds of 1280x720 is not): otherwise the functions below return
+// false instead of decoding to the wrong size. 0 means any size in
+// that direction. See §SCALING to get one that works.
 // http://www.libjpeg-turbo.org/Documentation/Documentation
+// Each thread that calls usbcam_jpeg_to_rgb gets its own turbojpeg
+// decompressor the first time it calls it, which is reused for every
+// frame after that and destroyed when the thread exits. If there is a
+// hardware JPEG decoder it is used instead, see §DECODERS.
+//
+// §OUTPUT FORMATS
+// usbcam_jpeg_to_rgb always gives you interleaved RGB, but you can pay
+// less if your pipeline needs something else:
+// * usbcam_jpeg_to_gray gives you one byte of luma per pixel. This is
+//   the cheapest: turbojpeg skips the inverse DCT and upsampling of the
+//   chroma components, and there is no color conversion.
+// * usbcam_jpeg_to_yuv gives you the Y, U and V planes as they are
+//   stored in the JPEG (usually 4:2:2 for webcams), so there is no
+//   upsampling or color conversion. Use usbcam_jpeg_header to get the
+//   subsampling, and tjPlaneWidth/tjPlaneHeight to size each plane.
+//   Pass NULL strides for tightly packed planes.
+// * usbcam_jpeg_to_pixels takes any TJPF_* pixel format, such as
+//   TJPF_RGBA or TJPF_BGRA for texture uploads or TJPF_BGR for OpenCV.
+//   The destination must hold width*height*tjPixelSize[pixel_format] bytes.
+// All of them take the same desired_width and desired_height as
+// usbcam_jpeg_to_rgb (see §DECOMPRESSION).
+//
+// §SCALING
+// turbojpeg scales while decoding by 1/8, 1/4, 3/8, ... 1, ... 2; the
+// smaller the cheaper, since it skips most of the inverse DCT.
+// usbcam_scaled_size picks the smallest of those that gives at least
+// min_width x min_height out of a width x height image, and tells you
+// the size you get:
+//   int w, h;
+//   usbcam_scaled_size(1280, 720, 300, 0, &w, &h); // 320x180
+// A min of 0 doesn't constrain that direction; both 0 give the full
+// size. It returns false if even 2x is too small. The result is always
+// a valid desired_width and desired_height for §DECOMPRESSION and
+// opt.decode_width and opt.decode_height (see §DECODE THREADS).
+// usbcam_jpeg_to_image does the same for one JPEG, and decodes into an
+// image that it (re)allocates when it is too small, so keep one around:
+//   usbcam_image_t image = {0};
+//   while (...)
+//     if (usbcam_jpeg_to_image(300, 0, TJPF_RGB, &image, jpg_data, jpg_size))
+//       ... image.width x image.height pixels at image.data
+//   usbcam_free_image(&image);
+// If you need exactly 300 pixels, resample afterwards: that is cheaper
+// from an image that is only a bit larger than from the full size.
+//
+// §IMAGE POOL
+// To hand decoded frames to other threads without copying them or
+// allocating for every frame, decode into images from a pool. It
+// allocates count images of one size up front, and gives them out with
+// a reference count:
+//   usbcam_pool_t *pool = usbcam_pool_create(640, 360, TJPF_RGB, 8, 0);
+//   usbcam_image_t image;
+//   if (usbcam_jpeg_to_pool(pool, &image, jpg_data, jpg_size) == 0)
+//     ... give image to a thread, which calls usbcam_release_image(&image)
+// usbcam_pool_acquire gives you an image without decoding into it. Both
+// return -EAGAIN when every image is out; nothing is allocated after
+// usbcam_pool_create, so that is where you find out you made the pool
+// too small. usbcam_retain_image adds a reference for every extra
+// thread that keeps a copy of the usbcam_image_t, and each of them
+// calls usbcam_release_image; the image goes back to the pool when the
+// last one does. All of these are thread-safe and lock-free.
+// usbcam_pool_destroy drops your reference to the pool, which is freed
+// when the last image is released. Don't acquire from it after that.
+// The size must be one that turbojpeg can scale to (see §SCALING).
+// Images start on a 64-byte boundary, and so does every row: the
+// stride is rounded up to 64 bytes, so use image.stride rather than
+// width*3 for the next row. Pass usbcam_pool_packed for tightly packed
+// rows, and usbcam_pool_hugepages to put the pool on 2 MB pages, which
+// saves TLB misses when large frames go through several stages. The
+// hugepages come from hugetlbfs if some are reserved
+// (/proc/sys/vm/nr_hugepages), else they are asked for as
+// transparent hugepages, else you get normal pages. Either way the
+// memory is touched when the pool is created, so the first frames don't
+// pay for page faults.
+// With §DECODE THREADS the workers decode into a pool of their own.
+// Set opt.decode_keep to the number of frames that you want to hold on
+// to at most, and call usbcam_keep_rgb instead of usbcam_unlock_rgb:
+//   usbcam_frame_t rgb;
+//   usbcam_lock_rgb(cam, &rgb);
+//   usbcam_image_t kept;
+//   if (usbcam_keep_rgb(cam, &rgb, &kept) == 0)
+//     ... kept is yours until usbcam_release_image(&kept)
+//   else
+//     usbcam_unlock_rgb(cam, &rgb); // -EAGAIN: you already keep decode_keep
+// The workers get a fresh image from the pool in exchange, so they
+// don't wait for you. The rows of these images are packed, as in
+// rgb.data. Kept images stay valid after usbcam_reconfigure and
+// usbcam_cleanup.
+//
+// §REGION OF INTEREST
+// If you only look at part of the image, e.g. a window around where
+// your tracker last saw something, usbcam_jpeg_to_rgb_roi decodes just
+// that rectangle:
+//   unsigned char rgb[200*150*3];
+//   usbcam_jpeg_to_rgb_roi(0, 0, x, y, 200, 150, rgb, jpg_data, jpg_size);
+// x, y, width and height are in pixels of the image that
+// usbcam_jpeg_to_rgb would give you for the same desired_width and
+// desired_height, so you can crop and downscale at once. You get
+// exactly width*height pixels, rows tightly packed, and the same ones
+// that the full image would have there. It returns false if
+// the rectangle doesn't fit in the image. usbcam_jpeg_to_pixels_roi
+// does the same for any TJPF_* format but TJPF_CMYK.
+// JPEG is coded in blocks of 8 or 16 pixels (MCUs) that can only be
+// Huffman decoded one after another, so not everything outside the
+// rectangle is free. Columns are rounded out to whole MCUs and the rest
+// of each row is Huffman decoded but not transformed; rows above are
+// Huffman decoded only, and rows below are not touched at all. So a
+// small rectangle near the top is nearly free, and one near the bottom
+// still costs the Huffman decoding of everything above it.
+// This uses the libjpeg API of libjpeg-turbo (jpeg_crop_scanline and
+// jpeg_skip_scanlines, 1.5 or later), so you need to link with -ljpeg
+// too. Each thread gets its own decompressor, as in §DECOMPRESSION.
+//
+// §DECODERS
+// The functions in §DECOMPRESSION and §OUTPUT FORMATS (but
+// usbcam_jpeg_to_yuv), usbcam_jpeg_to_image, usbcam_jpeg_to_pool and
+// §DECODE THREADS hand the JPEG to a decoder backend. There are two:
+// * "turbojpeg" decodes on the CPU, to any size and format.
+// * "v4l2" uses a V4L2 mem2mem JPEG decoder, the hardware block that
+//   many ARM SoCs have (i.MX8, Exynos, Rockchip, ...), and costs next
+//   to no CPU. It doesn't scale, so you only get it at the full size,
+//   and only for TJPF_RGB, TJPF_BGR and TJPF_GRAY. The device may give
+//   RGB itself, or NV12 or YUYV that we convert (see §RAW FORMATS, but
+//   in the full range that JPEG uses).
+// Whatever a backend can't do goes to turbojpeg, frame by frame, and
+// gives the same image but for rounding in the color conversion and
+// upsampling. By default ("auto") each thread, when it first decodes,
+// takes the first of these that opens: the backends you registered,
+// the first /dev/video* that is a JPEG decoder, turbojpeg. You can
+// name one instead:
+//   usbcam_set_decoder("turbojpeg");          // never use the hardware
+//   usbcam_set_decoder("v4l2:/dev/video12");  // this device
+//   usbcam_set_decoder("auto");
+// It returns -ENOENT for a name that isn't registered. If the backend
+// can't be opened, or it fails while decoding (no frame back within a
+// second, an error from the device, or 8 frames in a row that it
+// couldn't decode) you get a warning and the thread carries on with
+// turbojpeg. Each thread opens its own instance (a mem2mem device
+// gives every open a context of its own), so the §DECODE THREADS keep
+// a frame each in the hardware. usbcam_set_decoder can be called at
+// any time; each thread switches at its next frame.
+// usbcam_decoder_name tells you which backend the calling thread uses.
+// To add your own, e.g. NVJPG through the Jetson Multimedia API, fill
+// in a usbcam_decoder_t and pass it to usbcam_register_decoder, which
+// keeps the pointer:
+// * open is called in each thread that decodes, with what comes after
+//   the ':' in the name (NULL if there is none). Return NULL if it
+//   can't decode here.
+// * decode gets the size that turbojpeg would give for the desired
+//   size, so width and height are never 0, and pitch bytes between
+//   rows (0 means packed). Return -ENOTSUP to have turbojpeg decode
+//   that one.
+// * close is called when the thread exits or switches to another
+//   backend, which it does when decode returns another error.
+//
+// §MJPG
+// Many cameras leave the Huffman table out of their MJPG frames, since
+// they always use the default one from the JPEG standard. That's fine
+// for decoding: turbojpeg falls back to the default table itself, so
+// usbcam_jpeg_to_rgb and friends take the frame straight out of the
+// buffer. But other programs won't open a frame that you save as a
+// .jpg. usbcam_mjpg_to_jpg makes a valid JPG by squeezing the default
+// table into the header:
+// * Pass NULL for jpg to get the size you need, which is at most
+//   mjpg_size + 420. Allocate a buffer of the largest frame size once
+//   (e.g. the buffer length from §BUFFERS + 420) and reuse it.
+// * jpg can be mjpg itself, if there are jpg_capacity bytes there. The
+//   capture buffers are usually bigger than the frames in them.
+// * It returns 0 if jpg_capacity is too small.
+// * If the frame already has a Huffman table it is left alone (and
+//   copied if jpg is another buffer).
+// Only the header is looked at, not the compressed data. To avoid the
+// copy altogether when you write the frame out, ask for the offset
+// where the table goes with usbcam_mjpg_huffman_offset (-1 means none
+// is needed), and write the three pieces with writev:
+//   int at = usbcam_mjpg_huffman_offset(frame.data, frame.size);
+//   unsigned int table_size;
+//   const unsigned char *table = usbcam_mjpg_huffman(&table_size);
+//   ... frame.data[0, at), table, frame.data[at, size)
+//
+// §RECORDING
+// A recorder saves the MJPEG frames as they come from the camera, without
+// decoding them, into AVI files that ordinary players can open:
+//   usbcam_recorder_opt_t ropt = {0};
+//   ropt.path = "video%03d.avi";
+//   ropt.width = 1280;
+//   ropt.height = 720;
+//   usbcam_recorder_t *rec = usbcam_recorder_open(ropt);
+//   ...
+//   usbcam_lock_frame(cam, &frame);
+//   usbcam_record_frame(rec, &frame);
+//   usbcam_release_frame(cam, &frame);
+//   ...
+//   usbcam_recorder_close(rec);
+// usbcam_record copies the frame into a buffer (buffer_size bytes) and
+// returns, so you can release the frame straight away. A background
+// thread writes the buffer to disk, adding the Huffman table each frame
+// needs (see §MJPG) on the way. If the disk falls behind and the buffer
+// is full the frame is dropped and usbcam_record returns -ENOBUFS;
+// usbcam_recorder_dropped counts those. Errors from the writer thread
+// (e.g. a full disk) come back from the next usbcam_record and from
+// usbcam_recorder_close.
+// When a file reaches max_file_size it is finished and the next one is
+// started, if path has a %d in it (otherwise recording stops with
+// -EFBIG). Each file is finished with an idx1 index, for seeking, and a
+// "usbt" chunk that has the CLOCK_MONOTONIC timestamp (nanoseconds) and
+// driver sequence number of every frame, in the same order. The frame
+// rate in the header is the average over the file. A file is only
+// playable once it is finished, so call usbcam_recorder_close.
+// preallocate reserves each file on disk up front (with fallocate) so
+// that the filesystem doesn't have to find space while you record; the
+// unused part is given back when the file is finished.
+// usbcam_record takes a timestamp and sequence number so that you can
+// also record from usbcam_lock, or frames from somewhere else.
+//
+// §PLAYBACK
+// To test or benchmark without a camera, set opt.playback and give a
+// recording as the device_name: an AVI file from §RECORDING, or a
+// directory of .jpg files (such as the videoNNNN.jpg files from
+// test_usbcam). Everything else works as with a camera, including the
+// capture and decode threads and the event loop:
+//   opt.device_name = "video000.avi";
+//   opt.playback = usbcam_playback_fast;
+//   usbcam_t *cam = usbcam_open(opt);
+// width and height must match the recording, and the pixel format must
+// be MJPEG (or JPEG). The recording is mapped into memory and frames
+// point straight into it, so nothing is copied; don't write to them.
+// * usbcam_playback_realtime hands out frames at the pace they were
+//   recorded (from the first usbcam_open). If you fall behind, frames
+//   are dropped just as a camera would drop them, and show up as
+//   sequence_gaps in §STATS.
+// * usbcam_playback_fast hands out the next frame whenever you ask for
+//   one, so usbcam_lock gives you every frame once, as fast as you can
+//   process them. A capture thread or decode threads still skip frames
+//   that you don't lock in time, like a camera that runs faster than
+//   you.
+// Frames have the timestamps and sequence numbers they were recorded
+// with. For a directory, the timestamp is the modification time of the
+// file (wall time, see §TIMESTAMPS), and the sequence number is the
+// number in its name. Latency in §STATS is not counted, since it would
+// be measured against when the frames were recorded. At the end of the
+// recording the camera is lost (see §ERRORS): usbcam_lock returns
+// -ENODEV, or with opt.reconnect it starts over from the beginning.
+//
+// §RAW FORMATS
+// At low resolutions many cameras can also send uncompressed frames,
+// such as V4L2_PIX_FMT_YUYV (packed 4:2:2) or V4L2_PIX_FMT_NV12 (a Y
+// plane followed by an interleaved UV plane at half resolution). That
+// saves the JPEG decode entirely. usbcam_yuyv_to_gray, usbcam_yuyv_to_rgb
+// and usbcam_nv12_to_rgb convert those straight out of the buffer you
+// got from usbcam_lock. stride is the number of bytes between rows in
+// the source (bytesperline), or 0 if rows are tightly packed. The width
+// must be even. They use SSE2 (and SSSE3/AVX2 where it helps) on x86 and
+// NEON on ARM if you compile with support for them (e.g. -mavx2 or
+// -march=native), and fall back to plain C otherwise. All paths give
+// exactly the same output (BT.601, limited range).
 //
 // §BUILDING
 // STEP 1) Get the video 4 linux 2 development libraries (v4l2)
@@ -71,7 +920,7 @@ bool usbcam_jpeg_to_rgb(int desired_width, int desired_height, unsigned char *rg
 //   $ make
 //   $ make install prefix=/usr/local libdir=/usr/local/lib64
 // STEP 3) Compiler flags
-//   g++ ... -lv4l2 -lturbojpeg
+//   g++ ... -lv4l2 -lturbojpeg -ljpeg -pthread
 
 //
 // Implementation
@@ -82,266 +931,4787 @@ bool usbcam_jpeg_to_rgb(int desired_width, int desired_height, unsigned char *rg
 #include <sys/time.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <linux/videodev2.h>
 #include <libv4l2.h>
 #include <turbojpeg.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define usbcam_max_buffers 128
-#define usbcam_assert(CONDITION, ...) { if (!(CONDITION)) { printf("[usbcam.h line %d] ", __LINE__); printf(__VA_ARGS__); printf("\n"); exit(EXIT_FAILURE); } }
+#define usbcam_max_cameras 32
+#define usbcam_max_decode_threads 16
+#define usbcam_tune_min_frames 30 // frames usbcam_tune_buffers measures before it decides
 #define usbcam_warn(...) { printf("[usbcam.h line %d] ", __LINE__); printf(__VA_ARGS__); printf("\n"); }
+#define usbcam_check(CONDITION, ERROR, ...) { if (!(CONDITION)) { int usbcam_error = (ERROR); usbcam_warn(__VA_ARGS__); return usbcam_error; } }
+#define usbcam_try(CALL) { int usbcam_result = (CALL); if (usbcam_result < 0) return usbcam_result; }
 #ifdef USBCAM_DEBUG
 #define usbcam_debug(...) { printf("[usbcam.h line %d] ", __LINE__); printf(__VA_ARGS__); printf("\n"); }
 #else
 #define usbcam_debug(...) { }
 #endif
 
-static int          usbcam_has_mmap = 0;
-static int          usbcam_has_lock = 0;
-static int          usbcam_has_fd = 0;
-static int          usbcam_has_stream = 0;
-static int          usbcam_fd = 0;
-static int          usbcam_buffers = 0;
-static void        *usbcam_buffer_start[usbcam_max_buffers] = {0};
-static unsigned int usbcam_buffer_length[usbcam_max_buffers] = {0};
-static v4l2_buffer  usbcam_lock_buf = {0};
+#define usbcam_max_backoff_ms 64 // how long we wait on EAGAIN before giving up
+#define usbcam_reconnect_min_ms 250
+#define usbcam_reconnect_max_ms 4000
+#define usbcam_mailbox_lost -2 // see usbcam_device_lost
+#define usbcam_max_controls 32 // per usbcam_set_controls
 
-void usbcam_ioctl(int request, void *arg)
+enum
 {
-    usbcam_assert(usbcam_has_fd, "The camera device has not been opened yet!");
-    int r;
-    do
-    {
-        r = v4l2_ioctl(usbcam_fd, request, arg);
-    } while (r == -1 && ((errno == EINTR) || (errno == EAGAIN)));
-    if (r == -1)
-    {
-        printf("[usbcam.h] USB request failed (%d): %s\n", errno, strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+    usbcam_slot_free = 0,
+    usbcam_slot_decoding,
+    usbcam_slot_ready,
+    usbcam_slot_locked
+};
+
+struct usbcam_decode_slot_t
+{
+    int            state;
+    int            ok; // false if the frame could not be decoded
+    unsigned int   ticket; // order in which the frame was dequeued
+    usbcam_frame_t frame;
+    usbcam_image_t image; // where frame.data points, from decode_pool
+};
+
+struct usbcam_playback_t;
+
+struct usbcam_t
+{
+    int          has_mmap;
+    int          has_lock;
+    int          has_fd;
+    int          has_stream;
+    int          fd;
+    int          buffers;
+    void        *buffer_start[usbcam_max_buffers];
+    unsigned int buffer_length[usbcam_max_buffers];
+    int          buffer_dmabuf[usbcam_max_buffers]; // See §DMABUF
+    int          has_dmabuf;
+    unsigned int memory; // V4L2_MEMORY_*, see §MEMORY
+    usbcam_frame_t lock_frame; // used by usbcam_lock/usbcam_unlock
+
+    // See §FRAMES
+    v4l2_buffer  dequeued_buf[usbcam_max_buffers]; // state of buffers we hold
+    int          refcount[usbcam_max_buffers];
+    int          frames_held;
+
+    // See §CAPTURE THREAD
+    int          has_thread;
+    pthread_t    thread;
+    int          thread_wakeup; // eventfd used to stop the thread
+    int          mailbox; // index of the newest unlocked buffer, -1 or usbcam_mailbox_lost
+
+    // See §DECODE THREADS
+    int             decode_threads;
+    int             decode_running; // workers are started
+    int             decode_width;
+    int             decode_height;
+    int             decode_format;
+    int             decode_quit;
+    pthread_t       decode_thread[usbcam_max_decode_threads];
+    pthread_mutex_t dequeue_mutex; // gives one worker at a time access to DQBUF
+    pthread_mutex_t decode_mutex; // protects the slots and tickets
+    pthread_cond_t  decode_cond; // signalled when a slot changes state
+    unsigned int    next_ticket;
+    usbcam_decode_slot_t decode_slot[usbcam_max_decode_threads+2];
+    usbcam_pool_t  *decode_pool;
+
+    // See §STATS
+    usbcam_stats_t  stats;
+    unsigned int    last_sequence;
+    int             has_sequence; // false until the first frame after opening
+
+    // See §LOW LATENCY, measured since the last usbcam_tune_buffers
+    long long          locked_ns[usbcam_max_buffers]; // when you locked each buffer
+    unsigned long long hold_max_ns; // longest a buffer was out of the driver
+    unsigned long long held_max; // most frames you held at once
+    unsigned int       interval_frames; // frames dequeued, from first_ns to last_ns
+    long long          first_ns;
+    long long          last_ns;
+    unsigned int       first_sequence; // to count the frames the driver dropped since
+
+    // See §ERRORS
+    usbcam_opt_t    opt; // what we were opened with, to reconnect
+    int             lost; // the device is gone (or broken) until this is cleared
+    int             has_reconnect;
+    int             reconnect_quit;
+    int             reconnect_wakeup; // eventfd used to stop reconnecting
+    pthread_t       reconnect_thread;
+    pthread_mutex_t reconnect_mutex; // protects has_reconnect and reconnect_quit
+
+    // See §PLAYBACK
+    usbcam_playback_t *playback; // stands in for the device when opt.playback is set
+};
+
+static usbcam_t usbcam_default = {0};
+
+//
+// Playback (see §PLAYBACK)
+//
+
+struct usbcam_playback_frame_t
+{
+    unsigned char *data; // in the mapped recording, or its own mapping for a directory
+    unsigned int   size;
+    long long      timestamp_ns; // as recorded
+    unsigned int   sequence;
+};
+
+// A recording that pretends to be a V4L2 device: usbcam_ioctl sends
+// requests here instead, and fd is a timerfd that is readable whenever
+// a DQBUF would succeed.
+struct usbcam_playback_t
+{
+    int                      mode; // usbcam_playback_*
+    int                      fd;
+    unsigned char           *map; // the AVI file, or NULL for a directory
+    size_t                   map_size;
+    usbcam_playback_frame_t *frames;
+    int                      count;
+    int                      next; // the next frame to hand out
+    unsigned int             width;
+    unsigned int             height;
+    unsigned int             max_size;
+    unsigned int             flags; // V4L2_BUF_FLAG_TIMESTAMP_* of the recorded timestamps
+    int                      buffers;
+    int                      queued[usbcam_max_buffers];
+    int                      streaming;
+    long long                start_ns; // when STREAMON was called
+    pthread_mutex_t          mutex; // requests can come from several threads
+};
+
+static inline unsigned int usbcam_get_u32(const unsigned char *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24); }
+static inline unsigned long long usbcam_get_u64(const unsigned char *p) { return usbcam_get_u32(p) | ((unsigned long long)usbcam_get_u32(p+4) << 32); }
+
+long long usbcam_now_ns()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec*1000000000 + now.tv_nsec;
 }
 
-void usbcam_cleanup()
+int usbcam_playback_add_frame(usbcam_playback_t *pb, int *capacity, unsigned char *data, unsigned int size, long long timestamp_ns, unsigned int sequence)
 {
-    // return any buffers we have dequeued (not sure if this is necessary)
-    if (usbcam_has_lock)
+    if (pb->count == *capacity)
     {
-        usbcam_debug("Requeuing buffer");
-        usbcam_ioctl(VIDIOC_QBUF, &usbcam_lock_buf);
-        usbcam_has_lock = 0;
+        int n = *capacity ? 2*(*capacity) : 1024;
+        usbcam_playback_frame_t *frames = (usbcam_playback_frame_t*)realloc(pb->frames, n*sizeof(usbcam_playback_frame_t));
+        usbcam_check(frames, -ENOMEM, "Failed to allocate memory for the playback index");
+        pb->frames = frames;
+        *capacity = n;
     }
+    usbcam_playback_frame_t *f = &pb->frames[pb->count++];
+    f->data = data;
+    f->size = size;
+    f->timestamp_ns = timestamp_ns;
+    f->sequence = sequence;
+    if (size > pb->max_size)
+        pb->max_size = size;
+    return 0;
+}
 
-    // free buffers
-    if (usbcam_has_mmap)
+// Finds the frames in an AVI file (e.g. from usbcam_recorder_t), using
+// the usbt chunk for timestamps if there is one
+int usbcam_playback_open_avi(usbcam_playback_t *pb, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    usbcam_check(fd >= 0, -errno, "Failed to open recording %s (%d): %s", path, errno, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 12)
     {
-        usbcam_debug("Deallocating mmap");
-        for (int i = 0; i < usbcam_buffers; i++)
-            munmap(usbcam_buffer_start[i], usbcam_buffer_length[i]);
-        usbcam_has_mmap = 0;
+        close(fd);
+        usbcam_check(0, -EINVAL, "%s is not an AVI file", path);
     }
+    pb->map_size = (size_t)st.st_size;
+    void *map = mmap(NULL, pb->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error = errno;
+    close(fd);
+    usbcam_check(map != MAP_FAILED, -error, "Failed to map recording %s (%d): %s", path, error, strerror(error));
+    pb->map = (unsigned char*)map;
+    madvise(pb->map, pb->map_size, MADV_SEQUENTIAL);
 
-    // turn off streaming
-    if (usbcam_has_stream)
+    unsigned char *d = pb->map;
+    size_t n = pb->map_size;
+    usbcam_check(memcmp(d, "RIFF", 4) == 0 && memcmp(d+8, "AVI ", 4) == 0, -EINVAL, "%s is not an AVI file", path);
+
+    unsigned int us_per_frame = 33333;
+    const unsigned char *times = NULL;
+    unsigned int times_count = 0;
+    int capacity = 0;
+
+    // walk the top level chunks, and the hdrl and movi lists inside them
+    size_t end = n;
+    for (size_t at = 12; at + 8 <= end; )
     {
-        usbcam_debug("Turning off stream (if this freezes send me a message)");
-        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        usbcam_ioctl(VIDIOC_STREAMOFF, &type);
-        usbcam_has_stream = 0;
+        unsigned int size = usbcam_get_u32(d+at+4);
+        if (size > end - at - 8)
+            size = (unsigned int)(end - at - 8); // the last chunk of an unfinished file
+        unsigned char *data = d+at+8;
+        if (memcmp(d+at, "LIST", 4) == 0 && size >= 4)
+        {
+            if (memcmp(data, "hdrl", 4) == 0 || memcmp(data, "movi", 4) == 0)
+            {
+                at += 12; // go inside
+                continue;
+            }
+        }
+        else if (memcmp(d+at, "avih", 4) == 0 && size >= 40)
+        {
+            if (usbcam_get_u32(data))
+                us_per_frame = usbcam_get_u32(data);
+            pb->width = usbcam_get_u32(data+32);
+            pb->height = usbcam_get_u32(data+36);
+        }
+        else if (memcmp(d+at+2, "dc", 2) == 0 || memcmp(d+at+2, "db", 2) == 0)
+        {
+            if (size > 0)
+                usbcam_try(usbcam_playback_add_frame(pb, &capacity, data, size, (long long)pb->count*us_per_frame*1000, pb->count));
+        }
+        else if (memcmp(d+at, "usbt", 4) == 0)
+        {
+            times = data;
+            times_count = size / 16;
+        }
+        at += 8 + size + (size & 1);
     }
+    usbcam_check(pb->count > 0, -EINVAL, "%s has no frames", path);
 
-    if (usbcam_has_fd)
+    if (times && times_count == (unsigned int)pb->count)
     {
-        usbcam_debug("Closing fd");
-        close(usbcam_fd);
-        usbcam_has_fd = 0;
+        for (int i = 0; i < pb->count; i++)
+        {
+            pb->frames[i].timestamp_ns = (long long)usbcam_get_u64(times + 16*i);
+            pb->frames[i].sequence = usbcam_get_u32(times + 16*i + 8);
+        }
     }
+    pb->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    return 0;
 }
 
-void usbcam_init(usbcam_opt_t opt)
+int usbcam_compare_names(const void *a, const void *b)
 {
-    usbcam_cleanup();
-    usbcam_assert(opt.buffers <= usbcam_max_buffers, "You requested too many buffers");
-    usbcam_assert(opt.buffers > 0, "You need atleast one buffer");
+    return strcmp(*(char**)a, *(char**)b);
+}
 
-    // Open the device
-    usbcam_fd = v4l2_open(opt.device_name, O_RDWR, 0);
-    usbcam_assert(usbcam_fd >= 0, "Failed to open device");
-    usbcam_has_fd = 1;
+// Maps every .jpg file in a directory (e.g. from test_usbcam's
+// WRITE_TO_FILE), in name order, with their modification time as the
+// timestamp and the number in their name as the sequence number
+int usbcam_playback_open_directory(usbcam_playback_t *pb, const char *path)
+{
+    DIR *dir = opendir(path);
+    usbcam_check(dir, -errno, "Failed to open %s (%d): %s", path, errno, strerror(errno));
+    char **names = NULL;
+    int count = 0, capacity = 0;
+    int r = 0;
+    while (dirent *entry = readdir(dir))
+    {
+        size_t length = strlen(entry->d_name);
+        if (length < 4 || strcmp(entry->d_name + length - 4, ".jpg") != 0)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? 2*capacity : 1024;
+            char **more = (char**)realloc(names, capacity*sizeof(char*));
+            if (!more) { r = -ENOMEM; break; }
+            names = more;
+        }
+        if (!(names[count] = strdup(entry->d_name))) { r = -ENOMEM; break; }
+        count++;
+    }
+    closedir(dir);
+    if (count > 0)
+        qsort(names, count, sizeof(char*), usbcam_compare_names);
 
-    // set format
+    capacity = 0;
+    for (int i = 0; i < count && r == 0; i++)
     {
-        v4l2_format fmt = {0};
-        fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        fmt.fmt.pix.pixelformat = opt.pixel_format;
-        fmt.fmt.pix.width = opt.width;
-        fmt.fmt.pix.height = opt.height;
-        usbcam_ioctl(VIDIOC_S_FMT, &fmt);
+        char file[4096];
+        snprintf(file, sizeof(file), "%s/%s", path, names[i]);
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            r = -errno;
+            usbcam_warn("Failed to open %s (%d): %s", file, errno, strerror(errno));
+        }
+        else if (st.st_size > 0)
+        {
+            void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED)
+            {
+                r = -errno;
+                usbcam_warn("Failed to map %s (%d): %s", file, errno, strerror(errno));
+            }
+            else
+            {
+                const char *digits = names[i] + strcspn(names[i], "0123456789");
+                unsigned int sequence = *digits ? (unsigned int)strtoul(digits, NULL, 10) : (unsigned int)i;
+                long long timestamp_ns = (long long)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+                if ((r = usbcam_playback_add_frame(pb, &capacity, (unsigned char*)map, (unsigned int)st.st_size, timestamp_ns, sequence)) < 0)
+                    munmap(map, (size_t)st.st_size);
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+    for (int i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+    if (r < 0)
+        return r;
+    usbcam_check(pb->count > 0, -EINVAL, "%s has no .jpg files", path);
 
-        usbcam_assert(fmt.fmt.pix.pixelformat == opt.pixel_format, "Did not get the requested format");
-        usbcam_assert(fmt.fmt.pix.width == opt.width, "Did not get the requested width");
-        usbcam_assert(fmt.fmt.pix.height == opt.height, "Did not get the requested height");
+    int width, height, subsamp;
+    usbcam_check(usbcam_jpeg_header(pb->frames[0].data, pb->frames[0].size, &width, &height, &subsamp), -EINVAL,
+                 "Could not read the size of the first frame in %s", path);
+    pb->width = width;
+    pb->height = height;
+    pb->flags = V4L2_BUF_FLAG_TIMESTAMP_UNKNOWN; // wall time, see §TIMESTAMPS
+    return 0;
+}
+
+void usbcam_playback_close(usbcam_playback_t *pb)
+{
+    if (!pb)
+        return;
+    if (pb->map)
+        munmap(pb->map, pb->map_size);
+    else
+        for (int i = 0; i < pb->count; i++)
+            munmap(pb->frames[i].data, pb->frames[i].size);
+    if (pb->fd >= 0)
+        close(pb->fd);
+    pthread_mutex_destroy(&pb->mutex);
+    free(pb->frames);
+    free(pb);
+}
+
+// Opens a recording in place of a device, and returns the fd to poll
+int usbcam_playback_open(usbcam_t *cam, const char *path, int mode)
+{
+    usbcam_playback_t *pb = (usbcam_playback_t*)calloc(1, sizeof(usbcam_playback_t));
+    usbcam_check(pb, -ENOMEM, "Failed to allocate playback");
+    pb->mode = mode;
+    pthread_mutex_init(&pb->mutex, NULL);
+    pb->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int r = pb->fd >= 0 ? 0 : -errno;
+    if (r < 0)
+        usbcam_warn("Failed to create timerfd (%d): %s", errno, strerror(errno));
+    if (r == 0)
+    {
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            r = usbcam_playback_open_directory(pb, path);
+        else
+            r = usbcam_playback_open_avi(pb, path);
     }
+    if (r < 0)
+    {
+        usbcam_playback_close(pb);
+        return r;
+    }
+    usbcam_debug("Opened recording %s (%d frames)", path, pb->count);
+    cam->playback = pb;
+    return pb->fd;
+}
+
+// When the next frame is due, on the CLOCK_MONOTONIC epoch
+long long usbcam_playback_due_ns(usbcam_playback_t *pb, int index)
+{
+    if (pb->mode == usbcam_playback_fast)
+        return 0;
+    return pb->start_ns + (pb->frames[index].timestamp_ns - pb->frames[0].timestamp_ns);
+}
 
-    usbcam_debug("Opened device (%s %dx%d)", opt.device_name, opt.width, opt.height);
+// Makes the fd readable when a DQBUF would succeed (or fail for good at the end)
+void usbcam_playback_arm(usbcam_playback_t *pb)
+{
+    int queued = 0;
+    for (int i = 0; i < pb->buffers; i++)
+        queued += pb->queued[i];
 
-    // tell the driver how many buffers we want
+    itimerspec t = {0};
+    int flags = 0;
+    if (!pb->streaming || (pb->next < pb->count && !queued) || (pb->next >= pb->count && queued < pb->buffers))
+        ; // disarmed
+    else if (pb->next >= pb->count || usbcam_playback_due_ns(pb, pb->next) <= usbcam_now_ns())
+        t.it_value.tv_nsec = 1; // now
+    else
     {
-        v4l2_requestbuffers request = {0};
-        request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        request.memory = V4L2_MEMORY_MMAP;
-        request.count = opt.buffers;
-        usbcam_ioctl(VIDIOC_REQBUFS, &request);
+        long long due = usbcam_playback_due_ns(pb, pb->next);
+        t.it_value.tv_sec = due / 1000000000;
+        t.it_value.tv_nsec = due % 1000000000;
+        flags = TFD_TIMER_ABSTIME;
+    }
+    timerfd_settime(pb->fd, flags, &t, NULL);
+}
+
+int usbcam_playback_dequeue(usbcam_playback_t *pb, usbcam_t *cam, v4l2_buffer *buf)
+{
+    if (!pb->streaming)
+        return -EINVAL;
 
-        usbcam_assert(request.count == opt.buffers, "Did not get the requested number of buffers");
+    int index = -1, queued = 0;
+    for (int i = 0; i < pb->buffers; i++)
+    {
+        if (pb->queued[i] && index < 0)
+            index = i;
+        queued += pb->queued[i];
     }
 
-    // allocate buffers
-    for (int i = 0; i < opt.buffers; i++)
+    // the end of the recording is like unplugging the camera, once the
+    // last frames have been given back
+    if (pb->next >= pb->count)
+        return queued < pb->buffers ? -EAGAIN : -ENODEV;
+    if (index < 0)
+        return -EAGAIN;
+
+    if (pb->mode == usbcam_playback_realtime)
     {
-        v4l2_buffer info = {0};
-        info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        info.memory = V4L2_MEMORY_MMAP;
-        info.index = i;
-        usbcam_ioctl(VIDIOC_QUERYBUF, &info);
+        // like a driver, only keep as many frames as there are buffers to
+        // put them in, and drop the older ones
+        long long now = usbcam_now_ns();
+        if (usbcam_playback_due_ns(pb, pb->next) > now)
+            return -EAGAIN;
+        int due = pb->next;
+        while (due + 1 < pb->count && usbcam_playback_due_ns(pb, due + 1) <= now)
+            due++;
+        if (due - pb->next + 1 > queued)
+            pb->next = due - queued + 1;
+    }
 
-        usbcam_buffer_length[i] = info.length;
-        usbcam_buffer_start[i] = mmap(
-            NULL,
-            info.length,
-            PROT_READ | PROT_WRITE,
-            MAP_SHARED,
-            usbcam_fd,
-            info.m.offset
-        );
+    usbcam_playback_frame_t *f = &pb->frames[pb->next++];
+    pb->queued[index] = 0;
+    cam->buffer_start[index] = f->data; // no copy
+    cam->buffer_length[index] = f->size;
+    buf->index = index;
+    buf->bytesused = f->size;
+    buf->length = f->size;
+    buf->sequence = f->sequence;
+    buf->flags = pb->flags;
+    buf->field = V4L2_FIELD_NONE;
+    buf->timestamp.tv_sec = (time_t)(f->timestamp_ns / 1000000000);
+    buf->timestamp.tv_usec = (suseconds_t)((f->timestamp_ns % 1000000000) / 1000);
+    return 0;
+}
 
-        usbcam_assert(usbcam_buffer_start[i] != MAP_FAILED, "Failed to allocate memory for buffers");
+int usbcam_playback_ioctl(usbcam_t *cam, int request, void *arg)
+{
+    usbcam_playback_t *pb = cam->playback;
+    int r = 0;
+    pthread_mutex_lock(&pb->mutex);
+    if (request == (int)VIDIOC_S_FMT)
+    {
+        v4l2_format *fmt = (v4l2_format*)arg;
+        if (fmt->fmt.pix.pixelformat != V4L2_PIX_FMT_JPEG)
+            fmt->fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
+        fmt->fmt.pix.width = pb->width;
+        fmt->fmt.pix.height = pb->height;
+        fmt->fmt.pix.sizeimage = pb->max_size;
+    }
+    else if (request == (int)VIDIOC_REQBUFS)
+    {
+        v4l2_requestbuffers *request = (v4l2_requestbuffers*)arg;
+        if (request->memory != V4L2_MEMORY_MMAP)
+            r = -EINVAL;
+        else
+        {
+            if (request->count > usbcam_max_buffers)
+                request->count = usbcam_max_buffers;
+            pb->buffers = (int)request->count;
+            memset(pb->queued, 0, sizeof(pb->queued));
+        }
+    }
+    else if (request == (int)VIDIOC_STREAMON)
+    {
+        pb->streaming = 1;
+        pb->next = 0;
+        pb->start_ns = usbcam_now_ns();
+    }
+    else if (request == (int)VIDIOC_STREAMOFF)
+    {
+        pb->streaming = 0;
+        memset(pb->queued, 0, sizeof(pb->queued));
+    }
+    else if (request == (int)VIDIOC_QBUF)
+    {
+        v4l2_buffer *buf = (v4l2_buffer*)arg;
+        if (buf->index >= (unsigned int)pb->buffers || pb->queued[buf->index])
+            r = -EINVAL;
+        else
+            pb->queued[buf->index] = 1;
     }
+    else if (request == (int)VIDIOC_DQBUF)
+        r = usbcam_playback_dequeue(pb, cam, (v4l2_buffer*)arg);
+    else
+        r = -ENOTTY; // controls and such don't mean anything here
+    usbcam_playback_arm(pb);
+    pthread_mutex_unlock(&pb->mutex);
+    return r;
+}
 
-    usbcam_buffers = opt.buffers;
-    usbcam_has_mmap = 1;
+// Returns 0 or -errno. EINTR is retried, and EAGAIN is retried after
+// sleeping with a growing backoff instead of spinning on the driver,
+// except from VIDIOC_DQBUF, where it just means there is no frame yet.
+int usbcam_ioctl(usbcam_t *cam, int request, void *arg)
+{
+    usbcam_check(cam->has_fd, -EBADF, "The camera device has not been opened yet!");
+    if (cam->playback)
+        return usbcam_playback_ioctl(cam, request, arg);
+    int backoff_ms = 1;
+    for (;;)
+    {
+        if (v4l2_ioctl(cam->fd, request, arg) != -1)
+            return 0;
+        int error = errno;
+        if (error == EINTR)
+            continue;
+        if (error == EAGAIN && request == (int)VIDIOC_DQBUF) // no frame yet, callers decide how to wait
+            return -EAGAIN;
+        if (error == EAGAIN && backoff_ms <= usbcam_max_backoff_ms)
+        {
+            poll(NULL, 0, backoff_ms);
+            backoff_ms *= 2;
+            continue;
+        }
+        if (!__atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE)) // don't repeat ourselves once it's gone
+            usbcam_warn("USB request failed (%d): %s", error, strerror(error));
+        return -error;
+    }
+}
 
-    // start streaming
+// Absolute CLOCK_MONOTONIC time timeout_us from now (for timeouts that survive retries)
+timespec usbcam_deadline(int timeout_us)
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    if (timeout_us > 0)
     {
-        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        usbcam_ioctl(VIDIOC_STREAMON, &type);
+        t.tv_sec += timeout_us / 1000000;
+        t.tv_nsec += (timeout_us % 1000000)*1000;
+        if (t.tv_nsec >= 1000000000)
+        {
+            t.tv_sec++;
+            t.tv_nsec -= 1000000000;
+        }
     }
+    return t;
+}
+
+int usbcam_is_device_error(int error)
+{
+    return error == -ENODEV || error == -EIO || error == -ENXIO;
+}
 
-    usbcam_has_stream = 1;
+void usbcam_stop_threads(usbcam_t *cam)
+{
+    // stop the capture thread before touching the buffers it uses
+    if (cam->has_thread)
+    {
+        usbcam_debug("Stopping capture thread");
+        uint64_t one = 1;
+        if (write(cam->thread_wakeup, &one, sizeof(one)) != sizeof(one))
+            usbcam_warn("Failed to signal capture thread");
+        pthread_join(cam->thread, NULL);
+        close(cam->thread_wakeup);
+        cam->has_thread = 0;
+    }
 
-    // queue buffers
-    for (int i = 0; i < opt.buffers; i++)
+    if (cam->decode_running)
     {
-        v4l2_buffer info = {0};
-        info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        info.memory = V4L2_MEMORY_MMAP;
-        info.index = i;
-        usbcam_ioctl(VIDIOC_QBUF, &info);
+        usbcam_debug("Stopping decode threads");
+        pthread_mutex_lock(&cam->decode_mutex);
+        cam->decode_quit = 1;
+        pthread_cond_broadcast(&cam->decode_cond);
+        pthread_mutex_unlock(&cam->decode_mutex);
+        uint64_t one = 1;
+        if (write(cam->thread_wakeup, &one, sizeof(one)) != sizeof(one))
+            usbcam_warn("Failed to signal decode threads");
+        for (int i = 0; i < cam->decode_running; i++)
+            pthread_join(cam->decode_thread[i], NULL);
+        close(cam->thread_wakeup);
+        cam->decode_running = 0;
     }
 }
 
-void usbcam_unlock()
+// Undoes usbcam_start_stream, leaving the device open
+void usbcam_stop_stream(usbcam_t *cam)
 {
-    if (usbcam_has_lock)
+    int lost = __atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE);
+
+    if (cam->has_dmabuf)
     {
-        usbcam_ioctl(VIDIOC_QBUF, &usbcam_lock_buf);
-        usbcam_has_lock = 0;
+        usbcam_debug("Closing DMABUF fds");
+        for (int i = 0; i < cam->buffers; i++)
+            if (cam->buffer_dmabuf[i] >= 0)
+                close(cam->buffer_dmabuf[i]);
+        cam->has_dmabuf = 0;
     }
-    else
+
+    // free buffers (userptr memory belongs to the user)
+    if (cam->has_mmap)
     {
-        usbcam_warn("You already unlocked the frame");
+        usbcam_debug("Deallocating mmap");
+        if (cam->memory != V4L2_MEMORY_USERPTR && !cam->playback)
+            for (int i = 0; i < cam->buffers; i++)
+                if (cam->buffer_start[i])
+                    munmap(cam->buffer_start[i], cam->buffer_length[i]);
+        cam->has_mmap = 0;
+    }
+
+    // turn off streaming
+    if (cam->has_stream)
+    {
+        usbcam_debug("Turning off stream (if this freezes send me a message)");
+        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (!lost)
+            usbcam_ioctl(cam, VIDIOC_STREAMOFF, &type);
+        cam->has_stream = 0;
     }
 }
 
-void usbcam_lock(unsigned char **data, unsigned int *size, timeval *timestamp)
+// Undoes usbcam_open_device. The threads must be stopped.
+void usbcam_close_device(usbcam_t *cam)
 {
-    usbcam_assert(usbcam_has_fd, "Camera device not open");
-    usbcam_assert(usbcam_has_mmap, "Buffers not allocated");
-    usbcam_assert(usbcam_has_stream, "Stream not begun");
+    usbcam_stop_stream(cam);
+    if (cam->has_fd)
+    {
+        usbcam_debug("Closing fd");
+        if (cam->playback)
+            usbcam_playback_close(cam->playback); // closes the fd
+        else
+            close(cam->fd);
+        cam->playback = NULL;
+        cam->has_fd = 0;
+    }
+}
 
-    if (usbcam_has_lock)
+void usbcam_cleanup(usbcam_t *cam)
+{
+    // nobody may start reconnecting after this
+    if (cam->opt.reconnect)
     {
-        // you should unlock frames as soon as you are done processing them for best performance
-        usbcam_warn("You did not unlock the previous frame");
-        usbcam_unlock();
+        pthread_mutex_lock(&cam->reconnect_mutex);
+        cam->reconnect_quit = 1;
+        int has_reconnect = cam->has_reconnect;
+        cam->has_reconnect = 0;
+        pthread_mutex_unlock(&cam->reconnect_mutex);
+        if (has_reconnect)
+        {
+            usbcam_debug("Stopping reconnect thread");
+            uint64_t one = 1;
+            if (write(cam->reconnect_wakeup, &one, sizeof(one)) != sizeof(one))
+                usbcam_warn("Failed to signal reconnect thread");
+            pthread_join(cam->reconnect_thread, NULL);
+        }
     }
 
-    // dequeue all the buffers and select the one with latest data
-    v4l2_buffer buf = {0};
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
+    usbcam_stop_threads(cam);
+
+    // return any buffers we have dequeued (not sure if this is necessary)
+    if (cam->frames_held > 0)
     {
-        // get a buffer
-        usbcam_ioctl(VIDIOC_DQBUF, &buf);
-
-        // check if there are more buffers available
-        int r = 1;
-        while (r == 1)
-        {
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(usbcam_fd, &fds);
-            timeval tv; // if both fields = 0, select returns immediately
-            tv.tv_sec = 0;
-            tv.tv_usec = 0;
-            r = select(usbcam_fd + 1, &fds, NULL, NULL, &tv); // todo: what if r == -1?
-            if (r == 1)
+        usbcam_debug("Requeuing buffers");
+        for (int i = 0; i < cam->buffers; i++)
+        {
+            if (cam->refcount[i] > 0)
             {
-                // queue the previous buffer
-                usbcam_ioctl(VIDIOC_QBUF, &buf);
-
-                // get a new buffer
-                usbcam_ioctl(VIDIOC_DQBUF, &buf);
+                if (!cam->lost && cam->has_stream)
+                    usbcam_ioctl(cam, VIDIOC_QBUF, &cam->dequeued_buf[i]);
+                cam->refcount[i] = 0;
             }
         }
+        cam->frames_held = 0;
     }
+    cam->has_lock = 0;
+
+    usbcam_close_device(cam);
 
-    *timestamp = buf.timestamp;
-    *data = (unsigned char*)usbcam_buffer_start[buf.index];
-    *size = buf.bytesused;
+    if (cam->decode_threads > 0)
+    {
+        for (int i = 0; i < cam->decode_threads+2; i++)
+            if (cam->decode_slot[i].image.pool)
+                usbcam_release_image(&cam->decode_slot[i].image);
+        memset(cam->decode_slot, 0, sizeof(cam->decode_slot));
+        if (cam->decode_pool)
+            usbcam_pool_destroy(cam->decode_pool); // for good once the kept frames are released
+        cam->decode_pool = NULL;
+        pthread_mutex_destroy(&cam->dequeue_mutex);
+        pthread_mutex_destroy(&cam->decode_mutex);
+        pthread_cond_destroy(&cam->decode_cond);
+        cam->decode_threads = 0;
+    }
 
-    usbcam_lock_buf = buf;
-    usbcam_has_lock = 1;
+    if (cam->opt.reconnect)
+    {
+        close(cam->reconnect_wakeup);
+        pthread_mutex_destroy(&cam->reconnect_mutex);
+    }
+    memset(&cam->opt, 0, sizeof(cam->opt));
+    memset(&cam->stats, 0, sizeof(cam->stats));
+    cam->mailbox = -1;
+    cam->lost = 0;
 }
 
-bool usbcam_jpeg_to_rgb(int desired_width, int desired_height, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size)
+void *usbcam_reconnect_thread(void *arg);
+
+// Wakes up everyone that is waiting for a frame from a lost camera
+void usbcam_wake_lost(usbcam_t *cam)
 {
-    tjhandle decompressor = tjInitDecompress();
-    int subsamp,width,height,error;
+    __atomic_store_n(&cam->mailbox, usbcam_mailbox_lost, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &cam->mailbox, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    if (cam->decode_threads > 0)
+    {
+        pthread_mutex_lock(&cam->decode_mutex);
+        pthread_cond_broadcast(&cam->decode_cond);
+        pthread_mutex_unlock(&cam->decode_mutex);
+    }
+}
 
-    error = tjDecompressHeader2(decompressor,
-        jpg_data,
-        jpg_size,
-        &width,
-        &height,
-        &subsamp);
+// Called by whoever first notices that the device is gone. Wakes up
+// everyone that is waiting for a frame, and starts reconnecting.
+void usbcam_device_lost(usbcam_t *cam, int error)
+{
+    if (__atomic_exchange_n(&cam->lost, 1, __ATOMIC_SEQ_CST))
+        return;
+    usbcam_warn("Lost camera %s (%d): %s", cam->opt.device_name, -error, strerror(-error));
+    usbcam_wake_lost(cam);
 
-    if (error)
+    if (cam->opt.reconnect)
     {
-        usbcam_warn("Failed to decode JPEG: %s", tjGetErrorStr());
-        tjDestroy(decompressor);
-        return false;
+        pthread_mutex_lock(&cam->reconnect_mutex);
+        if (!cam->reconnect_quit)
+        {
+            // the previous reconnect thread is done once the camera is back
+            if (cam->has_reconnect)
+                pthread_join(cam->reconnect_thread, NULL);
+            cam->has_reconnect = pthread_create(&cam->reconnect_thread, NULL, usbcam_reconnect_thread, cam) == 0;
+            if (!cam->has_reconnect)
+                usbcam_warn("Failed to start reconnect thread");
+        }
+        pthread_mutex_unlock(&cam->reconnect_mutex);
     }
+}
 
-    error = tjDecompress2(decompressor,
-        jpg_data,
-        jpg_size,
-        destination,
-        desired_width,
-        0,
-        desired_height,
-        TJPF_RGB,
-        TJFLAG_FASTDCT);
+// Handles an error from the device; returns the error so you can write
+// return usbcam_device_error(cam, r);
+int usbcam_device_error(usbcam_t *cam, int error)
+{
+    if (usbcam_is_device_error(error))
+    {
+        usbcam_device_lost(cam, error);
+        return -ENODEV;
+    }
+    return error;
+}
 
-    if (error)
+#define usbcam_count(cam, field, n) __atomic_add_fetch(&(cam)->stats.field, (unsigned long long)(n), __ATOMIC_RELAXED)
+
+// Called for every buffer we dequeue, by whichever thread dequeues
+void usbcam_count_dequeued(usbcam_t *cam, v4l2_buffer *buf)
+{
+    if (cam->has_sequence && buf->sequence - cam->last_sequence > 1)
+        usbcam_count(cam, sequence_gaps, buf->sequence - cam->last_sequence - 1);
+    __atomic_store_n(&cam->last_sequence, buf->sequence, __ATOMIC_RELAXED); // read by usbcam_tune_buffers
+    cam->has_sequence = 1;
+    if (buf->flags & V4L2_BUF_FLAG_ERROR)
+        usbcam_count(cam, corrupted, 1);
+
+    // the frame interval for usbcam_tune_buffers
+    long long ns = usbcam_timestamp_ns(buf->timestamp, buf->flags);
+    if (__atomic_fetch_add(&cam->interval_frames, 1, __ATOMIC_RELAXED) == 0)
     {
-        usbcam_warn("Failed to decode JPEG: %s", tjGetErrorStr());
-        tjDestroy(decompressor);
-        return false;
+        __atomic_store_n(&cam->first_ns, ns, __ATOMIC_RELAXED);
+        __atomic_store_n(&cam->first_sequence, buf->sequence, __ATOMIC_RELAXED);
     }
+    __atomic_store_n(&cam->last_ns, ns, __ATOMIC_RELAXED);
+}
 
-    tjDestroy(decompressor);
-    return true;
+long long usbcam_timestamp_ns(timeval timestamp, unsigned int flags)
+{
+    long long ns = (long long)timestamp.tv_sec*1000000000 + (long long)timestamp.tv_usec*1000;
+    if ((flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        return ns;
+
+    // wall time: move it by how far CLOCK_REALTIME is ahead of CLOCK_MONOTONIC right now
+    timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+    long long offset = ((long long)real.tv_sec - mono.tv_sec)*1000000000 + (real.tv_nsec - mono.tv_nsec);
+    return ns - offset;
+}
+
+long long usbcam_timestamp_ns(const usbcam_frame_t *frame)
+{
+    return usbcam_timestamp_ns(frame->timestamp, frame->flags);
+}
+
+// Raises *max to value, from any thread
+void usbcam_raise(unsigned long long *max, unsigned long long value)
+{
+    unsigned long long old = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (value > old && !__atomic_compare_exchange_n(max, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+}
+
+// Adds the time from capture until now_ns to a latency histogram
+void usbcam_count_latency(unsigned long long *bins, unsigned long long *sum, unsigned long long *max,
+                          timeval timestamp, unsigned int flags, long long now_ns)
+{
+    long long us = (now_ns - usbcam_timestamp_ns(timestamp, flags)) / 1000;
+    if (us < 0)
+        us = 0;
+    // bins[0] is under 1 ms, bins[i] is [2^(i-1), 2^i) ms
+    long long ms = us / 1000;
+    int bin = 0;
+    while (bin < usbcam_latency_bins-1 && ms >= (1LL << bin))
+        bin++;
+    __atomic_add_fetch(&bins[bin], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(sum, (unsigned long long)us, __ATOMIC_RELAXED);
+    usbcam_raise(max, (unsigned long long)us);
+}
+
+// Called for every frame we hand to the user
+void usbcam_count_delivered(usbcam_t *cam, timeval timestamp, unsigned int flags)
+{
+    usbcam_count(cam, delivered, 1);
+    if (cam->opt.playback) // the timestamps are from when it was recorded
+        return;
+    usbcam_count_latency(cam->stats.latency, &cam->stats.latency_sum_us, &cam->stats.latency_max_us,
+                         timestamp, flags, usbcam_now_ns());
+}
+
+// Called when a frame has been decoded, or released by the user, with
+// when that buffer was taken from the driver
+void usbcam_count_done(usbcam_t *cam, timeval timestamp, unsigned int flags, long long taken_ns)
+{
+    long long now = usbcam_now_ns();
+    usbcam_raise(&cam->hold_max_ns, (unsigned long long)(now - taken_ns));
+    usbcam_count(cam, done, 1);
+    if (cam->opt.playback)
+        return;
+    usbcam_count_latency(cam->stats.done_latency, &cam->stats.done_latency_sum_us, &cam->stats.done_latency_max_us,
+                         timestamp, flags, now);
+}
+
+void *usbcam_capture_thread(void *arg)
+{
+    usbcam_t *cam = (usbcam_t*)arg;
+    pollfd fds[2];
+    fds[0].fd = cam->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = cam->thread_wakeup;
+    fds[1].events = POLLIN;
+    int error = 0;
+    for (;;)
+    {
+        int r = poll(fds, 2, -1);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1)
+        {
+            error = -errno;
+            usbcam_warn("Capture thread failed to poll (%d): %s", errno, strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        if (!(fds[0].revents & (POLLIN | POLLERR | POLLHUP)))
+            continue;
+
+        // on POLLERR the dequeue tells us what went wrong
+        v4l2_buffer buf = {0};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = cam->memory;
+        if ((error = usbcam_ioctl(cam, VIDIOC_DQBUF, &buf)) == -EAGAIN)
+            continue;
+        if (error < 0)
+            break;
+        usbcam_count_dequeued(cam, &buf);
+
+        // publish the new frame, and requeue the one it replaces if
+        // the user never got around to locking it
+        cam->dequeued_buf[buf.index] = buf;
+        int old = __atomic_exchange_n(&cam->mailbox, (int)buf.index, __ATOMIC_ACQ_REL);
+        if (old >= 0)
+        {
+            usbcam_count(cam, skipped, 1);
+            error = usbcam_ioctl(cam, VIDIOC_QBUF, &cam->dequeued_buf[old]);
+        }
+        else
+            syscall(SYS_futex, &cam->mailbox, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        if (error < 0)
+            break;
+    }
+
+    // nobody else will fill the mailbox, so whoever waits on it must find out
+    if (error < 0)
+    {
+        usbcam_device_lost(cam, usbcam_is_device_error(error) ? error : -ENODEV);
+        __atomic_store_n(&cam->mailbox, usbcam_mailbox_lost, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &cam->mailbox, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+    return NULL;
+}
+
+// Returns a free slot, or else the oldest decoded frame that nobody has
+// locked yet (which is dropped), so that workers keep up with the camera
+usbcam_decode_slot_t *usbcam_find_decode_slot(usbcam_t *cam)
+{
+    usbcam_decode_slot_t *oldest = NULL;
+    for (int i = 0; i < cam->decode_threads+2; i++)
+    {
+        usbcam_decode_slot_t *slot = &cam->decode_slot[i];
+        if (slot->state == usbcam_slot_free)
+            return slot;
+        if (slot->state == usbcam_slot_ready && (!oldest || slot->ticket < oldest->ticket))
+            oldest = slot;
+    }
+    if (oldest && oldest->ok)
+        usbcam_count(cam, skipped, 1);
+    return oldest;
+}
+
+void *usbcam_decode_thread(void *arg)
+{
+    usbcam_t *cam = (usbcam_t*)arg;
+    for (;;)
+    {
+        // reserve somewhere to put the output before taking a frame from the driver
+        pthread_mutex_lock(&cam->decode_mutex);
+        usbcam_decode_slot_t *slot = NULL;
+        while (!cam->decode_quit && !(slot = usbcam_find_decode_slot(cam)))
+            pthread_cond_wait(&cam->decode_cond, &cam->decode_mutex);
+        if (cam->decode_quit)
+        {
+            pthread_mutex_unlock(&cam->decode_mutex);
+            break;
+        }
+        slot->state = usbcam_slot_decoding;
+        slot->ticket = 0; // not dequeued yet
+        pthread_mutex_unlock(&cam->decode_mutex);
+
+        // dequeue the next frame; workers take turns so that tickets follow capture order
+        v4l2_buffer buf = {0};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = cam->memory;
+        int got_frame = 0;
+        int error = 0;
+        long long taken_ns = 0;
+        pthread_mutex_lock(&cam->dequeue_mutex);
+        {
+            pollfd fds[2];
+            fds[0].fd = cam->fd;
+            fds[0].events = POLLIN;
+            fds[1].fd = cam->thread_wakeup;
+            fds[1].events = POLLIN;
+            for (;;)
+            {
+                int r = poll(fds, 2, -1);
+                if (r == -1 && errno == EINTR)
+                    continue;
+                if (r == -1)
+                {
+                    error = -errno;
+                    usbcam_warn("Decode thread failed to poll (%d): %s", errno, strerror(errno));
+                    break;
+                }
+                if (fds[1].revents || __atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE))
+                    break;
+                if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+                {
+                    if ((error = usbcam_ioctl(cam, VIDIOC_DQBUF, &buf)) == -EAGAIN)
+                        continue;
+                    if (error < 0)
+                        break;
+                    usbcam_count_dequeued(cam, &buf);
+                    taken_ns = usbcam_now_ns();
+                    pthread_mutex_lock(&cam->decode_mutex);
+                    slot->ticket = ++cam->next_ticket;
+                    pthread_mutex_unlock(&cam->decode_mutex);
+                    got_frame = 1;
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&cam->dequeue_mutex);
+
+        if (!got_frame)
+        {
+            pthread_mutex_lock(&cam->decode_mutex);
+            slot->state = usbcam_slot_free;
+            pthread_mutex_unlock(&cam->decode_mutex);
+            if (error < 0)
+                usbcam_device_lost(cam, usbcam_is_device_error(error) ? error : -ENODEV);
+            break;
+        }
+
+        slot->ok = usbcam_jpeg_to_pixels(cam->decode_width, cam->decode_height, cam->decode_format, slot->frame.data,
+                                         (unsigned char*)cam->buffer_start[buf.index], buf.bytesused);
+        if (!slot->ok && !(buf.flags & V4L2_BUF_FLAG_ERROR)) // those are counted already
+            usbcam_count(cam, corrupted, 1);
+        slot->frame.timestamp = buf.timestamp;
+        slot->frame.sequence = buf.sequence;
+        slot->frame.flags = buf.flags;
+        usbcam_count_done(cam, buf.timestamp, buf.flags, taken_ns);
+        error = usbcam_ioctl(cam, VIDIOC_QBUF, &buf);
+
+        pthread_mutex_lock(&cam->decode_mutex);
+        slot->state = usbcam_slot_ready;
+        pthread_cond_broadcast(&cam->decode_cond);
+        pthread_mutex_unlock(&cam->decode_mutex);
+
+        if (error < 0)
+        {
+            usbcam_device_lost(cam, usbcam_is_device_error(error) ? error : -ENODEV);
+            break;
+        }
+    }
+    return NULL;
+}
+
+//
+// Controls and formats (see §CONTROLS and §FORMATS)
+//
+
+// Like usbcam_ioctl, but quiet and without backoff, for requests that
+// are expected to fail (the end of an enumeration, an unsupported control)
+int usbcam_query_ioctl(int fd, int request, void *arg)
+{
+    for (;;)
+    {
+        if (v4l2_ioctl(fd, request, arg) != -1)
+            return 0;
+        if (errno != EINTR)
+            return -errno;
+    }
+}
+
+// The fd to send control requests to, or -errno
+int usbcam_control_fd(usbcam_t *cam)
+{
+    if (__atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE))
+        return -ENODEV;
+    usbcam_check(cam->has_fd, -EBADF, "Camera device not open");
+    return cam->fd;
+}
+
+int usbcam_set_control(usbcam_t *cam, unsigned int id, int value)
+{
+    int fd = usbcam_control_fd(cam);
+    usbcam_try(fd);
+    v4l2_control control = {0};
+    control.id = id;
+    control.value = value;
+    int r = usbcam_query_ioctl(fd, VIDIOC_S_CTRL, &control);
+    usbcam_check(r == 0, r, "Failed to set control 0x%x to %d (%d): %s", id, value, -r, strerror(-r));
+    return 0;
+}
+
+int usbcam_get_control(usbcam_t *cam, unsigned int id, int *value)
+{
+    int fd = usbcam_control_fd(cam);
+    usbcam_try(fd);
+    v4l2_control control = {0};
+    control.id = id;
+    int r = usbcam_query_ioctl(fd, VIDIOC_G_CTRL, &control);
+    usbcam_check(r == 0, r, "Failed to get control 0x%x (%d): %s", id, -r, strerror(-r));
+    *value = control.value;
+    return 0;
+}
+
+int usbcam_set_controls(usbcam_t *cam, const usbcam_control_t *controls, int count)
+{
+    int fd = usbcam_control_fd(cam);
+    usbcam_try(fd);
+    usbcam_check(count > 0 && count <= usbcam_max_controls, -EINVAL, "You can set 1 to %d controls at once", usbcam_max_controls);
+    v4l2_ext_control ext[usbcam_max_controls];
+    memset(ext, 0, sizeof(ext));
+    for (int i = 0; i < count; i++)
+    {
+        ext[i].id = controls[i].id;
+        ext[i].value = controls[i].value;
+    }
+    v4l2_ext_controls request = {0};
+    request.which = V4L2_CTRL_WHICH_CUR_VAL;
+    request.count = count;
+    request.controls = ext;
+    int r = usbcam_query_ioctl(fd, VIDIOC_S_EXT_CTRLS, &request);
+    if (r == -ENOTTY)
+    {
+        // old drivers only have S_CTRL
+        for (int i = 0; i < count; i++)
+            usbcam_try(usbcam_set_control(cam, controls[i].id, controls[i].value));
+        return 0;
+    }
+    usbcam_check(r == 0, r, "Failed to set control 0x%x (%d): %s",
+                 request.error_idx < (unsigned int)count ? controls[request.error_idx].id : 0, -r, strerror(-r));
+    return 0;
+}
+
+// "Exposure, Auto" becomes "exposure_auto", like v4l2-ctl names them
+void usbcam_control_name(const char *name, char *result, size_t size)
+{
+    size_t n = 0;
+    for (const char *c = name; *c && n+1 < size; c++)
+    {
+        if ((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9'))
+            result[n++] = *c;
+        else if (*c >= 'A' && *c <= 'Z')
+            result[n++] = *c - 'A' + 'a';
+        else if (n > 0 && result[n-1] != '_')
+            result[n++] = '_';
+    }
+    while (n > 0 && result[n-1] == '_')
+        n--;
+    result[n] = 0;
+}
+
+void usbcam_fill_control_info(v4l2_queryctrl *query, usbcam_control_info_t *info)
+{
+    info->id = query->id;
+    usbcam_control_name((const char*)query->name, info->name, sizeof(info->name));
+    info->type = query->type;
+    info->minimum = query->minimum;
+    info->maximum = query->maximum;
+    info->step = query->step;
+    info->default_value = query->default_value;
+}
+
+int usbcam_query_control(usbcam_t *cam, unsigned int id, usbcam_control_info_t *info)
+{
+    int fd = usbcam_control_fd(cam);
+    usbcam_try(fd);
+    v4l2_queryctrl query = {0};
+    query.id = id;
+    usbcam_try(usbcam_query_ioctl(fd, VIDIOC_QUERYCTRL, &query));
+    if (query.flags & V4L2_CTRL_FLAG_DISABLED)
+        return -EINVAL;
+    usbcam_fill_control_info(&query, info);
+    return 0;
+}
+
+int usbcam_enum_controls(usbcam_t *cam, usbcam_control_info_t *controls, int max_controls)
+{
+    int fd = usbcam_control_fd(cam);
+    usbcam_try(fd);
+    int count = 0;
+    v4l2_queryctrl query = {0};
+    query.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+    while (usbcam_query_ioctl(fd, VIDIOC_QUERYCTRL, &query) == 0)
+    {
+        if (!(query.flags & V4L2_CTRL_FLAG_DISABLED) && query.type != V4L2_CTRL_TYPE_CTRL_CLASS)
+        {
+            if (count < max_controls)
+                usbcam_fill_control_info(&query, &controls[count]);
+            count++;
+        }
+        query.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+    }
+    return count;
+}
+
+int usbcam_find_control(usbcam_t *cam, const char *name)
+{
+    int fd = usbcam_control_fd(cam);
+    usbcam_try(fd);
+    v4l2_queryctrl query = {0};
+    query.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+    while (usbcam_query_ioctl(fd, VIDIOC_QUERYCTRL, &query) == 0)
+    {
+        char query_name[32];
+        usbcam_control_name((const char*)query.name, query_name, sizeof(query_name));
+        if (query.type != V4L2_CTRL_TYPE_CTRL_CLASS && strcmp(query_name, name) == 0)
+            return (int)query.id;
+        query.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+    }
+    usbcam_warn("The camera has no control called %s", name);
+    return -EINVAL;
+}
+
+// Also used while (re)opening, when the camera still counts as lost
+int usbcam_set_fps(int fd, unsigned int fps)
+{
+    usbcam_check(fps > 0, -EINVAL, "The frame rate must be positive");
+    v4l2_streamparm parm = {0};
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int r = usbcam_query_ioctl(fd, VIDIOC_G_PARM, &parm);
+    usbcam_check(r == 0 && (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME), r ? r : -ENOTTY,
+                 "The camera can't set its frame rate");
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = fps;
+    r = usbcam_query_ioctl(fd, VIDIOC_S_PARM, &parm);
+    usbcam_check(r == 0, r, "Failed to set frame rate to %u (%d): %s", fps, -r, strerror(-r));
+    usbcam_debug("Frame interval is %u/%u s", parm.parm.capture.timeperframe.numerator, parm.parm.capture.timeperframe.denominator);
+    return 0;
+}
+
+int usbcam_set_fps(usbcam_t *cam, unsigned int fps)
+{
+    int fd = usbcam_control_fd(cam);
+    usbcam_try(fd);
+    return usbcam_set_fps(fd, fps);
+}
+
+int usbcam_add_mode(usbcam_mode_t *modes, int count, int max_modes, unsigned int pixel_format,
+                    unsigned int width, unsigned int height, v4l2_fract interval)
+{
+    if (count < max_modes)
+    {
+        modes[count].pixel_format = pixel_format;
+        modes[count].width = width;
+        modes[count].height = height;
+        modes[count].interval_numerator = interval.numerator;
+        modes[count].interval_denominator = interval.denominator;
+    }
+    return count + 1;
+}
+
+// Adds every frame interval the camera has at one size
+int usbcam_add_intervals(int fd, usbcam_mode_t *modes, int count, int max_modes, unsigned int pixel_format, unsigned int width, unsigned int height)
+{
+    v4l2_frmivalenum ival = {0};
+    ival.pixel_format = pixel_format;
+    ival.width = width;
+    ival.height = height;
+    int added = 0;
+    for (ival.index = 0; usbcam_query_ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++)
+    {
+        if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+            count = usbcam_add_mode(modes, count, max_modes, pixel_format, width, height, ival.discrete);
+        else
+        {
+            // fastest and slowest of a range
+            count = usbcam_add_mode(modes, count, max_modes, pixel_format, width, height, ival.stepwise.min);
+            count = usbcam_add_mode(modes, count, max_modes, pixel_format, width, height, ival.stepwise.max);
+            added += 2;
+            break;
+        }
+        added++;
+    }
+    if (added == 0)
+    {
+        v4l2_fract unknown = {0, 0};
+        count = usbcam_add_mode(modes, count, max_modes, pixel_format, width, height, unknown);
+    }
+    return count;
+}
+
+int usbcam_enum_modes(const char *device_name, usbcam_mode_t *modes, int max_modes)
+{
+    int fd = v4l2_open(device_name, O_RDWR | O_NONBLOCK, 0);
+    usbcam_check(fd >= 0, -errno, "Failed to open device %s (%d): %s", device_name, errno, strerror(errno));
+    int count = 0;
+    v4l2_fmtdesc fmt = {0};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    for (fmt.index = 0; usbcam_query_ioctl(fd, VIDIOC_ENUM_FMT, &fmt) == 0; fmt.index++)
+    {
+        v4l2_frmsizeenum size = {0};
+        size.pixel_format = fmt.pixelformat;
+        for (size.index = 0; usbcam_query_ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++)
+        {
+            if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+                count = usbcam_add_intervals(fd, modes, count, max_modes, fmt.pixelformat, size.discrete.width, size.discrete.height);
+            else
+            {
+                // smallest and largest of a range
+                count = usbcam_add_intervals(fd, modes, count, max_modes, fmt.pixelformat, size.stepwise.min_width, size.stepwise.min_height);
+                count = usbcam_add_intervals(fd, modes, count, max_modes, fmt.pixelformat, size.stepwise.max_width, size.stepwise.max_height);
+                break;
+            }
+        }
+    }
+    v4l2_close(fd);
+    return count;
+}
+
+// Sets the format, and allocates, maps and queues the buffers, on an
+// open device. The caller cleans up if anything fails.
+int usbcam_start_stream(usbcam_t *cam, usbcam_opt_t opt)
+{
+    int r = 0;
+    cam->mailbox = -1;
+    cam->has_sequence = 0; // the driver starts counting from 0 again
+    do
+    {
+        // set format
+        unsigned int sizeimage = 0;
+        {
+            v4l2_format fmt = {0};
+            fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            fmt.fmt.pix.pixelformat = opt.pixel_format;
+            fmt.fmt.pix.width = opt.width;
+            fmt.fmt.pix.height = opt.height;
+            if ((r = usbcam_ioctl(cam, VIDIOC_S_FMT, &fmt)) < 0)
+                break;
+
+            r = -EINVAL;
+            if (fmt.fmt.pix.pixelformat != opt.pixel_format) { usbcam_warn("Did not get the requested format"); break; }
+            if (fmt.fmt.pix.width != opt.width) { usbcam_warn("Did not get the requested width"); break; }
+            if (fmt.fmt.pix.height != opt.height) { usbcam_warn("Did not get the requested height"); break; }
+            r = 0;
+            sizeimage = fmt.fmt.pix.sizeimage;
+        }
+
+        usbcam_debug("Opened device (%s %dx%d)", opt.device_name, opt.width, opt.height);
+
+        // cameras round to a frame rate they have, so only a refusal is an error
+        if (opt.fps && !cam->playback && (r = usbcam_set_fps(cam->fd, opt.fps)) < 0)
+            break;
+
+        // tell the driver how many buffers we want
+        {
+            v4l2_requestbuffers request = {0};
+            request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            request.memory = cam->memory;
+            request.count = opt.buffers;
+            if ((r = usbcam_ioctl(cam, VIDIOC_REQBUFS, &request)) < 0)
+                break;
+
+            if (request.count != opt.buffers)
+            {
+                usbcam_warn("Did not get the requested number of buffers");
+                r = -ENOMEM;
+                break;
+            }
+        }
+
+        // allocate buffers
+        cam->buffers = opt.buffers;
+        cam->has_mmap = 1;
+        memset(cam->buffer_start, 0, sizeof(cam->buffer_start));
+        if (cam->playback)
+        {
+            // buffers point into the recording, see usbcam_playback_dequeue
+        }
+        else if (cam->memory == V4L2_MEMORY_MMAP)
+        {
+            for (int i = 0; i < (int)opt.buffers && r == 0; i++)
+            {
+                v4l2_buffer info = {0};
+                info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                info.memory = V4L2_MEMORY_MMAP;
+                info.index = i;
+                if ((r = usbcam_ioctl(cam, VIDIOC_QUERYBUF, &info)) < 0)
+                    break;
+
+                cam->buffer_length[i] = info.length;
+                cam->buffer_start[i] = mmap(
+                    NULL,
+                    info.length,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    cam->fd,
+                    info.m.offset
+                );
+
+                if (cam->buffer_start[i] == MAP_FAILED)
+                {
+                    r = -errno;
+                    cam->buffer_start[i] = NULL;
+                    usbcam_warn("Failed to allocate memory for buffers (%d): %s", errno, strerror(errno));
+                }
+            }
+            if (r < 0)
+                break;
+        }
+        else if (cam->memory == V4L2_MEMORY_USERPTR)
+        {
+            // split the arena into page-aligned slices
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t slice = ((size_t)sizeimage + page - 1) & ~(page - 1);
+            if (slice*opt.buffers > opt.arena_size)
+            {
+                usbcam_warn("Arena is too small (need %zu bytes)", slice*opt.buffers);
+                r = -ENOMEM;
+                break;
+            }
+            for (int i = 0; i < (int)opt.buffers; i++)
+            {
+                cam->buffer_start[i] = (unsigned char*)opt.arena + i*slice;
+                cam->buffer_length[i] = (unsigned int)slice;
+            }
+        }
+        else
+        {
+            for (int i = 0; i < (int)opt.buffers; i++)
+            {
+                cam->buffer_length[i] = sizeimage;
+                cam->buffer_start[i] = mmap(NULL, sizeimage, PROT_READ, MAP_SHARED, opt.dmabuf_fds[i], 0);
+                if (cam->buffer_start[i] == MAP_FAILED)
+                {
+                    usbcam_debug("Could not map DMABUF %d for CPU access", opt.dmabuf_fds[i]);
+                    cam->buffer_start[i] = NULL;
+                }
+                cam->buffer_dmabuf[i] = opt.dmabuf_fds[i];
+            }
+        }
+
+        if (opt.export_dmabuf)
+        {
+            for (int i = 0; i < (int)opt.buffers; i++)
+                cam->buffer_dmabuf[i] = -1;
+            cam->has_dmabuf = 1;
+            for (int i = 0; i < (int)opt.buffers; i++)
+            {
+                v4l2_exportbuffer expbuf = {0};
+                expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                expbuf.index = i;
+                expbuf.flags = O_RDONLY | O_CLOEXEC;
+                if ((r = usbcam_ioctl(cam, VIDIOC_EXPBUF, &expbuf)) < 0)
+                    break;
+                cam->buffer_dmabuf[i] = expbuf.fd;
+            }
+            if (r < 0)
+                break;
+        }
+
+        // start streaming
+        {
+            int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            if ((r = usbcam_ioctl(cam, VIDIOC_STREAMON, &type)) < 0)
+                break;
+        }
+
+        cam->has_stream = 1;
+
+        // queue buffers
+        for (int i = 0; i < (int)opt.buffers; i++)
+        {
+            v4l2_buffer info = {0};
+            info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            info.memory = cam->memory;
+            info.index = i;
+            if (cam->memory == V4L2_MEMORY_USERPTR)
+            {
+                info.m.userptr = (unsigned long)cam->buffer_start[i];
+                info.length = cam->buffer_length[i];
+            }
+            else if (cam->memory == V4L2_MEMORY_DMABUF)
+            {
+                info.m.fd = cam->buffer_dmabuf[i];
+                info.length = cam->buffer_length[i];
+            }
+            if ((r = usbcam_ioctl(cam, VIDIOC_QBUF, &info)) < 0)
+                break;
+        }
+        if (r < 0)
+            break;
+    } while (0);
+    return r;
+}
+
+// The fewest buffers that keep the newest frame fresh, when you hold up
+// to held frames at once, each for up to hold_ns, and the camera captures
+// one every interval_ns (see §LOW LATENCY). Whoever dequeues needs a
+// buffer that the driver is filling. A capture thread requeues frames as
+// soon as newer ones arrive, so it only needs one more for its mailbox.
+// Without one, the driver fills a buffer for every frame captured while
+// you hold one, and decode threads hold one each while they decode.
+unsigned int usbcam_needed_buffers(usbcam_opt_t opt, int held, long long hold_ns, long long interval_ns)
+{
+    long long captured = (hold_ns + interval_ns - 1) / interval_ns;
+    long long n;
+    if (opt.threaded)
+        n = held + 2;
+    else if (opt.decode_threads > 0)
+    {
+        long long busy = captured < opt.decode_threads ? captured : opt.decode_threads;
+        n = busy + 2 > opt.decode_threads + 1 ? busy + 2 : opt.decode_threads + 1;
+    }
+    else
+        n = held + captured + 1;
+    return (unsigned int)(n < usbcam_max_buffers ? n : usbcam_max_buffers);
+}
+
+// Starts measuring again for usbcam_tune_buffers, e.g. in a new mode
+void usbcam_reset_tuning(usbcam_t *cam)
+{
+    __atomic_store_n(&cam->interval_frames, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cam->hold_max_ns, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&cam->held_max, 0, __ATOMIC_RELAXED);
+}
+
+// Pins a capture or decode thread to opt.cpu_mask and runs it with
+// SCHED_FIFO priority, if you asked for that. Failing is only a warning,
+// e.g. realtime priority needs CAP_SYS_NICE (or an RLIMIT_RTPRIO).
+void usbcam_tune_thread(usbcam_opt_t opt, pthread_t thread)
+{
+    if (opt.cpu_mask)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int i = 0; i < 64; i++)
+            if (opt.cpu_mask & (1ULL << i))
+                CPU_SET(i, &set);
+        int r = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (r != 0)
+            usbcam_warn("Failed to pin thread to cpu_mask 0x%llx (%d): %s", opt.cpu_mask, r, strerror(r));
+    }
+    if (opt.realtime_priority > 0)
+    {
+        sched_param param = {0};
+        param.sched_priority = opt.realtime_priority;
+        int r = pthread_setschedparam(thread, SCHED_FIFO, &param);
+        if (r != 0)
+            usbcam_warn("Failed to set SCHED_FIFO priority %d (%d): %s", opt.realtime_priority, r, strerror(r));
+    }
+}
+
+// Starts the capture or decode threads on a streaming device
+int usbcam_start_threads(usbcam_t *cam, usbcam_opt_t opt)
+{
+    int r = 0;
+    if (opt.threaded)
+    {
+        cam->thread_wakeup = eventfd(0, EFD_CLOEXEC);
+        if (cam->thread_wakeup < 0)
+        {
+            usbcam_warn("Failed to create eventfd");
+            return -errno;
+        }
+        if ((r = -pthread_create(&cam->thread, NULL, usbcam_capture_thread, cam)) < 0)
+        {
+            close(cam->thread_wakeup);
+            usbcam_warn("Failed to start capture thread");
+            return r;
+        }
+        cam->has_thread = 1;
+        usbcam_tune_thread(opt, cam->thread);
+    }
+
+    if (opt.decode_threads > 0)
+    {
+        cam->thread_wakeup = eventfd(0, EFD_CLOEXEC);
+        if (cam->thread_wakeup < 0)
+        {
+            usbcam_warn("Failed to create eventfd");
+            return -errno;
+        }
+        cam->decode_quit = 0;
+        for (int i = 0; i < opt.decode_threads; i++)
+        {
+            if ((r = -pthread_create(&cam->decode_thread[i], NULL, usbcam_decode_thread, cam)) < 0)
+            {
+                usbcam_warn("Failed to start decode thread");
+                break;
+            }
+            cam->decode_running = i+1;
+            usbcam_tune_thread(opt, cam->decode_thread[i]);
+        }
+        if (!cam->decode_running)
+            close(cam->thread_wakeup);
+        if (r < 0)
+            return r;
+    }
+    return 0;
+}
+
+// Opens the device and sets up and queues the buffers, but doesn't
+// start the threads. Cleans up after itself if anything fails.
+int usbcam_open_stream(usbcam_t *cam, usbcam_opt_t opt)
+{
+    // Open the device (or the recording, which answers the same requests)
+    if (opt.playback)
+    {
+        usbcam_try(cam->fd = usbcam_playback_open(cam, opt.device_name, opt.playback));
+    }
+    else
+    {
+        cam->fd = v4l2_open(opt.device_name, O_RDWR | O_NONBLOCK, 0);
+        usbcam_check(cam->fd >= 0, -errno, "Failed to open device %s (%d): %s", opt.device_name, errno, strerror(errno));
+    }
+    cam->has_fd = 1;
+
+    int r = usbcam_start_stream(cam, opt);
+    if (r < 0)
+        usbcam_close_device(cam);
+    return r;
+}
+
+// Opens the device, sets up and queues the buffers, and starts the
+// threads. Cleans up after itself if anything fails.
+int usbcam_open_device(usbcam_t *cam, usbcam_opt_t opt)
+{
+    usbcam_try(usbcam_open_stream(cam, opt));
+    int r = usbcam_start_threads(cam, opt);
+    if (r < 0)
+    {
+        usbcam_stop_threads(cam);
+        usbcam_close_device(cam);
+    }
+    return r;
+}
+
+bool usbcam_check_desired_size(int width, int height, int desired_width, int desired_height);
+
+void *usbcam_reconnect_thread(void *arg)
+{
+    usbcam_t *cam = (usbcam_t*)arg;
+    usbcam_stop_threads(cam);
+
+    // the user may still be reading from the old buffers
+    pollfd fds;
+    fds.fd = cam->reconnect_wakeup;
+    fds.events = POLLIN;
+    while (__atomic_load_n(&cam->frames_held, __ATOMIC_SEQ_CST) > 0)
+        if (poll(&fds, 1, 10) > 0)
+            return NULL;
+    usbcam_close_device(cam);
+
+    int delay_ms = usbcam_reconnect_min_ms;
+    for (;;)
+    {
+        if (poll(&fds, 1, delay_ms) > 0)
+            return NULL;
+        usbcam_debug("Reconnecting to %s", cam->opt.device_name);
+        if (usbcam_open_stream(cam, cam->opt) == 0)
+        {
+            // the camera is back before the threads start, so that one
+            // that fails right away is a new loss and reconnects again
+            __atomic_store_n(&cam->lost, 0, __ATOMIC_SEQ_CST);
+            if (usbcam_start_threads(cam, cam->opt) == 0)
+                break;
+
+            // take it back, unless a thread that did start has already
+            // lost the camera again: its reconnect thread cleans up
+            if (__atomic_exchange_n(&cam->lost, 1, __ATOMIC_SEQ_CST))
+                return NULL;
+            usbcam_wake_lost(cam);
+            usbcam_stop_threads(cam);
+            usbcam_close_device(cam);
+        }
+        delay_ms = delay_ms*2 < usbcam_reconnect_max_ms ? delay_ms*2 : usbcam_reconnect_max_ms;
+    }
+
+    usbcam_warn("Reconnected to camera %s", cam->opt.device_name);
+    return NULL;
+}
+
+int usbcam_init(usbcam_t *cam, usbcam_opt_t opt)
+{
+    usbcam_cleanup(cam);
+    usbcam_check(opt.buffers > 0 || opt.memory != usbcam_memory_dmabuf, -EINVAL, "Say how many dmabuf_fds you gave in buffers");
+    if (opt.buffers == 0)
+        opt.buffers = usbcam_needed_buffers(opt, 1, 0, 1);
+    usbcam_check(opt.buffers <= usbcam_max_buffers, -EINVAL, "You requested too many buffers");
+    usbcam_check(!opt.threaded || opt.buffers >= 3, -EINVAL, "You need atleast three buffers with a capture thread");
+    usbcam_check(opt.decode_threads >= 0 && opt.decode_threads <= usbcam_max_decode_threads, -EINVAL, "You requested too many decode threads");
+    usbcam_check(!opt.threaded || !opt.decode_threads, -EINVAL, "You can't use both a capture thread and decode threads");
+    usbcam_check(!opt.decode_threads || (int)opt.buffers > opt.decode_threads, -EINVAL, "You need more buffers than decode threads");
+    usbcam_check(!opt.decode_threads || opt.pixel_format == V4L2_PIX_FMT_MJPEG || opt.pixel_format == V4L2_PIX_FMT_JPEG,
+                 -EINVAL, "Decode threads need a JPEG pixel format");
+    usbcam_check(!opt.decode_threads || (opt.decode_format >= 0 && opt.decode_format < TJ_NUMPF), -EINVAL, "Unknown decode format");
+    usbcam_check(!opt.decode_threads || usbcam_check_desired_size(opt.width, opt.height, opt.decode_width, opt.decode_height),
+                 -EINVAL, "Get a decode size that works from usbcam_scaled_size");
+    usbcam_check(opt.decode_keep >= 0, -EINVAL, "decode_keep can't be negative");
+    usbcam_check(opt.realtime_priority >= 0 && opt.realtime_priority <= sched_get_priority_max(SCHED_FIFO), -EINVAL,
+                 "realtime_priority goes up to %d (0 is off)", sched_get_priority_max(SCHED_FIFO));
+    usbcam_check((!opt.cpu_mask && !opt.realtime_priority) || opt.threaded || opt.decode_threads, -EINVAL,
+                 "cpu_mask and realtime_priority are for the capture and decode threads");
+    usbcam_check(opt.memory == usbcam_memory_mmap || opt.memory == usbcam_memory_userptr || opt.memory == usbcam_memory_dmabuf,
+                 -EINVAL, "Unknown memory mode");
+    usbcam_check(opt.memory != usbcam_memory_userptr || opt.arena, -EINVAL, "You need to pass an arena for userptr memory");
+    usbcam_check(opt.memory != usbcam_memory_dmabuf || opt.dmabuf_fds, -EINVAL, "You need to pass dmabuf_fds for dmabuf memory");
+    usbcam_check(!opt.export_dmabuf || opt.memory == usbcam_memory_mmap, -EINVAL, "You can only export mmap buffers");
+    usbcam_check(opt.playback >= usbcam_playback_off && opt.playback <= usbcam_playback_fast, -EINVAL, "Unknown playback mode");
+    usbcam_check(!opt.playback || (opt.memory == usbcam_memory_mmap && !opt.export_dmabuf), -EINVAL,
+                 "Playback only works with mmap memory");
+
+    if (opt.memory == usbcam_memory_userptr) cam->memory = V4L2_MEMORY_USERPTR;
+    else if (opt.memory == usbcam_memory_dmabuf) cam->memory = V4L2_MEMORY_DMABUF;
+    else cam->memory = V4L2_MEMORY_MMAP;
+
+    if (opt.reconnect)
+    {
+        cam->reconnect_wakeup = eventfd(0, EFD_CLOEXEC);
+        usbcam_check(cam->reconnect_wakeup >= 0, -errno, "Failed to create eventfd");
+        pthread_mutex_init(&cam->reconnect_mutex, NULL);
+        cam->reconnect_quit = 0;
+    }
+    cam->opt = opt;
+
+    // the decoded frames outlive reconnects, so they are set up here
+    if (opt.decode_threads > 0)
+    {
+        cam->decode_width = opt.decode_width ? opt.decode_width : (int)opt.width;
+        cam->decode_height = opt.decode_height ? opt.decode_height : (int)opt.height;
+        cam->decode_format = opt.decode_format;
+        cam->next_ticket = 0;
+        pthread_mutex_init(&cam->dequeue_mutex, NULL);
+        pthread_mutex_init(&cam->decode_mutex, NULL);
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // for usbcam_try_lock_rgb
+        pthread_cond_init(&cam->decode_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        cam->decode_threads = opt.decode_threads;
+        cam->decode_pool = usbcam_pool_create(cam->decode_width, cam->decode_height, cam->decode_format,
+                                              opt.decode_threads+2+opt.decode_keep, usbcam_pool_packed);
+        if (!cam->decode_pool)
+        {
+            usbcam_cleanup(cam);
+            return -ENOMEM;
+        }
+        for (int i = 0; i < opt.decode_threads+2; i++)
+        {
+            usbcam_decode_slot_t *slot = &cam->decode_slot[i];
+            slot->state = usbcam_slot_free;
+            slot->frame.index = i;
+            slot->frame.dmabuf_fd = -1;
+            usbcam_pool_acquire(cam->decode_pool, &slot->image);
+            slot->frame.data = slot->image.data;
+            slot->frame.size = slot->image.stride*slot->image.height;
+        }
+    }
+
+    int r = usbcam_open_device(cam, opt);
+    if (r < 0)
+        usbcam_cleanup(cam);
+    return r;
+}
+
+//
+// Switching modes without closing the camera (see §RECONFIGURE)
+//
+
+int usbcam_try_mode(usbcam_t *cam, const usbcam_mode_t *mode)
+{
+    int fd = usbcam_control_fd(cam);
+    usbcam_try(fd);
+    usbcam_check(!cam->playback, -ENOTTY, "A recording has only the one mode");
+    v4l2_format fmt = {0};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.pixelformat = mode->pixel_format;
+    fmt.fmt.pix.width = mode->width;
+    fmt.fmt.pix.height = mode->height;
+    int r = usbcam_query_ioctl(fd, VIDIOC_TRY_FMT, &fmt);
+    usbcam_check(r == 0, r, "Failed to try %ux%u (%d): %s", mode->width, mode->height, -r, strerror(-r));
+    usbcam_check(fmt.fmt.pix.pixelformat == mode->pixel_format && fmt.fmt.pix.width == mode->width &&
+                 fmt.fmt.pix.height == mode->height, -EINVAL,
+                 "The camera has no %ux%u mode in that format (it offered %ux%u)",
+                 mode->width, mode->height, fmt.fmt.pix.width, fmt.fmt.pix.height);
+    return 0;
+}
+
+// Keeps the reconnect thread away while usbcam_reconfigure stops and
+// starts the threads and buffers. If the camera was lost just before,
+// the thread is woken up and joined halfway; usbcam_resume_reconnect
+// starts a new one.
+void usbcam_pause_reconnect(usbcam_t *cam)
+{
+    if (!cam->opt.reconnect)
+        return;
+    pthread_mutex_lock(&cam->reconnect_mutex);
+    cam->reconnect_quit = 1;
+    int has_reconnect = cam->has_reconnect;
+    cam->has_reconnect = 0;
+    pthread_mutex_unlock(&cam->reconnect_mutex);
+    if (has_reconnect)
+    {
+        uint64_t one = 1;
+        if (write(cam->reconnect_wakeup, &one, sizeof(one)) != sizeof(one))
+            usbcam_warn("Failed to signal reconnect thread");
+        pthread_join(cam->reconnect_thread, NULL);
+        if (read(cam->reconnect_wakeup, &one, sizeof(one)) != sizeof(one)) // so the next thread doesn't quit at once
+            usbcam_warn("Failed to reset reconnect eventfd");
+    }
+}
+
+void usbcam_resume_reconnect(usbcam_t *cam)
+{
+    if (!cam->opt.reconnect)
+        return;
+    pthread_mutex_lock(&cam->reconnect_mutex);
+    cam->reconnect_quit = 0;
+    if (__atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE))
+    {
+        cam->has_reconnect = pthread_create(&cam->reconnect_thread, NULL, usbcam_reconnect_thread, cam) == 0;
+        if (!cam->has_reconnect)
+            usbcam_warn("Failed to start reconnect thread");
+    }
+    pthread_mutex_unlock(&cam->reconnect_mutex);
+}
+
+// Adds mmap buffers to the running stream with VIDIOC_CREATE_BUFS. The
+// threads must be stopped. On failure the buffers that were created
+// stay in cam->buffers, so usbcam_stop_stream still cleans them up.
+int usbcam_add_buffers(usbcam_t *cam, unsigned int buffers)
+{
+    v4l2_create_buffers create = {0};
+    create.count = buffers - cam->buffers;
+    create.memory = V4L2_MEMORY_MMAP;
+    create.format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    usbcam_try(usbcam_ioctl(cam, VIDIOC_G_FMT, &create.format));
+    int r = usbcam_query_ioctl(cam->fd, VIDIOC_CREATE_BUFS, &create);
+    if (r < 0)
+    {
+        usbcam_debug("Could not add buffers (%d): %s", -r, strerror(-r));
+        return r;
+    }
+    usbcam_check(create.index == (unsigned int)cam->buffers, -EIO, "The driver added buffers in the wrong place");
+
+    int first = cam->buffers;
+    cam->buffers = first + create.count;
+    for (int i = first; i < cam->buffers; i++)
+    {
+        cam->buffer_start[i] = NULL;
+        cam->buffer_dmabuf[i] = -1;
+    }
+    for (int i = first; i < cam->buffers; i++)
+    {
+        v4l2_buffer info = {0};
+        info.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        info.memory = V4L2_MEMORY_MMAP;
+        info.index = i;
+        usbcam_try(usbcam_ioctl(cam, VIDIOC_QUERYBUF, &info));
+        cam->buffer_length[i] = info.length;
+        cam->buffer_start[i] = mmap(NULL, info.length, PROT_READ | PROT_WRITE, MAP_SHARED, cam->fd, info.m.offset);
+        if (cam->buffer_start[i] == MAP_FAILED)
+        {
+            cam->buffer_start[i] = NULL;
+            usbcam_warn("Failed to allocate memory for buffers (%d): %s", errno, strerror(errno));
+            return -ENOMEM;
+        }
+        if (cam->has_dmabuf)
+        {
+            v4l2_exportbuffer expbuf = {0};
+            expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            expbuf.index = i;
+            expbuf.flags = O_RDONLY | O_CLOEXEC;
+            usbcam_try(usbcam_ioctl(cam, VIDIOC_EXPBUF, &expbuf));
+            cam->buffer_dmabuf[i] = expbuf.fd;
+        }
+        usbcam_try(usbcam_ioctl(cam, VIDIOC_QBUF, &info));
+    }
+    usbcam_check(cam->buffers == (int)buffers, -ENOMEM, "Did not get the requested number of buffers");
+    return 0;
+}
+
+// Stops the stream, frees the buffers and starts again in another mode,
+// without closing the device. The threads must be stopped.
+int usbcam_restart_stream(usbcam_t *cam, usbcam_opt_t opt)
+{
+    usbcam_stop_stream(cam);
+    // S_FMT is refused (EBUSY) as long as the driver has buffers
+    v4l2_requestbuffers request = {0};
+    request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    request.memory = cam->memory;
+    request.count = 0;
+    usbcam_try(usbcam_ioctl(cam, VIDIOC_REQBUFS, &request));
+    cam->buffers = 0;
+    return usbcam_start_stream(cam, opt);
+}
+
+int usbcam_reconfigure(usbcam_t *cam, const usbcam_mode_t *mode, unsigned int buffers)
+{
+    if (__atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE))
+        return -ENODEV;
+    usbcam_check(cam->has_fd, -EBADF, "Camera device not open");
+    usbcam_check(!cam->playback, -ENOTTY, "A recording has only the one mode");
+    usbcam_check(__atomic_load_n(&cam->frames_held, __ATOMIC_SEQ_CST) == 0, -EBUSY, "Release your frames before reconfiguring");
+
+    usbcam_opt_t opt = cam->opt;
+    if (mode)
+    {
+        opt.pixel_format = mode->pixel_format;
+        opt.width = mode->width;
+        opt.height = mode->height;
+        if (mode->interval_numerator && mode->interval_denominator)
+            opt.fps = (mode->interval_denominator + mode->interval_numerator/2) / mode->interval_numerator;
+    }
+    if (buffers)
+        opt.buffers = buffers;
+    usbcam_check(opt.buffers <= usbcam_max_buffers, -EINVAL, "You requested too many buffers");
+    usbcam_check(!opt.threaded || opt.buffers >= 3, -EINVAL, "You need atleast three buffers with a capture thread");
+    usbcam_check(!opt.decode_threads || (int)opt.buffers > opt.decode_threads, -EINVAL, "You need more buffers than decode threads");
+    usbcam_check(!opt.decode_threads || opt.pixel_format == V4L2_PIX_FMT_MJPEG || opt.pixel_format == V4L2_PIX_FMT_JPEG,
+                 -EINVAL, "Decode threads need a JPEG pixel format");
+    usbcam_check(opt.memory != usbcam_memory_dmabuf || opt.buffers <= cam->opt.buffers, -EINVAL,
+                 "You can't have more buffers than dmabuf_fds");
+    usbcam_check(!opt.decode_threads || usbcam_check_desired_size(opt.width, opt.height, opt.decode_width, opt.decode_height),
+                 -EINVAL, "Get a decode size that works from usbcam_scaled_size");
+
+    int same_mode = opt.pixel_format == cam->opt.pixel_format && opt.width == cam->opt.width &&
+                    opt.height == cam->opt.height && opt.fps == cam->opt.fps;
+    if (same_mode && opt.buffers == (unsigned int)cam->buffers)
+        return 0;
+
+    // a mode the camera doesn't have should cost nothing
+    if (!same_mode)
+    {
+        usbcam_mode_t want = { opt.pixel_format, opt.width, opt.height, 0, 0 };
+        usbcam_try(usbcam_device_error(cam, usbcam_try_mode(cam, &want)));
+    }
+
+    // decoded frames of the new size, allocated up front for the same reason
+    int decode_width = opt.decode_width ? opt.decode_width : (int)opt.width;
+    int decode_height = opt.decode_height ? opt.decode_height : (int)opt.height;
+    int resize_decode = opt.decode_threads > 0 && (decode_width != cam->decode_width || decode_height != cam->decode_height);
+    usbcam_pool_t *decode_pool = NULL;
+    usbcam_image_t decode_image[usbcam_max_decode_threads+2] = {0};
+    if (opt.decode_threads > 0)
+    {
+        pthread_mutex_lock(&cam->decode_mutex);
+        int locked = 0;
+        for (int i = 0; i < cam->decode_threads+2; i++)
+            locked |= cam->decode_slot[i].state == usbcam_slot_locked;
+        pthread_mutex_unlock(&cam->decode_mutex);
+        usbcam_check(!locked, -EBUSY, "Unlock your decoded frame before reconfiguring");
+    }
+    if (resize_decode)
+    {
+        decode_pool = usbcam_pool_create(decode_width, decode_height, cam->decode_format,
+                                         opt.decode_threads+2+opt.decode_keep, usbcam_pool_packed);
+        if (!decode_pool)
+            return -ENOMEM;
+        for (int i = 0; i < cam->decode_threads+2; i++)
+            usbcam_pool_acquire(decode_pool, &decode_image[i]);
+    }
+
+    usbcam_debug("Reconfiguring %s to %ux%u with %u buffers", opt.device_name, opt.width, opt.height, opt.buffers);
+    usbcam_pause_reconnect(cam);
+    usbcam_stop_threads(cam);
+
+    int r = -ENODEV;
+    int broken = 1;
+    if (!__atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE))
+    {
+        // the capture thread may have left a frame in the mailbox
+        int old = __atomic_exchange_n(&cam->mailbox, -1, __ATOMIC_ACQ_REL);
+        r = old >= 0 ? usbcam_ioctl(cam, VIDIOC_QBUF, &cam->dequeued_buf[old]) : 0;
+
+        // more buffers in the same mode can be added while streaming,
+        // anything else needs the stream stopped
+        int done = 0;
+        if (r == 0 && same_mode && opt.buffers > (unsigned int)cam->buffers && cam->memory == V4L2_MEMORY_MMAP)
+            done = (r = usbcam_add_buffers(cam, opt.buffers)) == 0;
+        if (!done && !usbcam_is_device_error(r))
+            r = usbcam_restart_stream(cam, opt);
+
+        if (r == 0)
+        {
+            if (opt.decode_threads > 0)
+            {
+                for (int i = 0; i < cam->decode_threads+2; i++)
+                {
+                    usbcam_decode_slot_t *slot = &cam->decode_slot[i];
+                    if (resize_decode)
+                    {
+                        usbcam_release_image(&slot->image);
+                        slot->image = decode_image[i];
+                        slot->frame.data = slot->image.data;
+                        slot->frame.size = slot->image.stride*slot->image.height;
+                        decode_image[i].pool = NULL;
+                    }
+                    slot->state = usbcam_slot_free; // frames of the old mode
+                }
+                if (resize_decode)
+                {
+                    // frames you kept from the old pool hold on to it
+                    usbcam_pool_destroy(cam->decode_pool);
+                    cam->decode_pool = decode_pool;
+                    decode_pool = NULL;
+                }
+                cam->decode_width = decode_width;
+                cam->decode_height = decode_height;
+            }
+            cam->opt = opt; // reconnect in the new mode
+            usbcam_reset_tuning(cam);
+            broken = usbcam_start_threads(cam, opt) < 0;
+        }
+        else if (!usbcam_is_device_error(r))
+        {
+            // go back to the old mode, so that the camera keeps working
+            usbcam_warn("Failed to reconfigure (%d): %s", -r, strerror(-r));
+            int restored = usbcam_restart_stream(cam, cam->opt);
+            if (restored == 0)
+                restored = usbcam_start_threads(cam, cam->opt);
+            broken = restored < 0;
+            if (usbcam_is_device_error(restored))
+                r = restored;
+        }
+    }
+    if (decode_pool)
+    {
+        for (int i = 0; i < cam->decode_threads+2; i++)
+            usbcam_release_image(&decode_image[i]);
+        usbcam_pool_destroy(decode_pool);
+    }
+
+    // the reconnect thread takes over from here
+    if (broken)
+        usbcam_device_lost(cam, usbcam_is_device_error(r) ? r : -ENODEV);
+    usbcam_resume_reconnect(cam);
+    return broken ? -ENODEV : r;
+}
+
+int usbcam_is_lost(usbcam_t *cam)
+{
+    return __atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE);
+}
+
+// Returns the newest decoded frame that can be delivered without
+// breaking capture order, i.e. no older frame is still being decoded.
+// Frames that are older than that one, or that failed to decode, are
+// dropped.
+usbcam_decode_slot_t *usbcam_take_newest_decoded(usbcam_t *cam)
+{
+    unsigned int oldest_decoding = UINT_MAX;
+    for (int i = 0; i < cam->decode_threads+2; i++)
+    {
+        usbcam_decode_slot_t *slot = &cam->decode_slot[i];
+        if (slot->state == usbcam_slot_decoding && slot->ticket && slot->ticket < oldest_decoding)
+            oldest_decoding = slot->ticket;
+    }
+
+    usbcam_decode_slot_t *newest = NULL;
+    for (int i = 0; i < cam->decode_threads+2; i++)
+    {
+        usbcam_decode_slot_t *slot = &cam->decode_slot[i];
+        if (slot->state == usbcam_slot_ready && slot->ticket < oldest_decoding && slot->ok &&
+            (!newest || slot->ticket > newest->ticket))
+            newest = slot;
+    }
+
+    for (int i = 0; i < cam->decode_threads+2; i++)
+    {
+        usbcam_decode_slot_t *slot = &cam->decode_slot[i];
+        if (slot != newest && slot->state == usbcam_slot_ready && slot->ticket < oldest_decoding &&
+            (!slot->ok || (newest && slot->ticket < newest->ticket)))
+        {
+            if (slot->ok)
+                usbcam_count(cam, skipped, 1);
+            slot->state = usbcam_slot_free;
+        }
+    }
+    return newest;
+}
+
+int usbcam_try_lock_rgb(usbcam_t *cam, usbcam_frame_t *frame, int timeout_us)
+{
+    usbcam_check(cam->decode_threads > 0, -EINVAL, "Decode threads were not enabled for this camera");
+    timespec deadline = usbcam_deadline(timeout_us);
+    pthread_mutex_lock(&cam->decode_mutex);
+    usbcam_decode_slot_t *slot;
+    while (!(slot = usbcam_take_newest_decoded(cam)))
+    {
+        int r = 0;
+        if (__atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE))
+            r = -ENODEV;
+        else if (timeout_us < 0)
+            pthread_cond_wait(&cam->decode_cond, &cam->decode_mutex);
+        else if (pthread_cond_timedwait(&cam->decode_cond, &cam->decode_mutex, &deadline) == ETIMEDOUT)
+            r = -EAGAIN;
+        if (r < 0)
+        {
+            pthread_mutex_unlock(&cam->decode_mutex);
+            return r;
+        }
+    }
+    slot->state = usbcam_slot_locked;
+    pthread_cond_broadcast(&cam->decode_cond);
+    pthread_mutex_unlock(&cam->decode_mutex);
+    *frame = slot->frame;
+    usbcam_count_delivered(cam, frame->timestamp, frame->flags);
+    return 0;
+}
+
+int usbcam_lock_rgb(usbcam_t *cam, usbcam_frame_t *frame) { return usbcam_try_lock_rgb(cam, frame, -1); }
+
+int usbcam_unlock_rgb(usbcam_t *cam, usbcam_frame_t *frame)
+{
+    usbcam_check(cam->decode_threads > 0, -EINVAL, "Decode threads were not enabled for this camera");
+    pthread_mutex_lock(&cam->decode_mutex);
+    usbcam_decode_slot_t *slot = &cam->decode_slot[frame->index];
+    int r = 0;
+    if (slot->state == usbcam_slot_locked)
+    {
+        slot->state = usbcam_slot_free;
+        pthread_cond_broadcast(&cam->decode_cond);
+    }
+    else
+    {
+        usbcam_warn("You already unlocked the frame");
+        r = -EINVAL;
+    }
+    pthread_mutex_unlock(&cam->decode_mutex);
+    return r;
+}
+
+int usbcam_keep_rgb(usbcam_t *cam, usbcam_frame_t *frame, usbcam_image_t *image)
+{
+    usbcam_check(cam->decode_threads > 0, -EINVAL, "Decode threads were not enabled for this camera");
+    usbcam_image_t fresh;
+    if (usbcam_pool_acquire(cam->decode_pool, &fresh) < 0)
+        return -EAGAIN; // all decode_keep frames are still kept
+    pthread_mutex_lock(&cam->decode_mutex);
+    usbcam_decode_slot_t *slot = &cam->decode_slot[frame->index];
+    int r = 0;
+    if (slot->state == usbcam_slot_locked)
+    {
+        *image = slot->image;
+        slot->image = fresh;
+        slot->frame.data = fresh.data;
+        slot->state = usbcam_slot_free;
+        pthread_cond_broadcast(&cam->decode_cond);
+    }
+    else
+    {
+        usbcam_warn("You already unlocked the frame");
+        r = -EINVAL;
+    }
+    pthread_mutex_unlock(&cam->decode_mutex);
+    if (r < 0)
+        usbcam_release_image(&fresh);
+    return r;
+}
+
+// Waits until the device is readable, or returns -EAGAIN at the deadline
+int usbcam_wait_readable(usbcam_t *cam, int timeout_us, timespec deadline)
+{
+    pollfd fds;
+    fds.fd = cam->fd;
+    fds.events = POLLIN;
+    for (;;)
+    {
+        timespec left = deadline;
+        if (timeout_us >= 0)
+        {
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t ns = (int64_t)(deadline.tv_sec - now.tv_sec)*1000000000 + (deadline.tv_nsec - now.tv_nsec);
+            if (ns <= 0)
+                return -EAGAIN;
+            left.tv_sec = ns / 1000000000;
+            left.tv_nsec = ns % 1000000000;
+        }
+        int r = ppoll(&fds, 1, timeout_us < 0 ? NULL : &left, NULL);
+        if (r > 0)
+            return 0;
+        if (r == -1 && errno != EINTR)
+            usbcam_check(0, -errno, "Failed to poll camera (%d): %s", errno, strerror(errno));
+    }
+}
+
+// dequeue all the buffers and select the one with latest data, waiting
+// up to timeout_us for the first one
+int usbcam_dequeue_latest(usbcam_t *cam, v4l2_buffer *buf, int timeout_us)
+{
+    // get a buffer
+    timespec deadline = usbcam_deadline(timeout_us);
+    int r;
+    while ((r = usbcam_ioctl(cam, VIDIOC_DQBUF, buf)) == -EAGAIN && timeout_us != 0)
+        usbcam_try(usbcam_wait_readable(cam, timeout_us, deadline));
+    if (r < 0)
+        return r;
+    usbcam_count_dequeued(cam, buf);
+    if (cam->opt.playback == usbcam_playback_fast) // every frame is the latest
+        return 0;
+
+    // take newer buffers for as long as the driver has any (the fd is non-blocking)
+    for (;;)
+    {
+        v4l2_buffer next = {0};
+        next.type = buf->type;
+        next.memory = buf->memory;
+        r = usbcam_ioctl(cam, VIDIOC_DQBUF, &next);
+        if (r == -EAGAIN)
+            return 0;
+        if (r == 0)
+        {
+            // queue the previous buffer
+            usbcam_count_dequeued(cam, &next);
+            usbcam_count(cam, skipped, 1);
+            r = usbcam_ioctl(cam, VIDIOC_QBUF, buf);
+            *buf = next;
+        }
+        if (r < 0)
+        {
+            usbcam_ioctl(cam, VIDIOC_QBUF, buf);
+            return r; // we don't hold a buffer anymore
+        }
+    }
+}
+
+int usbcam_try_lock_frame(usbcam_t *cam, usbcam_frame_t *frame, int timeout_us)
+{
+    // counted before we look at the device, so that a reconnect
+    // doesn't unmap the buffer under us (see usbcam_reconnect_thread)
+    int held = __atomic_fetch_add(&cam->frames_held, 1, __ATOMIC_SEQ_CST);
+    int r = 0;
+    do
+    {
+        if (__atomic_load_n(&cam->lost, __ATOMIC_SEQ_CST)) { r = -ENODEV; break; }
+        if (!cam->has_fd) { usbcam_warn("Camera device not open"); r = -EBADF; break; }
+        if (!cam->has_mmap) { usbcam_warn("Buffers not allocated"); r = -EINVAL; break; }
+        if (!cam->has_stream) { usbcam_warn("Stream not begun"); r = -EINVAL; break; }
+        if (cam->decode_threads) { usbcam_warn("Use usbcam_lock_rgb when decode threads are enabled"); r = -EINVAL; break; }
+
+        // the driver (and the capture thread's mailbox) must keep a buffer,
+        // otherwise we would wait forever for one to be filled
+        int reserved = cam->opt.threaded ? 2 : 1;
+        if (held + reserved > cam->buffers)
+        {
+            usbcam_warn("You are holding too many frames (%d of %d buffers)", held, cam->buffers);
+            r = -ENOBUFS;
+            break;
+        }
+
+        v4l2_buffer buf = {0};
+        if (cam->opt.threaded)
+        {
+            // take the newest frame out of the mailbox, or sleep until there is one
+            timespec deadline = usbcam_deadline(timeout_us);
+            int index = -1;
+            for (;;)
+            {
+                index = __atomic_load_n(&cam->mailbox, __ATOMIC_ACQUIRE);
+                if (index == usbcam_mailbox_lost)
+                    break;
+                if (index >= 0 && __atomic_compare_exchange_n(&cam->mailbox, &index, -1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                    break;
+                if (index != -1)
+                    continue;
+                if (timeout_us < 0)
+                {
+                    syscall(SYS_futex, &cam->mailbox, FUTEX_WAIT_PRIVATE, -1, NULL, NULL, 0);
+                    continue;
+                }
+                // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline
+                if (syscall(SYS_futex, &cam->mailbox, FUTEX_WAIT_BITSET_PRIVATE, -1, &deadline, NULL, FUTEX_BITSET_MATCH_ANY) == -1 &&
+                    errno == ETIMEDOUT)
+                {
+                    r = -EAGAIN;
+                    break;
+                }
+            }
+            if (r < 0)
+                break;
+            if (index == usbcam_mailbox_lost) { r = -ENODEV; break; }
+            buf = cam->dequeued_buf[index];
+        }
+        else
+        {
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.memory = cam->memory;
+            if ((r = usbcam_dequeue_latest(cam, &buf, timeout_us)) < 0)
+            {
+                r = usbcam_device_error(cam, r);
+                break;
+            }
+        }
+
+        cam->dequeued_buf[buf.index] = buf;
+        cam->locked_ns[buf.index] = usbcam_now_ns();
+        usbcam_raise(&cam->held_max, (unsigned long long)held+1);
+        __atomic_store_n(&cam->refcount[buf.index], 1, __ATOMIC_RELEASE);
+
+        frame->index = buf.index;
+        frame->data = (unsigned char*)cam->buffer_start[buf.index];
+        frame->size = buf.bytesused;
+        frame->timestamp = buf.timestamp;
+        frame->sequence = buf.sequence;
+        frame->flags = buf.flags;
+        frame->dmabuf_fd = (cam->has_dmabuf || cam->memory == V4L2_MEMORY_DMABUF) ? cam->buffer_dmabuf[buf.index] : -1;
+        usbcam_count_delivered(cam, buf.timestamp, buf.flags);
+        return 0;
+    } while (0);
+
+    __atomic_sub_fetch(&cam->frames_held, 1, __ATOMIC_SEQ_CST);
+    return r;
+}
+
+int usbcam_lock_frame(usbcam_t *cam, usbcam_frame_t *frame) { return usbcam_try_lock_frame(cam, frame, -1); }
+
+int usbcam_retain_frame(usbcam_t *cam, usbcam_frame_t *frame)
+{
+    int n = __atomic_add_fetch(&cam->refcount[frame->index], 1, __ATOMIC_ACQ_REL);
+    if (n <= 1)
+    {
+        __atomic_sub_fetch(&cam->refcount[frame->index], 1, __ATOMIC_ACQ_REL);
+        usbcam_warn("You retained a frame that was already released");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int usbcam_release_frame(usbcam_t *cam, usbcam_frame_t *frame)
+{
+    int n = __atomic_sub_fetch(&cam->refcount[frame->index], 1, __ATOMIC_ACQ_REL);
+    if (n < 0)
+    {
+        __atomic_add_fetch(&cam->refcount[frame->index], 1, __ATOMIC_ACQ_REL);
+        usbcam_warn("You already released the frame");
+        return -EINVAL;
+    }
+    int r = 0;
+    if (n == 0)
+    {
+        // V4L2 serializes ioctls on the same device, so this is safe
+        // even if another thread is dequeuing at the same time. If the
+        // device is gone there is nothing to give the buffer back to.
+        v4l2_buffer *buf = &cam->dequeued_buf[frame->index];
+        usbcam_count_done(cam, buf->timestamp, buf->flags, cam->locked_ns[frame->index]);
+        if (!__atomic_load_n(&cam->lost, __ATOMIC_SEQ_CST))
+            r = usbcam_device_error(cam, usbcam_ioctl(cam, VIDIOC_QBUF, buf));
+        __atomic_sub_fetch(&cam->frames_held, 1, __ATOMIC_SEQ_CST);
+    }
+    return r;
+}
+
+int usbcam_unlock(usbcam_t *cam)
+{
+    if (cam->has_lock)
+    {
+        cam->has_lock = 0;
+        return usbcam_release_frame(cam, &cam->lock_frame);
+    }
+    else
+    {
+        usbcam_warn("You already unlocked the frame");
+        return -EINVAL;
+    }
+}
+
+int usbcam_try_lock(usbcam_t *cam, int timeout_us, unsigned char **data, unsigned int *size, timeval *timestamp)
+{
+    if (cam->has_lock)
+    {
+        // you should unlock frames as soon as you are done processing them for best performance
+        usbcam_warn("You did not unlock the previous frame");
+        usbcam_unlock(cam);
+    }
+
+    usbcam_try(usbcam_try_lock_frame(cam, &cam->lock_frame, timeout_us));
+    *timestamp = cam->lock_frame.timestamp;
+    *data = cam->lock_frame.data;
+    *size = cam->lock_frame.size;
+    cam->has_lock = 1;
+    return 0;
+}
+
+int usbcam_lock(usbcam_t *cam, unsigned char **data, unsigned int *size, timeval *timestamp)
+{
+    return usbcam_try_lock(cam, -1, data, size, timestamp);
+}
+
+int usbcam_get_stats(usbcam_t *cam, usbcam_stats_t *stats)
+{
+    unsigned long long *src = (unsigned long long*)&cam->stats;
+    unsigned long long *dst = (unsigned long long*)stats;
+    for (size_t i = 0; i < sizeof(usbcam_stats_t)/sizeof(unsigned long long); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    return 0;
+}
+
+void usbcam_reset_stats(usbcam_t *cam)
+{
+    unsigned long long *p = (unsigned long long*)&cam->stats;
+    for (size_t i = 0; i < sizeof(usbcam_stats_t)/sizeof(unsigned long long); i++)
+        __atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+}
+
+int usbcam_tune_buffers(usbcam_t *cam)
+{
+    // measure over a few frames, at least one of which was given back
+    unsigned int frames = __atomic_load_n(&cam->interval_frames, __ATOMIC_RELAXED);
+    long long first = __atomic_load_n(&cam->first_ns, __ATOMIC_RELAXED);
+    long long last = __atomic_load_n(&cam->last_ns, __ATOMIC_RELAXED);
+    unsigned int captured = __atomic_load_n(&cam->last_sequence, __ATOMIC_RELAXED) -
+                            __atomic_load_n(&cam->first_sequence, __ATOMIC_RELAXED);
+    long long hold_ns = (long long)__atomic_load_n(&cam->hold_max_ns, __ATOMIC_RELAXED);
+    if (frames < usbcam_tune_min_frames || last <= first || hold_ns == 0)
+        return -EAGAIN;
+
+    // the sequence numbers also count frames the driver had no buffer
+    // for, unless the driver doesn't fill them in
+    if (captured < frames - 1 || captured > 100*frames)
+        captured = frames - 1;
+    long long interval_ns = (last - first) / captured;
+    int held = (int)__atomic_load_n(&cam->held_max, __ATOMIC_RELAXED);
+    int needed = (int)usbcam_needed_buffers(cam->opt, held > 0 ? held : 1, hold_ns, interval_ns);
+
+    // adding buffers is cheap, but taking them away restarts the
+    // stream, so don't bother for one
+    if (needed < cam->buffers && needed + 1 >= cam->buffers)
+        needed = cam->buffers;
+    if (needed != cam->buffers)
+    {
+        usbcam_debug("Tuning %s to %d buffers (held %d for up to %lld us, a frame every %lld us)",
+                     cam->opt.device_name, needed, held, hold_ns/1000, interval_ns/1000);
+        usbcam_try(usbcam_reconfigure(cam, NULL, (unsigned int)needed));
+    }
+
+    usbcam_reset_tuning(cam);
+    return needed;
+}
+
+int usbcam_fd(usbcam_t *cam)
+{
+    usbcam_check(!cam->opt.threaded && !cam->decode_threads, -EINVAL, "The camera's threads are already waiting on the fd");
+    if (__atomic_load_n(&cam->lost, __ATOMIC_ACQUIRE))
+        return -ENODEV;
+    usbcam_check(cam->has_fd, -EBADF, "Camera device not open");
+    return cam->fd;
+}
+
+struct usbcam_epoll_entry_t
+{
+    usbcam_t         *cam;
+    usbcam_callback_t callback;
+    void             *userdata;
+    int               fd; // the fd we registered, or -1 while the camera is lost
+};
+
+struct usbcam_epoll_t
+{
+    int                  fd;
+    usbcam_epoll_entry_t entries[usbcam_max_cameras];
+};
+
+usbcam_epoll_t *usbcam_epoll_create()
+{
+    usbcam_epoll_t *ep = (usbcam_epoll_t*)calloc(1, sizeof(usbcam_epoll_t));
+    if (!ep)
+    {
+        usbcam_warn("Failed to allocate epoll handle");
+        return NULL;
+    }
+    ep->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ep->fd < 0)
+    {
+        usbcam_warn("Failed to create epoll instance (%d): %s", errno, strerror(errno));
+        free(ep);
+        return NULL;
+    }
+    return ep;
+}
+
+void usbcam_epoll_destroy(usbcam_epoll_t *ep)
+{
+    if (!ep)
+        return;
+    close(ep->fd);
+    free(ep);
+}
+
+int usbcam_epoll_register(usbcam_epoll_t *ep, usbcam_epoll_entry_t *entry)
+{
+    epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = entry;
+    usbcam_check(epoll_ctl(ep->fd, EPOLL_CTL_ADD, entry->cam->fd, &event) == 0, -errno,
+                 "Failed to add camera to epoll (%d): %s", errno, strerror(errno));
+    entry->fd = entry->cam->fd;
+    return 0;
+}
+
+int usbcam_epoll_add(usbcam_epoll_t *ep, usbcam_t *cam, usbcam_callback_t callback, void *userdata)
+{
+    usbcam_check(cam->has_fd && cam->has_stream, -EINVAL, "Camera must be streaming before it is added");
+    usbcam_check(!cam->has_thread && !cam->decode_threads, -EINVAL, "Camera already has a capture thread");
+    usbcam_epoll_entry_t *entry = NULL;
+    for (int i = 0; i < usbcam_max_cameras && !entry; i++)
+        if (!ep->entries[i].cam)
+            entry = &ep->entries[i];
+    usbcam_check(entry, -ENOSPC, "You added too many cameras (max %d)", usbcam_max_cameras);
+
+    entry->cam = cam;
+    entry->callback = callback;
+    entry->userdata = userdata;
+    int r = usbcam_epoll_register(ep, entry);
+    if (r < 0)
+        entry->cam = NULL;
+    return r;
+}
+
+int usbcam_epoll_remove(usbcam_epoll_t *ep, usbcam_t *cam)
+{
+    for (int i = 0; i < usbcam_max_cameras; i++)
+    {
+        if (ep->entries[i].cam == cam)
+        {
+            if (ep->entries[i].fd >= 0)
+                epoll_ctl(ep->fd, EPOLL_CTL_DEL, ep->entries[i].fd, NULL);
+            ep->entries[i].cam = NULL;
+            return 0;
+        }
+    }
+    usbcam_warn("That camera was not added");
+    return -ENOENT;
+}
+
+int usbcam_epoll_wait(usbcam_epoll_t *ep, int timeout_ms)
+{
+    // pick up cameras that have come back since they were lost
+    for (int i = 0; i < usbcam_max_cameras; i++)
+    {
+        usbcam_epoll_entry_t *entry = &ep->entries[i];
+        if (entry->cam && entry->fd < 0 && !usbcam_is_lost(entry->cam))
+            usbcam_epoll_register(ep, entry);
+    }
+
+    epoll_event events[usbcam_max_cameras];
+    int n = epoll_wait(ep->fd, events, usbcam_max_cameras, timeout_ms);
+    if (n == -1)
+    {
+        usbcam_check(errno == EINTR, -errno, "epoll_wait failed (%d): %s", errno, strerror(errno));
+        return 0;
+    }
+
+    int delivered = 0;
+    for (int i = 0; i < n; i++)
+    {
+        usbcam_epoll_entry_t *entry = (usbcam_epoll_entry_t*)events[i].data.ptr;
+        usbcam_t *cam = entry->cam;
+        if (!cam || entry->fd < 0)
+            continue;
+
+        // readiness means at least one buffer is done, so DQBUF won't block,
+        // and on an error it tells us what went wrong
+        v4l2_buffer buf = {0};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = cam->memory;
+        int r = usbcam_dequeue_latest(cam, &buf, 0);
+        if (r == -EAGAIN) // spurious wakeup
+            continue;
+        if (r == 0)
+        {
+            usbcam_count_delivered(cam, buf.timestamp, buf.flags);
+            long long taken_ns = usbcam_now_ns();
+            entry->callback(cam, (unsigned char*)cam->buffer_start[buf.index], buf.bytesused, buf.timestamp, entry->userdata);
+            usbcam_count_done(cam, buf.timestamp, buf.flags, taken_ns);
+            r = usbcam_ioctl(cam, VIDIOC_QBUF, &buf);
+            delivered++;
+        }
+
+        // stop listening to a camera that is gone until it's back
+        // (before the reconnect thread gets to close the fd)
+        if (r < 0)
+        {
+            epoll_ctl(ep->fd, EPOLL_CTL_DEL, entry->fd, NULL);
+            entry->fd = -1;
+            usbcam_device_lost(cam, usbcam_is_device_error(r) ? r : -ENODEV);
+        }
+    }
+    return delivered;
+}
+
+struct usbcam_sync_t
+{
+    int count;
+    int depth;
+    long long tolerance_ns;
+    usbcam_t *cams[usbcam_max_cameras];
+
+    // frames we hold from each camera that haven't been matched yet, oldest first
+    usbcam_frame_t queue[usbcam_max_cameras][usbcam_sync_max_depth];
+    long long queue_ns[usbcam_max_cameras][usbcam_sync_max_depth];
+    int queued[usbcam_max_cameras];
+
+    // the tuple we gave out in usbcam_sync_lock
+    usbcam_frame_t locked[usbcam_max_cameras];
+    int has_lock;
+};
+
+usbcam_sync_t *usbcam_sync_create(usbcam_t **cams, int count, long long tolerance_ns, int depth)
+{
+    if (count < 1 || count > usbcam_max_cameras)
+    {
+        usbcam_warn("A sync group has 1 to %d cameras (you gave %d)", usbcam_max_cameras, count);
+        return NULL;
+    }
+    if (tolerance_ns < 0 || depth < 0 || depth > usbcam_sync_max_depth)
+    {
+        usbcam_warn("tolerance_ns can't be negative, and depth must be 0 to %d", usbcam_sync_max_depth);
+        return NULL;
+    }
+
+    // each camera keeps a buffer in the driver (and one in the capture
+    // thread's mailbox) while we hold a full queue and lock one more
+    int most = usbcam_sync_max_depth;
+    for (int i = 0; i < count; i++)
+    {
+        usbcam_t *cam = cams[i];
+        if (!cam->has_stream || cam->decode_threads)
+        {
+            usbcam_warn("Camera %d must be streaming, without decode threads", i);
+            return NULL;
+        }
+        int reserved = cam->opt.threaded ? 2 : 1;
+        if ((int)cam->buffers - reserved - 1 < most)
+            most = (int)cam->buffers - reserved - 1;
+    }
+    if (most < 1 || depth > most)
+    {
+        usbcam_warn("Not enough buffers to queue %d frames per camera (at most %d)", depth ? depth : 1, most < 0 ? 0 : most);
+        return NULL;
+    }
+
+    usbcam_sync_t *sync = (usbcam_sync_t*)calloc(1, sizeof(usbcam_sync_t));
+    if (!sync)
+    {
+        usbcam_warn("Failed to allocate sync group");
+        return NULL;
+    }
+    sync->count = count;
+    sync->depth = depth ? depth : (most < 3 ? most : 3);
+    sync->tolerance_ns = tolerance_ns;
+    for (int i = 0; i < count; i++)
+        sync->cams[i] = cams[i];
+    return sync;
+}
+
+// Requeues the n oldest frames we hold from camera i
+void usbcam_sync_drop(usbcam_sync_t *sync, int i, int n)
+{
+    for (int j = 0; j < n; j++)
+        usbcam_release_frame(sync->cams[i], &sync->queue[i][j]);
+    sync->queued[i] -= n;
+    memmove(&sync->queue[i][0], &sync->queue[i][n], sync->queued[i]*sizeof(usbcam_frame_t));
+    memmove(&sync->queue_ns[i][0], &sync->queue_ns[i][n], sync->queued[i]*sizeof(long long));
+}
+
+// Locks the newest frame from camera i, if there is one by timeout_us,
+// and queues it, making room by requeueing the oldest frame
+int usbcam_sync_take(usbcam_sync_t *sync, int i, int timeout_us)
+{
+    usbcam_frame_t frame;
+    int r = usbcam_try_lock_frame(sync->cams[i], &frame, timeout_us);
+    if (r == -ENODEV) // let it reconnect (it waits for every frame we hold)
+        usbcam_sync_drop(sync, i, sync->queued[i]);
+    if (r < 0)
+        return r;
+
+    // timestamps only go forward, unless the camera was reconnected
+    long long ns = usbcam_timestamp_ns(&frame);
+    int n = sync->queued[i];
+    if (n > 0 && ns <= sync->queue_ns[i][n-1])
+        usbcam_sync_drop(sync, i, n);
+    else if (n == sync->depth)
+        usbcam_sync_drop(sync, i, 1);
+
+    n = sync->queued[i]++;
+    sync->queue[i][n] = frame;
+    sync->queue_ns[i][n] = ns;
+    return 0;
+}
+
+// Index of the frame we hold from camera i that is closest to ns, or -1
+int usbcam_sync_closest(usbcam_sync_t *sync, int i, long long ns)
+{
+    int best = -1;
+    long long best_diff = 0;
+    for (int j = 0; j < sync->queued[i]; j++)
+    {
+        long long diff = llabs(sync->queue_ns[i][j] - ns);
+        if (best < 0 || diff < best_diff)
+        {
+            best = j;
+            best_diff = diff;
+        }
+    }
+    if (best >= 0 && best_diff > sync->tolerance_ns)
+        return -1;
+    return best;
+}
+
+// Finds the newest tuple where every frame is within the tolerance of
+// the first camera's frame, and puts the index of each frame in pick
+bool usbcam_sync_match(usbcam_sync_t *sync, int *pick)
+{
+    for (int j = sync->queued[0]-1; j >= 0; j--)
+    {
+        pick[0] = j;
+        int i = 1;
+        while (i < sync->count && (pick[i] = usbcam_sync_closest(sync, i, sync->queue_ns[0][j])) >= 0)
+            i++;
+        if (i == sync->count)
+            return true;
+    }
+    return false;
+}
+
+// Requeues frames that can't be part of any tuple anymore: a frame from
+// another camera is only still useful if the first camera has a frame
+// close to it, or can still capture one, and a frame from the first
+// camera if every other camera has, or can still capture, a frame close
+// to it. Frames are captured in order, so a camera can't capture one
+// older than the newest we hold, and the oldest frames go first.
+void usbcam_sync_prune(usbcam_sync_t *sync)
+{
+    long long tolerance = sync->tolerance_ns;
+    while (sync->queued[0] > 0)
+    {
+        long long ns = sync->queue_ns[0][0];
+        int i = 1;
+        for (; i < sync->count; i++)
+        {
+            int n = sync->queued[i];
+            if (n > 0 && sync->queue_ns[i][n-1] >= ns + tolerance && usbcam_sync_closest(sync, i, ns) < 0)
+                break;
+        }
+        if (i == sync->count)
+            break;
+        usbcam_sync_drop(sync, 0, 1);
+    }
+
+    int n0 = sync->queued[0];
+    if (n0 == 0)
+        return;
+    long long newest = sync->queue_ns[0][n0-1];
+    for (int i = 1; i < sync->count; i++)
+    {
+        int n = 0;
+        while (n < sync->queued[i] && newest >= sync->queue_ns[i][n] + tolerance &&
+               usbcam_sync_closest(sync, 0, sync->queue_ns[i][n]) < 0)
+            n++;
+        usbcam_sync_drop(sync, i, n);
+    }
+}
+
+int usbcam_sync_lock(usbcam_sync_t *sync, usbcam_frame_t *frames, int timeout_us)
+{
+    if (sync->has_lock)
+    {
+        usbcam_warn("You did not unlock the previous tuple");
+        usbcam_sync_unlock(sync);
+    }
+
+    timespec deadline = usbcam_deadline(timeout_us);
+    for (;;)
+    {
+        // pick up whatever every camera has captured since last time
+        for (int i = 0; i < sync->count; i++)
+        {
+            int r = usbcam_sync_take(sync, i, 0);
+            if (r < 0 && r != -EAGAIN)
+                return r;
+        }
+
+        int pick[usbcam_max_cameras];
+        if (usbcam_sync_match(sync, pick))
+        {
+            // frames older than the tuple would only make older tuples
+            for (int i = 0; i < sync->count; i++)
+            {
+                usbcam_sync_drop(sync, i, pick[i]);
+                frames[i] = sync->locked[i] = sync->queue[i][0];
+                sync->queued[i]--;
+                memmove(&sync->queue[i][0], &sync->queue[i][1], sync->queued[i]*sizeof(usbcam_frame_t));
+                memmove(&sync->queue_ns[i][0], &sync->queue_ns[i][1], sync->queued[i]*sizeof(long long));
+            }
+            sync->has_lock = 1;
+            return 0;
+        }
+        usbcam_sync_prune(sync);
+
+        // every tuple we can still make needs a newer frame from the
+        // camera that is furthest behind, so sleep on that one
+        int behind = 0;
+        for (int i = 0; i < sync->count; i++)
+        {
+            int n = sync->queued[i];
+            int m = sync->queued[behind];
+            if (n == 0 || (m > 0 && sync->queue_ns[i][n-1] < sync->queue_ns[behind][m-1]))
+                behind = i;
+            if (n == 0)
+                break;
+        }
+
+        int left_us = -1;
+        if (timeout_us >= 0)
+        {
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t ns = (int64_t)(deadline.tv_sec - now.tv_sec)*1000000000 + (deadline.tv_nsec - now.tv_nsec);
+            if (ns <= 0)
+                return -EAGAIN;
+            left_us = (int)((ns + 999) / 1000);
+        }
+        int r = usbcam_sync_take(sync, behind, left_us);
+        if (r < 0)
+            return r;
+    }
+}
+
+int usbcam_sync_unlock(usbcam_sync_t *sync)
+{
+    usbcam_check(sync->has_lock, -EINVAL, "You already unlocked the tuple");
+    sync->has_lock = 0;
+    int r = 0;
+    for (int i = 0; i < sync->count; i++)
+    {
+        int ri = usbcam_release_frame(sync->cams[i], &sync->locked[i]);
+        if (ri < 0 && r == 0)
+            r = ri;
+    }
+    return r;
+}
+
+void usbcam_sync_destroy(usbcam_sync_t *sync)
+{
+    if (!sync)
+        return;
+    if (sync->has_lock)
+        usbcam_sync_unlock(sync);
+    for (int i = 0; i < sync->count; i++)
+        usbcam_sync_drop(sync, i, sync->queued[i]);
+    free(sync);
+}
+
+usbcam_t *usbcam_open(usbcam_opt_t opt)
+{
+    usbcam_t *cam = (usbcam_t*)calloc(1, sizeof(usbcam_t));
+    if (!cam)
+    {
+        usbcam_warn("Failed to allocate camera handle");
+        return NULL;
+    }
+    if (usbcam_init(cam, opt) < 0)
+    {
+        free(cam);
+        return NULL;
+    }
+    return cam;
+}
+
+void usbcam_close(usbcam_t *cam)
+{
+    if (!cam)
+        return;
+    usbcam_cleanup(cam);
+    free(cam);
+}
+
+int usbcam_init(usbcam_opt_t opt) { return usbcam_init(&usbcam_default, opt); }
+void usbcam_cleanup() { usbcam_cleanup(&usbcam_default); }
+int usbcam_unlock() { return usbcam_unlock(&usbcam_default); }
+int usbcam_get_stats(usbcam_stats_t *stats) { return usbcam_get_stats(&usbcam_default, stats); }
+int usbcam_lock(unsigned char **data, unsigned int *size, timeval *timestamp) { return usbcam_lock(&usbcam_default, data, size, timestamp); }
+int usbcam_set_control(unsigned int id, int value) { return usbcam_set_control(&usbcam_default, id, value); }
+int usbcam_get_control(unsigned int id, int *value) { return usbcam_get_control(&usbcam_default, id, value); }
+int usbcam_enum_controls(usbcam_control_info_t *controls, int max_controls) { return usbcam_enum_controls(&usbcam_default, controls, max_controls); }
+int usbcam_find_control(const char *name) { return usbcam_find_control(&usbcam_default, name); }
+int usbcam_reconfigure(const usbcam_mode_t *mode, unsigned int buffers) { return usbcam_reconfigure(&usbcam_default, mode, buffers); }
+int usbcam_tune_buffers() { return usbcam_tune_buffers(&usbcam_default); }
+
+//
+// Raw pixel format conversion (see §RAW FORMATS)
+//
+
+// BT.601 limited range in 6-bit fixed point (75 ~ 1.164*64 etc.), the
+// same in every code path so that SIMD and scalar output match exactly
+#define usbcam_yuv_y   75
+#define usbcam_yuv_rv 102
+#define usbcam_yuv_gu  25
+#define usbcam_yuv_gv  52
+#define usbcam_yuv_bu 129
+// JPEG (JFIF) YCbCr is full range instead, which is what a hardware
+// decoder gives you (see §DECODERS)
+#define usbcam_jfif_rv  90
+#define usbcam_jfif_gu  22
+#define usbcam_jfif_gv  46
+#define usbcam_jfif_bu 113
+
+static inline unsigned char usbcam_clamp_u8(int x) { return (unsigned char)(x < 0 ? 0 : (x > 255 ? 255 : x)); }
+
+static inline void usbcam_yuv_to_rgb_scalar(int y, int u, int v, unsigned char *rgb, bool full = false)
+{
+    int yy = full ? y*64 + 32 : (y - 16)*usbcam_yuv_y + 32;
+    u -= 128;
+    v -= 128;
+    rgb[0] = usbcam_clamp_u8((yy + (full ? usbcam_jfif_rv : usbcam_yuv_rv)*v) >> 6);
+    rgb[1] = usbcam_clamp_u8((yy - (full ? usbcam_jfif_gu : usbcam_yuv_gu)*u - (full ? usbcam_jfif_gv : usbcam_yuv_gv)*v) >> 6);
+    rgb[2] = usbcam_clamp_u8((yy + (full ? usbcam_jfif_bu : usbcam_yuv_bu)*u) >> 6);
+}
+
+#if defined(__SSE2__)
+// Converts 16 pixels, given as 16 luma values (lo: pixels 0-7, hi: 8-15)
+// and 8 u and v values shared by pixel pairs, into 48 bytes of RGB
+static inline void usbcam_sse2_yuv16_to_rgb(__m128i y_lo, __m128i y_hi, __m128i u, __m128i v, unsigned char *rgb, bool full = false)
+{
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i c16 = _mm_set1_epi16(full ? 0 : 16);
+    const __m128i c32 = _mm_set1_epi16(32);
+    const __m128i cy = _mm_set1_epi16(full ? 64 : usbcam_yuv_y);
+    u = _mm_sub_epi16(u, c128);
+    v = _mm_sub_epi16(v, c128);
+    __m128i rv = _mm_mullo_epi16(v, _mm_set1_epi16(full ? usbcam_jfif_rv : usbcam_yuv_rv));
+    __m128i gu = _mm_mullo_epi16(u, _mm_set1_epi16(full ? usbcam_jfif_gu : usbcam_yuv_gu));
+    __m128i gv = _mm_mullo_epi16(v, _mm_set1_epi16(full ? usbcam_jfif_gv : usbcam_yuv_gv));
+    __m128i bu = _mm_mullo_epi16(u, _mm_set1_epi16(full ? usbcam_jfif_bu : usbcam_yuv_bu));
+    __m128i g_uv = _mm_add_epi16(gu, gv);
+    y_lo = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(y_lo, c16), cy), c32);
+    y_hi = _mm_add_epi16(_mm_mullo_epi16(_mm_sub_epi16(y_hi, c16), cy), c32);
+
+    // each chroma term applies to two neighbouring pixels
+    // (saturation only affects values that are clamped to 255 anyway)
+    __m128i r_lo = _mm_srai_epi16(_mm_adds_epi16(y_lo, _mm_unpacklo_epi16(rv, rv)), 6);
+    __m128i r_hi = _mm_srai_epi16(_mm_adds_epi16(y_hi, _mm_unpackhi_epi16(rv, rv)), 6);
+    __m128i g_lo = _mm_srai_epi16(_mm_subs_epi16(y_lo, _mm_unpacklo_epi16(g_uv, g_uv)), 6);
+    __m128i g_hi = _mm_srai_epi16(_mm_subs_epi16(y_hi, _mm_unpackhi_epi16(g_uv, g_uv)), 6);
+    __m128i b_lo = _mm_srai_epi16(_mm_adds_epi16(y_lo, _mm_unpacklo_epi16(bu, bu)), 6);
+    __m128i b_hi = _mm_srai_epi16(_mm_adds_epi16(y_hi, _mm_unpackhi_epi16(bu, bu)), 6);
+    __m128i r = _mm_packus_epi16(r_lo, r_hi);
+    __m128i g = _mm_packus_epi16(g_lo, g_hi);
+    __m128i b = _mm_packus_epi16(b_lo, b_hi);
+
+    #if defined(__SSSE3__)
+    const __m128i r0 = _mm_setr_epi8(0,-128,-128,1,-128,-128,2,-128,-128,3,-128,-128,4,-128,-128,5);
+    const __m128i g0 = _mm_setr_epi8(-128,0,-128,-128,1,-128,-128,2,-128,-128,3,-128,-128,4,-128,-128);
+    const __m128i b0 = _mm_setr_epi8(-128,-128,0,-128,-128,1,-128,-128,2,-128,-128,3,-128,-128,4,-128);
+    const __m128i r1 = _mm_setr_epi8(-128,-128,6,-128,-128,7,-128,-128,8,-128,-128,9,-128,-128,10,-128);
+    const __m128i g1 = _mm_setr_epi8(5,-128,-128,6,-128,-128,7,-128,-128,8,-128,-128,9,-128,-128,10);
+    const __m128i b1 = _mm_setr_epi8(-128,5,-128,-128,6,-128,-128,7,-128,-128,8,-128,-128,9,-128,-128);
+    const __m128i r2 = _mm_setr_epi8(-128,11,-128,-128,12,-128,-128,13,-128,-128,14,-128,-128,15,-128,-128);
+    const __m128i g2 = _mm_setr_epi8(-128,-128,11,-128,-128,12,-128,-128,13,-128,-128,14,-128,-128,15,-128);
+    const __m128i b2 = _mm_setr_epi8(10,-128,-128,11,-128,-128,12,-128,-128,13,-128,-128,14,-128,-128,15);
+    __m128i out0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r0), _mm_shuffle_epi8(g, g0)), _mm_shuffle_epi8(b, b0));
+    __m128i out1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r1), _mm_shuffle_epi8(g, g1)), _mm_shuffle_epi8(b, b1));
+    __m128i out2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(r, r2), _mm_shuffle_epi8(g, g2)), _mm_shuffle_epi8(b, b2));
+    _mm_storeu_si128((__m128i*)(rgb + 0), out0);
+    _mm_storeu_si128((__m128i*)(rgb + 16), out1);
+    _mm_storeu_si128((__m128i*)(rgb + 32), out2);
+    #else
+    // plain SSE2 has no byte shuffle, so interleave through the stack
+    unsigned char planes[48];
+    _mm_storeu_si128((__m128i*)(planes + 0), r);
+    _mm_storeu_si128((__m128i*)(planes + 16), g);
+    _mm_storeu_si128((__m128i*)(planes + 32), b);
+    for (int i = 0; i < 16; i++)
+    {
+        rgb[3*i+0] = planes[i];
+        rgb[3*i+1] = planes[16+i];
+        rgb[3*i+2] = planes[32+i];
+    }
+    #endif
+}
+#endif
+
+#if defined(__ARM_NEON)
+// Converts 16 pixels, given as 8 even and 8 odd luma values and the
+// 8 u and v values they share, into 48 bytes of RGB
+static inline void usbcam_neon_yuv16_to_rgb(uint8x8_t y_even, uint8x8_t y_odd, uint8x8_t u8, uint8x8_t v8, unsigned char *rgb, bool full = false)
+{
+    int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), vdupq_n_s16(128));
+    int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), vdupq_n_s16(128));
+    int16x8_t rv = vmulq_n_s16(v, full ? usbcam_jfif_rv : usbcam_yuv_rv);
+    int16x8_t g_uv = vaddq_s16(vmulq_n_s16(u, full ? usbcam_jfif_gu : usbcam_yuv_gu), vmulq_n_s16(v, full ? usbcam_jfif_gv : usbcam_yuv_gv));
+    int16x8_t bu = vmulq_n_s16(u, full ? usbcam_jfif_bu : usbcam_yuv_bu);
+    int16x8_t ye = vreinterpretq_s16_u16(vmovl_u8(y_even));
+    int16x8_t yo = vreinterpretq_s16_u16(vmovl_u8(y_odd));
+    int16x8_t y_offset = vdupq_n_s16(full ? 0 : 16);
+    int16_t y_scale = full ? 64 : usbcam_yuv_y;
+    ye = vaddq_s16(vmulq_n_s16(vsubq_s16(ye, y_offset), y_scale), vdupq_n_s16(32));
+    yo = vaddq_s16(vmulq_n_s16(vsubq_s16(yo, y_offset), y_scale), vdupq_n_s16(32));
+
+    // vqshrun shifts, saturates and narrows to unsigned 8 bits in one go
+    uint8x8x2_t r = vzip_u8(vqshrun_n_s16(vqaddq_s16(ye, rv), 6), vqshrun_n_s16(vqaddq_s16(yo, rv), 6));
+    uint8x8x2_t g = vzip_u8(vqshrun_n_s16(vqsubq_s16(ye, g_uv), 6), vqshrun_n_s16(vqsubq_s16(yo, g_uv), 6));
+    uint8x8x2_t b = vzip_u8(vqshrun_n_s16(vqaddq_s16(ye, bu), 6), vqshrun_n_s16(vqaddq_s16(yo, bu), 6));
+    uint8x16x3_t out;
+    out.val[0] = vcombine_u8(r.val[0], r.val[1]);
+    out.val[1] = vcombine_u8(g.val[0], g.val[1]);
+    out.val[2] = vcombine_u8(b.val[0], b.val[1]);
+    vst3q_u8(rgb, out);
+}
+#endif
+
+void usbcam_yuyv_to_gray(int width, int height, int stride, const unsigned char *yuyv, unsigned char *gray)
+{
+    if (!stride)
+        stride = 2*width;
+    for (int row = 0; row < height; row++)
+    {
+        const unsigned char *src = yuyv + row*stride;
+        unsigned char *dst = gray + row*width;
+        int x = 0;
+        #if defined(__AVX2__)
+        const __m256i mask256 = _mm256_set1_epi16(0x00ff);
+        for (; x + 32 <= width; x += 32)
+        {
+            __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(src + 2*x)), mask256);
+            __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(src + 2*x + 32)), mask256);
+            // packus works within 128-bit lanes, so put the quarters back in order
+            __m256i y = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+            _mm256_storeu_si256((__m256i*)(dst + x), y);
+        }
+        #endif
+        #if defined(__SSE2__)
+        const __m128i mask = _mm_set1_epi16(0x00ff);
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + 2*x)), mask);
+            __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + 2*x + 16)), mask);
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(a, b));
+        }
+        #elif defined(__ARM_NEON)
+        for (; x + 16 <= width; x += 16)
+            vst1q_u8(dst + x, vld2q_u8(src + 2*x).val[0]);
+        #endif
+        for (; x < width; x++)
+            dst[x] = src[2*x];
+    }
+}
+
+// usbcam_yuyv_to_rgb with rgb_stride bytes between output rows, and
+// full range (JPEG) input if full is set
+void usbcam_yuyv_rows_to_rgb(int width, int height, int stride, const unsigned char *yuyv, unsigned char *rgb, int rgb_stride, bool full)
+{
+    if (!stride)
+        stride = 2*width;
+    for (int row = 0; row < height; row++)
+    {
+        const unsigned char *src = yuyv + row*stride;
+        unsigned char *dst = rgb + row*rgb_stride;
+        int x = 0;
+        #if defined(__SSE2__)
+        const __m128i mask = _mm_set1_epi16(0x00ff);
+        const __m128i mask32 = _mm_set1_epi32(0x0000ffff);
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + 2*x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + 2*x + 16));
+            __m128i uv_a = _mm_srli_epi16(a, 8); // u0 v0 u1 v1 ...
+            __m128i uv_b = _mm_srli_epi16(b, 8);
+            __m128i u = _mm_packs_epi32(_mm_and_si128(uv_a, mask32), _mm_and_si128(uv_b, mask32));
+            __m128i v = _mm_packs_epi32(_mm_srli_epi32(uv_a, 16), _mm_srli_epi32(uv_b, 16));
+            usbcam_sse2_yuv16_to_rgb(_mm_and_si128(a, mask), _mm_and_si128(b, mask), u, v, dst + 3*x, full);
+        }
+        #elif defined(__ARM_NEON)
+        for (; x + 16 <= width; x += 16)
+        {
+            uint8x8x4_t p = vld4_u8(src + 2*x); // y0 u y1 v
+            usbcam_neon_yuv16_to_rgb(p.val[0], p.val[2], p.val[1], p.val[3], dst + 3*x, full);
+        }
+        #endif
+        for (; x + 2 <= width; x += 2)
+        {
+            const unsigned char *p = src + 2*x;
+            usbcam_yuv_to_rgb_scalar(p[0], p[1], p[3], dst + 3*x, full);
+            usbcam_yuv_to_rgb_scalar(p[2], p[1], p[3], dst + 3*x + 3, full);
+        }
+    }
+}
+
+void usbcam_yuyv_to_rgb(int width, int height, int stride, const unsigned char *yuyv, unsigned char *rgb)
+{
+    usbcam_yuyv_rows_to_rgb(width, height, stride, yuyv, rgb, width*3, false);
+}
+
+// usbcam_nv12_to_rgb with the UV plane anywhere (drivers may pad the Y
+// plane with extra rows), rgb_stride bytes between output rows, and
+// full range (JPEG) input if full is set
+void usbcam_nv12_planes_to_rgb(int width, int height, int stride, const unsigned char *y_plane, const unsigned char *uv_plane, unsigned char *rgb, int rgb_stride, bool full)
+{
+    for (int row = 0; row < height; row++)
+    {
+        const unsigned char *src_y = y_plane + row*stride;
+        const unsigned char *src_uv = uv_plane + (row/2)*stride;
+        unsigned char *dst = rgb + row*rgb_stride;
+        int x = 0;
+        #if defined(__SSE2__)
+        const __m128i mask = _mm_set1_epi16(0x00ff);
+        const __m128i zero = _mm_setzero_si128();
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i y = _mm_loadu_si128((const __m128i*)(src_y + x));
+            __m128i uv = _mm_loadu_si128((const __m128i*)(src_uv + x)); // u0 v0 u1 v1 ...
+            usbcam_sse2_yuv16_to_rgb(_mm_unpacklo_epi8(y, zero), _mm_unpackhi_epi8(y, zero),
+                                     _mm_and_si128(uv, mask), _mm_srli_epi16(uv, 8), dst + 3*x, full);
+        }
+        #elif defined(__ARM_NEON)
+        for (; x + 16 <= width; x += 16)
+        {
+            uint8x8x2_t y = vld2_u8(src_y + x);
+            uint8x8x2_t uv = vld2_u8(src_uv + x);
+            usbcam_neon_yuv16_to_rgb(y.val[0], y.val[1], uv.val[0], uv.val[1], dst + 3*x, full);
+        }
+        #endif
+        for (; x + 2 <= width; x += 2)
+        {
+            usbcam_yuv_to_rgb_scalar(src_y[x], src_uv[x], src_uv[x+1], dst + 3*x, full);
+            usbcam_yuv_to_rgb_scalar(src_y[x+1], src_uv[x], src_uv[x+1], dst + 3*x + 3, full);
+        }
+    }
+}
+
+void usbcam_nv12_to_rgb(int width, int height, int stride, const unsigned char *nv12, unsigned char *rgb)
+{
+    if (!stride)
+        stride = width;
+    usbcam_nv12_planes_to_rgb(width, height, stride, nv12, nv12 + stride*height, rgb, width*3, false);
+}
+
+static pthread_key_t  usbcam_decompressor_key;
+static pthread_once_t usbcam_decompressor_once = PTHREAD_ONCE_INIT;
+
+void usbcam_destroy_decompressor(void *decompressor)
+{
+    tjDestroy((tjhandle)decompressor);
+}
+
+void usbcam_create_decompressor_key()
+{
+    pthread_key_create(&usbcam_decompressor_key, usbcam_destroy_decompressor);
+}
+
+// Returns the calling thread's decompressor, creating it on first use
+tjhandle usbcam_get_decompressor()
+{
+    pthread_once(&usbcam_decompressor_once, usbcam_create_decompressor_key);
+    tjhandle decompressor = (tjhandle)pthread_getspecific(usbcam_decompressor_key);
+    if (!decompressor)
+    {
+        decompressor = tjInitDecompress();
+        if (decompressor)
+            pthread_setspecific(usbcam_decompressor_key, decompressor);
+    }
+    return decompressor;
+}
+
+// The scaling factor tjDecompress2 picks for a desired size (0 means
+// the JPEG's own size): the largest one that fits
+bool usbcam_desired_scaling(int width, int height, int desired_width, int desired_height, tjscalingfactor *factor)
+{
+    if (desired_width <= 0) desired_width = width;
+    if (desired_height <= 0) desired_height = height;
+    int count = 0;
+    tjscalingfactor *factors = tjGetScalingFactors(&count);
+    int best = -1;
+    for (int i = 0; i < count; i++)
+    {
+        int w = TJSCALED(width, factors[i]);
+        int h = TJSCALED(height, factors[i]);
+        if (w <= desired_width && h <= desired_height && (best < 0 || w > TJSCALED(width, factors[best])))
+            best = i;
+    }
+    if (best < 0)
+        return false;
+    *factor = factors[best];
+    return true;
+}
+
+// True if turbojpeg gives exactly the desired size (0 means any)
+bool usbcam_check_desired_size(int width, int height, int desired_width, int desired_height)
+{
+    tjscalingfactor factor;
+    if (usbcam_desired_scaling(width, height, desired_width, desired_height, &factor) &&
+        (desired_width <= 0 || TJSCALED(width, factor) == desired_width) &&
+        (desired_height <= 0 || TJSCALED(height, factor) == desired_height))
+        return true;
+    usbcam_warn("turbojpeg can't scale %dx%d to %dx%d (see §SCALING)", width, height, desired_width, desired_height);
+    return false;
+}
+
+bool usbcam_scaled_size(int width, int height, int min_width, int min_height, int *scaled_width, int *scaled_height)
+{
+    if (min_width <= 0 && min_height <= 0)
+    {
+        min_width = width;
+        min_height = height;
+    }
+    int count = 0;
+    tjscalingfactor *factors = tjGetScalingFactors(&count);
+    bool found = false;
+    for (int i = 0; i < count; i++)
+    {
+        int w = TJSCALED(width, factors[i]);
+        int h = TJSCALED(height, factors[i]);
+        if (w >= min_width && h >= min_height && (!found || w < *scaled_width))
+        {
+            *scaled_width = w;
+            *scaled_height = h;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool usbcam_jpeg_header(unsigned char *jpg_data, unsigned int jpg_size, int *width, int *height, int *subsamp)
+{
+    tjhandle decompressor = usbcam_get_decompressor();
+    if (!decompressor)
+    {
+        usbcam_warn("Failed to create JPEG decompressor: %s", tjGetErrorStr());
+        return false;
+    }
+    if (tjDecompressHeader2(decompressor, jpg_data, jpg_size, width, height, subsamp))
+    {
+        usbcam_warn("Failed to decode JPEG: %s", tjGetErrorStr());
+        return false;
+    }
+    return true;
+}
+
+//
+// Decoder backends (see §DECODERS)
+//
+
+int usbcam_turbojpeg_decode(void *state, int width, int height, int pitch, int pixel_format, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    tjhandle decompressor = usbcam_get_decompressor();
+    if (!decompressor)
+    {
+        usbcam_warn("Failed to create JPEG decompressor: %s", tjGetErrorStr());
+        return -ENOMEM;
+    }
+
+    int error = tjDecompress2(decompressor,
+        jpg_data,
+        jpg_size,
+        destination,
+        width,
+        pitch,
+        height,
+        pixel_format,
+        TJFLAG_FASTDCT);
+
+    if (error)
+    {
+        usbcam_warn("Failed to decode JPEG: %s", tjGetErrorStr());
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+// The decompressor belongs to the thread (see usbcam_get_decompressor),
+// so there is nothing to close
+void *usbcam_turbojpeg_open(const char *device) { return usbcam_get_decompressor(); }
+void usbcam_turbojpeg_close(void *state) { }
+
+const usbcam_decoder_t usbcam_decoder_turbojpeg = { "turbojpeg", usbcam_turbojpeg_open, usbcam_turbojpeg_close, usbcam_turbojpeg_decode };
+
+#define usbcam_max_decoders 8
+static const usbcam_decoder_t *usbcam_decoders[usbcam_max_decoders];
+static int usbcam_decoder_count = 0;
+static char usbcam_decoder_choice[256] = "auto";
+static int usbcam_decoder_generation = 0; // bumped when the choice changes
+static pthread_mutex_t usbcam_decoder_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The backend the calling thread decodes with
+struct usbcam_thread_decoder_t
+{
+    int generation; // of the choice it was picked for
+    const usbcam_decoder_t *decoder;
+    void *state;
+};
+
+static pthread_key_t  usbcam_thread_decoder_key;
+static pthread_once_t usbcam_thread_decoder_once = PTHREAD_ONCE_INIT;
+
+void usbcam_destroy_thread_decoder(void *data)
+{
+    usbcam_thread_decoder_t *td = (usbcam_thread_decoder_t*)data;
+    if (td->decoder)
+        td->decoder->close(td->state);
+    free(td);
+}
+
+void usbcam_create_thread_decoder_key()
+{
+    pthread_key_create(&usbcam_thread_decoder_key, usbcam_destroy_thread_decoder);
+}
+
+// Opens the first backend that the choice allows and that works here,
+// registered ones first and turbojpeg last
+void usbcam_choose_decoder(usbcam_thread_decoder_t *td)
+{
+    if (td->decoder)
+        td->decoder->close(td->state);
+    td->decoder = NULL;
+    td->state = NULL;
+
+    const usbcam_decoder_t *candidates[usbcam_max_decoders + 2];
+    int count = 0;
+    char choice[sizeof(usbcam_decoder_choice)];
+    pthread_mutex_lock(&usbcam_decoder_mutex);
+    td->generation = usbcam_decoder_generation;
+    for (int i = 0; i < usbcam_decoder_count; i++)
+        candidates[count++] = usbcam_decoders[i];
+    strcpy(choice, usbcam_decoder_choice);
+    pthread_mutex_unlock(&usbcam_decoder_mutex);
+    candidates[count++] = &usbcam_decoder_v4l2;
+    candidates[count++] = &usbcam_decoder_turbojpeg;
+
+    char *device = strchr(choice, ':');
+    if (device)
+        *device++ = 0;
+    bool any = strcmp(choice, "auto") == 0;
+    for (int i = 0; i < count && !td->decoder; i++)
+    {
+        if (!any && strcmp(candidates[i]->name, choice) != 0)
+            continue;
+        td->state = candidates[i]->open(device);
+        if (td->state)
+            td->decoder = candidates[i];
+        else if (!any)
+            usbcam_warn("The %s JPEG decoder is not available, using turbojpeg instead", choice);
+    }
+    if (!td->decoder)
+        td->decoder = &usbcam_decoder_turbojpeg;
+    usbcam_debug("Decoding JPEGs with %s", td->decoder->name);
+}
+
+usbcam_thread_decoder_t *usbcam_get_thread_decoder()
+{
+    pthread_once(&usbcam_thread_decoder_once, usbcam_create_thread_decoder_key);
+    usbcam_thread_decoder_t *td = (usbcam_thread_decoder_t*)pthread_getspecific(usbcam_thread_decoder_key);
+    if (!td)
+    {
+        td = (usbcam_thread_decoder_t*)calloc(1, sizeof(usbcam_thread_decoder_t));
+        if (!td)
+            return NULL;
+        td->generation = -1;
+        pthread_setspecific(usbcam_thread_decoder_key, td);
+    }
+    if (td->generation != __atomic_load_n(&usbcam_decoder_generation, __ATOMIC_ACQUIRE))
+        usbcam_choose_decoder(td);
+    return td;
+}
+
+const usbcam_decoder_t *usbcam_find_decoder(const char *name, size_t length)
+{
+    const usbcam_decoder_t *builtin[] = { &usbcam_decoder_v4l2, &usbcam_decoder_turbojpeg };
+    for (int i = 0; i < usbcam_decoder_count; i++)
+        if (strlen(usbcam_decoders[i]->name) == length && strncmp(usbcam_decoders[i]->name, name, length) == 0)
+            return usbcam_decoders[i];
+    for (int i = 0; i < 2; i++)
+        if (strlen(builtin[i]->name) == length && strncmp(builtin[i]->name, name, length) == 0)
+            return builtin[i];
+    return NULL;
+}
+
+int usbcam_register_decoder(const usbcam_decoder_t *decoder)
+{
+    usbcam_check(decoder && decoder->name && decoder->open && decoder->close && decoder->decode, -EINVAL, "Decoder needs a name, open, close and decode");
+    usbcam_check(!strchr(decoder->name, ':') && strcmp(decoder->name, "auto") != 0, -EINVAL, "Decoder name can't be \"%s\"", decoder->name);
+    pthread_mutex_lock(&usbcam_decoder_mutex);
+    int error = 0;
+    if (usbcam_find_decoder(decoder->name, strlen(decoder->name)))
+        error = -EEXIST;
+    else if (usbcam_decoder_count == usbcam_max_decoders)
+        error = -ENOSPC;
+    else
+    {
+        usbcam_decoders[usbcam_decoder_count++] = decoder;
+        // so that "auto" considers it
+        __atomic_add_fetch(&usbcam_decoder_generation, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&usbcam_decoder_mutex);
+    usbcam_check(error != -EEXIST, error, "There already is a decoder called %s", decoder->name);
+    usbcam_check(error != -ENOSPC, error, "Can't register more than %d decoders", usbcam_max_decoders);
+    return 0;
+}
+
+int usbcam_set_decoder(const char *name)
+{
+    if (!name)
+        name = "auto";
+    usbcam_check(strlen(name) < sizeof(usbcam_decoder_choice), -EINVAL, "Decoder name too long");
+    const char *device = strchr(name, ':');
+    size_t length = device ? (size_t)(device - name) : strlen(name);
+    pthread_mutex_lock(&usbcam_decoder_mutex);
+    bool known = (length == 4 && strncmp(name, "auto", 4) == 0) || usbcam_find_decoder(name, length);
+    if (known)
+    {
+        strcpy(usbcam_decoder_choice, name);
+        __atomic_add_fetch(&usbcam_decoder_generation, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&usbcam_decoder_mutex);
+    usbcam_check(known, -ENOENT, "There is no decoder called %.*s", (int)length, name);
+    return 0;
+}
+
+const char *usbcam_decoder_name()
+{
+    usbcam_thread_decoder_t *td = usbcam_get_thread_decoder();
+    return td ? td->decoder->name : usbcam_decoder_turbojpeg.name;
+}
+
+// usbcam_jpeg_to_pixels with pitch bytes between rows (0 means packed)
+bool usbcam_jpeg_decode(int desired_width, int desired_height, int pitch, int pixel_format, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    int width, height, subsamp;
+    if (!usbcam_jpeg_header(jpg_data, jpg_size, &width, &height, &subsamp))
+        return false;
+    if (!usbcam_check_desired_size(width, height, desired_width, desired_height))
+        return false;
+
+    // backends get the size that turbojpeg would pick
+    tjscalingfactor factor;
+    usbcam_desired_scaling(width, height, desired_width, desired_height, &factor);
+    width = TJSCALED(width, factor);
+    height = TJSCALED(height, factor);
+
+    usbcam_thread_decoder_t *td = usbcam_get_thread_decoder();
+    if (td && td->decoder != &usbcam_decoder_turbojpeg)
+    {
+        int error = td->decoder->decode(td->state, width, height, pitch, pixel_format, destination, jpg_data, jpg_size);
+        if (error == 0)
+            return true;
+        if (error != -ENOTSUP)
+        {
+            usbcam_warn("The %s JPEG decoder failed (%s), using turbojpeg instead", td->decoder->name, strerror(-error));
+            td->decoder->close(td->state);
+            td->decoder = &usbcam_decoder_turbojpeg;
+            td->state = NULL;
+        }
+    }
+    return usbcam_turbojpeg_decode(NULL, width, height, pitch, pixel_format, destination, jpg_data, jpg_size) == 0;
+}
+
+bool usbcam_jpeg_to_pixels(int desired_width, int desired_height, int pixel_format, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    return usbcam_jpeg_decode(desired_width, desired_height, 0, pixel_format, destination, jpg_data, jpg_size);
+}
+
+bool usbcam_jpeg_to_rgb(int desired_width, int desired_height, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    return usbcam_jpeg_to_pixels(desired_width, desired_height, TJPF_RGB, destination, jpg_data, jpg_size);
+}
+
+bool usbcam_jpeg_to_gray(int desired_width, int desired_height, unsigned char *gray, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    return usbcam_jpeg_to_pixels(desired_width, desired_height, TJPF_GRAY, gray, jpg_data, jpg_size);
+}
+
+bool usbcam_jpeg_to_yuv(int desired_width, int desired_height, unsigned char **planes, int *strides, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    tjhandle decompressor = usbcam_get_decompressor();
+    if (!decompressor)
+    {
+        usbcam_warn("Failed to create JPEG decompressor: %s", tjGetErrorStr());
+        return false;
+    }
+
+    int width, height, subsamp;
+    if (tjDecompressHeader2(decompressor, jpg_data, jpg_size, &width, &height, &subsamp))
+    {
+        usbcam_warn("Failed to decode JPEG: %s", tjGetErrorStr());
+        return false;
+    }
+    if (!usbcam_check_desired_size(width, height, desired_width, desired_height))
+        return false;
+
+    int error = tjDecompressToYUVPlanes(decompressor,
+        jpg_data,
+        jpg_size,
+        planes,
+        desired_width,
+        strides,
+        desired_height,
+        TJFLAG_FASTDCT);
+
+    if (error)
+    {
+        usbcam_warn("Failed to decode JPEG: %s", tjGetErrorStr());
+        return false;
+    }
+
+    return true;
+}
+
+bool usbcam_jpeg_to_image(int min_width, int min_height, int pixel_format, usbcam_image_t *image, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    if (pixel_format < 0 || pixel_format >= TJ_NUMPF)
+    {
+        usbcam_warn("Unknown pixel format %d", pixel_format);
+        return false;
+    }
+    if (image->pool)
+    {
+        usbcam_warn("Use usbcam_jpeg_to_pool for images from a pool");
+        return false;
+    }
+    int width, height, subsamp;
+    if (!usbcam_jpeg_header(jpg_data, jpg_size, &width, &height, &subsamp))
+        return false;
+    int w, h;
+    if (!usbcam_scaled_size(width, height, min_width, min_height, &w, &h))
+    {
+        usbcam_warn("turbojpeg can't scale %dx%d up to %dx%d", width, height, min_width, min_height);
+        return false;
+    }
+    size_t size = (size_t)w*h*tjPixelSize[pixel_format];
+    if (size > image->capacity)
+    {
+        unsigned char *data = (unsigned char*)realloc(image->data, size);
+        if (!data)
+        {
+            usbcam_warn("Failed to allocate memory for a %dx%d image", w, h);
+            return false;
+        }
+        image->data = data;
+        image->capacity = size;
+    }
+    image->width = w;
+    image->height = h;
+    image->pixel_format = pixel_format;
+    image->stride = w*tjPixelSize[pixel_format];
+    return usbcam_jpeg_to_pixels(w, h, pixel_format, image->data, jpg_data, jpg_size);
+}
+
+void usbcam_free_image(usbcam_image_t *image)
+{
+    if (image->pool)
+    {
+        usbcam_release_image(image);
+        return;
+    }
+    free(image->data);
+    memset(image, 0, sizeof(*image));
+}
+
+//
+// V4L2 mem2mem JPEG decoder (see §DECODERS)
+//
+
+struct usbcam_v4l2_decoder_t
+{
+    int fd;
+    unsigned int output_type, capture_type; // the _MPLANE types if the device has those
+    unsigned int jpeg_format; // V4L2_PIX_FMT_JPEG or V4L2_PIX_FMT_MJPEG
+    int width, height, pixel_format; // what the queues are set up for, 0x0 if they aren't
+    unsigned int capture_format; // what we get decoded
+    unsigned int bytesperline, rows; // of the capture buffer, rows can be more than height
+    unsigned char *output, *capture;
+    size_t output_length, capture_length;
+    unsigned int refused; // bit per TJPF_* that the device can't give us
+    int errors; // frames in a row that it failed to decode
+};
+
+static char usbcam_v4l2_decoder_device[64];
+static pthread_once_t usbcam_v4l2_decoder_once = PTHREAD_ONCE_INIT;
+
+bool usbcam_is_mplane(unsigned int type)
+{
+    return type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE || type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+}
+
+// Opens device if it is a mem2mem device that takes JPEGs, or -errno
+int usbcam_open_v4l2_decoder(const char *device, usbcam_v4l2_decoder_t *d)
+{
+    int fd = v4l2_open(device, O_RDWR | O_NONBLOCK, 0);
+    if (fd == -1)
+        return -errno;
+
+    v4l2_capability cap = {0};
+    int error = usbcam_query_ioctl(fd, VIDIOC_QUERYCAP, &cap);
+    unsigned int caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+    if (!error && (caps & V4L2_CAP_VIDEO_M2M_MPLANE))
+    {
+        d->output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+        d->capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    }
+    else if (!error && (caps & V4L2_CAP_VIDEO_M2M))
+    {
+        d->output_type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        d->capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    }
+    else
+    {
+        v4l2_close(fd);
+        return error ? error : -ENODEV;
+    }
+
+    d->jpeg_format = 0;
+    for (unsigned int i = 0; !d->jpeg_format; i++)
+    {
+        v4l2_fmtdesc desc = {0};
+        desc.index = i;
+        desc.type = d->output_type;
+        if (usbcam_query_ioctl(fd, VIDIOC_ENUM_FMT, &desc) < 0)
+            break;
+        if (desc.pixelformat == V4L2_PIX_FMT_JPEG || desc.pixelformat == V4L2_PIX_FMT_MJPEG)
+            d->jpeg_format = desc.pixelformat;
+    }
+    if (!d->jpeg_format)
+    {
+        v4l2_close(fd);
+        return -ENODEV;
+    }
+    d->fd = fd;
+    return 0;
+}
+
+// Looks for a JPEG decoder among /dev/video*, once per process
+void usbcam_find_v4l2_decoder()
+{
+    for (int i = 0; i < 64; i++)
+    {
+        char device[64];
+        snprintf(device, sizeof(device), "/dev/video%d", i);
+        usbcam_v4l2_decoder_t d = {0};
+        if (usbcam_open_v4l2_decoder(device, &d) == 0)
+        {
+            v4l2_close(d.fd);
+            strcpy(usbcam_v4l2_decoder_device, device);
+            usbcam_debug("Found a JPEG decoder at %s", device);
+            return;
+        }
+    }
+}
+
+void usbcam_v4l2_decoder_teardown(usbcam_v4l2_decoder_t *d)
+{
+    if (d->width)
+    {
+        int type = d->output_type;
+        usbcam_query_ioctl(d->fd, VIDIOC_STREAMOFF, &type);
+        type = d->capture_type;
+        usbcam_query_ioctl(d->fd, VIDIOC_STREAMOFF, &type);
+    }
+    if (d->output)
+        munmap(d->output, d->output_length);
+    if (d->capture)
+        munmap(d->capture, d->capture_length);
+    d->output = d->capture = NULL;
+    for (int i = 0; i < 2; i++)
+    {
+        v4l2_requestbuffers req = {0};
+        req.type = i ? d->capture_type : d->output_type;
+        req.memory = V4L2_MEMORY_MMAP;
+        usbcam_query_ioctl(d->fd, VIDIOC_REQBUFS, &req);
+    }
+    d->width = d->height = 0;
+}
+
+// Asks for one buffer on the queue and maps it
+int usbcam_v4l2_decoder_map(usbcam_v4l2_decoder_t *d, unsigned int type, unsigned char **memory, size_t *length)
+{
+    v4l2_requestbuffers req = {0};
+    req.count = 1;
+    req.type = type;
+    req.memory = V4L2_MEMORY_MMAP;
+    usbcam_try(usbcam_query_ioctl(d->fd, VIDIOC_REQBUFS, &req));
+    usbcam_check(req.count >= 1, -ENOMEM, "JPEG decoder gave no buffers");
+
+    v4l2_plane plane = {0};
+    v4l2_buffer buf = {0};
+    buf.type = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = 0;
+    if (usbcam_is_mplane(type))
+    {
+        buf.m.planes = &plane;
+        buf.length = 1;
+    }
+    usbcam_try(usbcam_query_ioctl(d->fd, VIDIOC_QUERYBUF, &buf));
+    *length = usbcam_is_mplane(type) ? plane.length : buf.length;
+    unsigned int offset = usbcam_is_mplane(type) ? plane.m.mem_offset : buf.m.offset;
+    void *map = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, offset);
+    usbcam_check(map != MAP_FAILED, -errno, "Failed to map JPEG decoder buffer: %s", strerror(errno));
+    *memory = (unsigned char*)map;
+    return 0;
+}
+
+// The capture formats to try for a TJPF_* format, best first
+int usbcam_v4l2_decoder_formats(int pixel_format, unsigned int *formats)
+{
+    int count = 0;
+    if (pixel_format == TJPF_RGB)
+        formats[count++] = V4L2_PIX_FMT_RGB24;
+    if (pixel_format == TJPF_BGR)
+        formats[count++] = V4L2_PIX_FMT_BGR24;
+    if (pixel_format == TJPF_GRAY)
+        formats[count++] = V4L2_PIX_FMT_GREY;
+    if (pixel_format == TJPF_RGB || pixel_format == TJPF_GRAY)
+    {
+        // we convert these ourselves
+        formats[count++] = V4L2_PIX_FMT_NV12;
+        formats[count++] = V4L2_PIX_FMT_YUYV;
+    }
+    return count;
+}
+
+// Sets up both queues for width x height JPEGs decoded to pixel_format.
+// -ENOTSUP if the device can't give us pixel_format
+int usbcam_v4l2_decoder_setup(usbcam_v4l2_decoder_t *d, int width, int height, int pixel_format, unsigned int jpg_size)
+{
+    usbcam_v4l2_decoder_teardown(d);
+
+    v4l2_format fmt = {0};
+    fmt.type = d->output_type;
+    unsigned int sizeimage = width*height*2;
+    if (sizeimage < 2*jpg_size)
+        sizeimage = 2*jpg_size;
+    if (usbcam_is_mplane(fmt.type))
+    {
+        fmt.fmt.pix_mp.width = width;
+        fmt.fmt.pix_mp.height = height;
+        fmt.fmt.pix_mp.pixelformat = d->jpeg_format;
+        fmt.fmt.pix_mp.num_planes = 1;
+        fmt.fmt.pix_mp.plane_fmt[0].sizeimage = sizeimage;
+    }
+    else
+    {
+        fmt.fmt.pix.width = width;
+        fmt.fmt.pix.height = height;
+        fmt.fmt.pix.pixelformat = d->jpeg_format;
+        fmt.fmt.pix.sizeimage = sizeimage;
+    }
+    usbcam_try(usbcam_query_ioctl(d->fd, VIDIOC_S_FMT, &fmt));
+
+    unsigned int formats[3];
+    int count = usbcam_v4l2_decoder_formats(pixel_format, formats);
+    d->capture_format = 0;
+    for (int i = 0; i < count && !d->capture_format; i++)
+    {
+        memset(&fmt, 0, sizeof(fmt));
+        fmt.type = d->capture_type;
+        if (usbcam_is_mplane(fmt.type))
+        {
+            fmt.fmt.pix_mp.width = width;
+            fmt.fmt.pix_mp.height = height;
+            fmt.fmt.pix_mp.pixelformat = formats[i];
+            fmt.fmt.pix_mp.num_planes = 1;
+        }
+        else
+        {
+            fmt.fmt.pix.width = width;
+            fmt.fmt.pix.height = height;
+            fmt.fmt.pix.pixelformat = formats[i];
+        }
+        if (usbcam_query_ioctl(d->fd, VIDIOC_S_FMT, &fmt) < 0)
+            continue;
+        // the driver may round the size up, and may pick another format
+        // or more planes than we can take
+        bool mplane = usbcam_is_mplane(fmt.type);
+        unsigned int got = mplane ? fmt.fmt.pix_mp.pixelformat : fmt.fmt.pix.pixelformat;
+        unsigned int w = mplane ? fmt.fmt.pix_mp.width : fmt.fmt.pix.width;
+        unsigned int h = mplane ? fmt.fmt.pix_mp.height : fmt.fmt.pix.height;
+        unsigned int bpl = mplane ? fmt.fmt.pix_mp.plane_fmt[0].bytesperline : fmt.fmt.pix.bytesperline;
+        unsigned int pixel_size = got == V4L2_PIX_FMT_YUYV ? 2 : got == V4L2_PIX_FMT_RGB24 || got == V4L2_PIX_FMT_BGR24 ? 3 : 1;
+        if (got != formats[i] || w < (unsigned int)width || h < (unsigned int)height || (mplane && fmt.fmt.pix_mp.num_planes != 1))
+            continue;
+        d->capture_format = got;
+        d->bytesperline = bpl ? bpl : w*pixel_size;
+        d->rows = h;
+    }
+    if (!d->capture_format)
+    {
+        usbcam_debug("JPEG decoder can't decode %dx%d to TJPF %d", width, height, pixel_format);
+        d->refused |= 1u << pixel_format;
+        return -ENOTSUP;
+    }
+
+    usbcam_try(usbcam_v4l2_decoder_map(d, d->output_type, &d->output, &d->output_length));
+    usbcam_try(usbcam_v4l2_decoder_map(d, d->capture_type, &d->capture, &d->capture_length));
+    size_t needed = (size_t)d->bytesperline*d->rows;
+    if (d->capture_format == V4L2_PIX_FMT_NV12)
+        needed += needed/2;
+    usbcam_check(d->capture_length >= needed, -EINVAL, "JPEG decoder capture buffer is too small");
+    int type = d->output_type;
+    usbcam_try(usbcam_query_ioctl(d->fd, VIDIOC_STREAMON, &type));
+    type = d->capture_type;
+    usbcam_try(usbcam_query_ioctl(d->fd, VIDIOC_STREAMON, &type));
+    d->width = width;
+    d->height = height;
+    d->pixel_format = pixel_format;
+    return 0;
+}
+
+// Queues or dequeues buffer 0, waiting up to a second for it to come back
+int usbcam_v4l2_decoder_buffer(usbcam_v4l2_decoder_t *d, int request, unsigned int type, unsigned int bytesused, unsigned int *flags)
+{
+    v4l2_plane plane = {0};
+    v4l2_buffer buf = {0};
+    buf.type = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = 0;
+    buf.bytesused = bytesused;
+    if (usbcam_is_mplane(type))
+    {
+        plane.bytesused = bytesused;
+        buf.m.planes = &plane;
+        buf.length = 1;
+    }
+    for (;;)
+    {
+        int error = usbcam_query_ioctl(d->fd, request, &buf);
+        if (error != -EAGAIN)
+        {
+            if (flags)
+                *flags = buf.flags;
+            return error;
+        }
+        // only DQBUF waits: for a decoded frame, or for the JPEG to be taken
+        pollfd pfd = { d->fd, (short)(type == d->capture_type ? POLLIN : POLLOUT), 0 };
+        int ready = poll(&pfd, 1, 1000);
+        if (ready == 0)
+            return -ETIMEDOUT;
+        if (ready < 0 && errno != EINTR)
+            return -errno;
+        if (pfd.revents & POLLERR)
+            return -EIO;
+    }
+}
+
+void *usbcam_v4l2_decoder_open(const char *device)
+{
+    if (!device)
+    {
+        pthread_once(&usbcam_v4l2_decoder_once, usbcam_find_v4l2_decoder);
+        if (!usbcam_v4l2_decoder_device[0])
+            return NULL;
+        device = usbcam_v4l2_decoder_device;
+    }
+    usbcam_v4l2_decoder_t *d = (usbcam_v4l2_decoder_t*)calloc(1, sizeof(usbcam_v4l2_decoder_t));
+    if (!d)
+        return NULL;
+    int error = usbcam_open_v4l2_decoder(device, d);
+    if (error < 0)
+    {
+        usbcam_debug("%s is not a JPEG decoder: %s", device, strerror(-error));
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+void usbcam_v4l2_decoder_close(void *state)
+{
+    usbcam_v4l2_decoder_t *d = (usbcam_v4l2_decoder_t*)state;
+    usbcam_v4l2_decoder_teardown(d);
+    v4l2_close(d->fd);
+    free(d);
+}
+
+int usbcam_v4l2_decoder_decode(void *state, int width, int height, int pitch, int pixel_format, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    usbcam_v4l2_decoder_t *d = (usbcam_v4l2_decoder_t*)state;
+    if (pixel_format < 0 || pixel_format >= 32 || (d->refused & (1u << pixel_format)))
+        return -ENOTSUP;
+
+    // the hardware doesn't scale
+    int jpg_width, jpg_height, subsamp;
+    if (!usbcam_jpeg_header(jpg_data, jpg_size, &jpg_width, &jpg_height, &subsamp))
+        return -ENOTSUP;
+    if (jpg_width != width || jpg_height != height)
+        return -ENOTSUP;
+
+    if (width != d->width || height != d->height || pixel_format != d->pixel_format || jpg_size > d->output_length)
+        usbcam_try(usbcam_v4l2_decoder_setup(d, width, height, pixel_format, jpg_size));
+    if (jpg_size > d->output_length)
+        return -ENOTSUP;
+
+    memcpy(d->output, jpg_data, jpg_size);
+    unsigned int flags = 0;
+    usbcam_try(usbcam_v4l2_decoder_buffer(d, VIDIOC_QBUF, d->output_type, jpg_size, NULL));
+    usbcam_try(usbcam_v4l2_decoder_buffer(d, VIDIOC_QBUF, d->capture_type, 0, NULL));
+    usbcam_try(usbcam_v4l2_decoder_buffer(d, VIDIOC_DQBUF, d->capture_type, 0, &flags));
+    usbcam_try(usbcam_v4l2_decoder_buffer(d, VIDIOC_DQBUF, d->output_type, 0, NULL));
+    if (flags & V4L2_BUF_FLAG_ERROR)
+    {
+        // turbojpeg has a go at it; if the device fails every frame, stop using it
+        usbcam_check(++d->errors < 8, -EIO, "JPEG decoder failed %d frames in a row", d->errors);
+        return -ENOTSUP;
+    }
+    d->errors = 0;
+
+    int row_size = width*tjPixelSize[pixel_format];
+    if (!pitch)
+        pitch = row_size;
+    const unsigned char *src = d->capture;
+    if (d->capture_format == V4L2_PIX_FMT_NV12 && pixel_format == TJPF_RGB)
+        usbcam_nv12_planes_to_rgb(width, height, d->bytesperline, src, src + d->bytesperline*d->rows, destination, pitch, true);
+    else if (d->capture_format == V4L2_PIX_FMT_YUYV && pixel_format == TJPF_RGB)
+        usbcam_yuyv_rows_to_rgb(width, height, d->bytesperline, src, destination, pitch, true);
+    else if (d->capture_format == V4L2_PIX_FMT_YUYV)
+        for (int row = 0; row < height; row++)
+            usbcam_yuyv_to_gray(width, 1, 0, src + row*d->bytesperline, destination + row*pitch);
+    else
+        // RGB24, BGR24 and GREY are what we asked for, and so is the Y plane of NV12
+        for (int row = 0; row < height; row++)
+            memcpy(destination + row*pitch, src + row*d->bytesperline, row_size);
+    return 0;
+}
+
+const usbcam_decoder_t usbcam_decoder_v4l2 = { "v4l2", usbcam_v4l2_decoder_open, usbcam_v4l2_decoder_close, usbcam_v4l2_decoder_decode };
+
+//
+// Image pool (see §IMAGE POOL)
+//
+
+struct usbcam_pool_t
+{
+    unsigned char *memory;
+    size_t         mapped; // bytes mapped at memory
+    size_t         image_size; // bytes from one image to the next, a multiple of 64
+    int            width, height, pixel_format, stride;
+    int            count;
+    int           *refcount; // per image, 0 means free
+    int            refs; // one for whoever created the pool, and one per image that is out
+};
+
+void usbcam_pool_unref(usbcam_pool_t *pool)
+{
+    if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    munmap(pool->memory, pool->mapped);
+    free(pool->refcount);
+    free(pool);
+}
+
+usbcam_pool_t *usbcam_pool_create(int width, int height, int pixel_format, int count, int flags)
+{
+    if (width <= 0 || height <= 0 || count <= 0 || pixel_format < 0 || pixel_format >= TJ_NUMPF)
+    {
+        usbcam_warn("An image pool needs a size, a count and a TJPF_* pixel format");
+        return NULL;
+    }
+    usbcam_pool_t *pool = (usbcam_pool_t*)calloc(1, sizeof(usbcam_pool_t));
+    int *refcount = (int*)calloc(count, sizeof(int));
+    if (!pool || !refcount)
+    {
+        free(pool);
+        free(refcount);
+        usbcam_warn("Failed to allocate an image pool");
+        return NULL;
+    }
+    int row = width*tjPixelSize[pixel_format];
+    pool->stride = (flags & usbcam_pool_packed) ? row : (row + 63) & ~63;
+    pool->image_size = ((size_t)pool->stride*height + 63) & ~(size_t)63;
+    pool->width = width;
+    pool->height = height;
+    pool->pixel_format = pixel_format;
+    pool->count = count;
+    pool->refcount = refcount;
+    pool->refs = 1;
+
+    // reserved hugepages if there are any, else transparent ones
+    size_t size = pool->image_size*count;
+    void *memory = MAP_FAILED;
+    if (flags & usbcam_pool_hugepages)
+    {
+        size_t huge = 2u << 20;
+        pool->mapped = (size + huge - 1) & ~(huge - 1);
+        memory = mmap(NULL, pool->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        if (memory == MAP_FAILED)
+            usbcam_debug("No hugetlbfs pages for the pool (%d): %s", errno, strerror(errno));
+    }
+    if (memory == MAP_FAILED)
+    {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        pool->mapped = (size + page - 1) & ~(page - 1);
+        memory = mmap(NULL, pool->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            usbcam_warn("Failed to allocate an image pool of %zu bytes (%d): %s", size, errno, strerror(errno));
+            free(refcount);
+            free(pool);
+            return NULL;
+        }
+        if ((flags & usbcam_pool_hugepages) && madvise(memory, pool->mapped, MADV_HUGEPAGE) != 0)
+            usbcam_debug("No transparent hugepages for the pool (%d): %s", errno, strerror(errno));
+        memset(memory, 0, pool->mapped); // fault it in now rather than on the first frames
+    }
+    pool->memory = (unsigned char*)memory;
+    return pool;
+}
+
+void usbcam_pool_destroy(usbcam_pool_t *pool)
+{
+    usbcam_pool_unref(pool);
+}
+
+int usbcam_pool_acquire(usbcam_pool_t *pool, usbcam_image_t *image)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        int expected = 0;
+        if (!__atomic_compare_exchange_n(&pool->refcount[i], &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        __atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+        image->data = pool->memory + i*pool->image_size;
+        image->width = pool->width;
+        image->height = pool->height;
+        image->pixel_format = pool->pixel_format;
+        image->stride = pool->stride;
+        image->capacity = pool->image_size;
+        image->pool = pool;
+        image->index = i;
+        return 0;
+    }
+    return -EAGAIN;
+}
+
+void usbcam_retain_image(usbcam_image_t *image)
+{
+    __atomic_add_fetch(&image->pool->refcount[image->index], 1, __ATOMIC_RELAXED);
+}
+
+void usbcam_release_image(usbcam_image_t *image)
+{
+    usbcam_pool_t *pool = image->pool;
+    if (__atomic_sub_fetch(&pool->refcount[image->index], 1, __ATOMIC_ACQ_REL) == 0)
+        usbcam_pool_unref(pool);
+    memset(image, 0, sizeof(*image));
+}
+
+int usbcam_jpeg_to_pool(usbcam_pool_t *pool, usbcam_image_t *image, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    usbcam_try(usbcam_pool_acquire(pool, image));
+    if (!usbcam_jpeg_decode(pool->width, pool->height, pool->stride, pool->pixel_format, image->data, jpg_data, jpg_size))
+    {
+        usbcam_release_image(image);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+//
+// Region of interest (see §REGION OF INTEREST)
+//
+
+// turbojpeg can't crop, so this goes through the libjpeg API of the
+// same library. Like the turbojpeg decompressor, each thread gets one.
+struct usbcam_roi_decoder_t
+{
+    jpeg_decompress_struct cinfo;
+    jpeg_error_mgr         error;
+    jmp_buf                jump;
+};
+
+static pthread_key_t  usbcam_roi_decoder_key;
+static pthread_once_t usbcam_roi_decoder_once = PTHREAD_ONCE_INIT;
+
+void usbcam_destroy_roi_decoder(void *arg)
+{
+    usbcam_roi_decoder_t *decoder = (usbcam_roi_decoder_t*)arg;
+    jpeg_destroy_decompress(&decoder->cinfo);
+    free(decoder);
+}
+
+void usbcam_create_roi_decoder_key()
+{
+    pthread_key_create(&usbcam_roi_decoder_key, usbcam_destroy_roi_decoder);
+}
+
+void usbcam_roi_error_exit(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    usbcam_warn("Failed to decode JPEG: %s", message);
+    longjmp(((usbcam_roi_decoder_t*)cinfo->client_data)->jump, 1);
+}
+
+// Corrupt data and the like, which turbojpeg doesn't complain about either
+void usbcam_roi_output_message(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    usbcam_debug("JPEG warning: %s", message);
+}
+
+usbcam_roi_decoder_t *usbcam_get_roi_decoder()
+{
+    pthread_once(&usbcam_roi_decoder_once, usbcam_create_roi_decoder_key);
+    usbcam_roi_decoder_t *decoder = (usbcam_roi_decoder_t*)pthread_getspecific(usbcam_roi_decoder_key);
+    if (!decoder)
+    {
+        decoder = (usbcam_roi_decoder_t*)calloc(1, sizeof(usbcam_roi_decoder_t));
+        if (!decoder)
+            return NULL;
+        decoder->cinfo.err = jpeg_std_error(&decoder->error);
+        decoder->error.error_exit = usbcam_roi_error_exit;
+        decoder->error.output_message = usbcam_roi_output_message;
+        decoder->cinfo.client_data = decoder;
+        if (setjmp(decoder->jump))
+        {
+            free(decoder);
+            return NULL;
+        }
+        jpeg_create_decompress(&decoder->cinfo);
+        pthread_setspecific(usbcam_roi_decoder_key, decoder);
+    }
+    return decoder;
+}
+
+// libjpeg names for the TJPF_* formats
+static const J_COLOR_SPACE usbcam_roi_color_space[TJ_NUMPF] =
+{
+    JCS_EXT_RGB, JCS_EXT_BGR, JCS_EXT_RGBX, JCS_EXT_BGRX, JCS_EXT_XBGR, JCS_EXT_XRGB,
+    JCS_GRAYSCALE, JCS_EXT_RGBA, JCS_EXT_BGRA, JCS_EXT_ABGR, JCS_EXT_ARGB, JCS_CMYK
+};
+
+bool usbcam_jpeg_to_pixels_roi(int desired_width, int desired_height, int x, int y, int width, int height,
+                               int pixel_format, unsigned char *destination, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    if (pixel_format < 0 || pixel_format >= TJ_NUMPF || pixel_format == TJPF_CMYK)
+    {
+        usbcam_warn("Unsupported pixel format for a region of interest");
+        return false;
+    }
+    usbcam_roi_decoder_t *decoder = usbcam_get_roi_decoder();
+    if (!decoder)
+    {
+        usbcam_warn("Failed to create JPEG decompressor");
+        return false;
+    }
+
+    jpeg_decompress_struct *cinfo = &decoder->cinfo;
+    if (setjmp(decoder->jump))
+    {
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+    jpeg_mem_src(cinfo, jpg_data, jpg_size);
+    jpeg_read_header(cinfo, TRUE);
+
+    // the scale turbojpeg would choose
+    tjscalingfactor factor;
+    if (!usbcam_desired_scaling((int)cinfo->image_width, (int)cinfo->image_height, desired_width, desired_height, &factor))
+    {
+        usbcam_warn("turbojpeg can't scale %ux%u to %dx%d (see §SCALING)", cinfo->image_width, cinfo->image_height,
+                    desired_width, desired_height);
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+    cinfo->scale_num = factor.num;
+    cinfo->scale_denom = factor.denom;
+    cinfo->out_color_space = usbcam_roi_color_space[pixel_format];
+    cinfo->dct_method = JDCT_IFAST; // as TJFLAG_FASTDCT
+    jpeg_start_decompress(cinfo);
+
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+        x + width > (int)cinfo->output_width || y + height > (int)cinfo->output_height)
+    {
+        usbcam_warn("Region %dx%d at %d,%d is outside the %ux%u image", width, height, x, y,
+                    cinfo->output_width, cinfo->output_height);
+        jpeg_abort_decompress(cinfo);
+        return false;
+    }
+
+    // Columns are widened to whole MCUs. Rows above the region are
+    // entropy decoded but nothing else, and rows below not at all.
+    // Upsampled chroma at the edge of a crop is replicated instead of
+    // interpolated, so ask for a margin to get the same pixels as a full
+    // decode.
+    int margin = 2;
+    int crop_left = x - margin > 0 ? x - margin : 0;
+    int crop_right = x + width + margin < (int)cinfo->output_width ? x + width + margin : (int)cinfo->output_width;
+    JDIMENSION crop_x = (JDIMENSION)crop_left;
+    JDIMENSION crop_width = (JDIMENSION)(crop_right - crop_left);
+    jpeg_crop_scanline(cinfo, &crop_x, &crop_width);
+    if (y > 0)
+        jpeg_skip_scanlines(cinfo, (JDIMENSION)y);
+
+    int pixel_size = tjPixelSize[pixel_format];
+    size_t skip = (size_t)(x - (int)crop_x)*pixel_size;
+    size_t row_size = (size_t)width*pixel_size;
+    JSAMPARRAY row = NULL;
+    if (crop_x != (JDIMENSION)x || crop_width != (JDIMENSION)width)
+        row = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE, crop_width*pixel_size, 1);
+    for (int i = 0; i < height; i++)
+    {
+        unsigned char *dst = destination + i*row_size;
+        if (row)
+        {
+            jpeg_read_scanlines(cinfo, row, 1);
+            memcpy(dst, row[0] + skip, row_size);
+        }
+        else
+            jpeg_read_scanlines(cinfo, &dst, 1);
+    }
+    jpeg_abort_decompress(cinfo); // nobody needs the rest
+    return true;
+}
+
+bool usbcam_jpeg_to_rgb_roi(int desired_width, int desired_height, int x, int y, int width, int height,
+                            unsigned char *rgb, unsigned char *jpg_data, unsigned int jpg_size)
+{
+    return usbcam_jpeg_to_pixels_roi(desired_width, desired_height, x, y, width, height, TJPF_RGB, rgb, jpg_data, jpg_size);
+}
+
+//
+// MJPG->JPG (see §MJPG)
+//
+
+// To understand how this works I suggest you run
+//   $ xxd <file> | less
+// on one of your MJPG images, and try to relate the binary data with
+// the JPEG specification on wikipedia (en.wikipedia.org/wiki/JPEG#JPEG_files).
+// Specifically, look for the ff** markers, starting with ffd8.
+// Then compare that with a JPG image.
+static const unsigned char usbcam_huffman[] =
+{
+    0xff, 0xc4, 0x01, 0xa2, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,
+    0x0b, 0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x10, 0x00,
+    0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01, 0x7d, 0x01,
+    0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22,
+    0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24,
+    0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28, 0x29,
+    0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a,
+    0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a,
+    0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8,
+    0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6,
+    0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3,
+    0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9,
+    0xfa, 0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01,
+    0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07,
+    0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33,
+    0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19,
+    0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46,
+    0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66,
+    0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85,
+    0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba,
+    0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8,
+    0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6,
+    0xf7, 0xf8, 0xf9, 0xfa
+};
+
+const unsigned char *usbcam_mjpg_huffman(unsigned int *size)
+{
+    *size = sizeof(usbcam_huffman);
+    return usbcam_huffman;
+}
+
+// Walks the segments of the header (each one says how long it is) up
+// to Start of Scan. Returns the offset of the first Start of Frame,
+// where the table goes, or -1 if there is a table already (or this
+// doesn't look like a JPG).
+int usbcam_mjpg_huffman_offset(const unsigned char *mjpg, unsigned int mjpg_size)
+{
+    if (mjpg_size < 4 || mjpg[0] != 0xff || mjpg[1] != 0xd8)
+        return -1;
+    int offset = -1;
+    unsigned int i = 2;
+    while (i + 4 <= mjpg_size)
+    {
+        // not on a marker (a broken length?): skip ahead to the next one
+        if (mjpg[i] != 0xff)
+        {
+            const unsigned char *next = (const unsigned char*)memchr(mjpg + i, 0xff, mjpg_size - i);
+            if (!next)
+                return -1;
+            i = (unsigned int)(next - mjpg);
+            continue;
+        }
+
+        unsigned char marker = mjpg[i+1];
+        if (marker == 0xff) // fill byte
+        {
+            i++;
+            continue;
+        }
+        if (marker == 0xc4) // Define Huffman Table
+            return -1;
+        if (marker == 0xd9) // End of Image before any scan
+            return -1;
+        int is_sof = marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+        if (offset < 0 && (is_sof || marker == 0xda))
+            offset = (int)i;
+        if (marker == 0xda) // Start of Scan, the compressed data follows
+            return offset;
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) // no length
+        {
+            i += 2;
+            continue;
+        }
+        i += 2 + ((mjpg[i+2] << 8) | mjpg[i+3]);
+    }
+    return -1;
+}
+
+unsigned int usbcam_mjpg_to_jpg(unsigned char *mjpg, unsigned int mjpg_size, unsigned char *jpg, unsigned int jpg_capacity)
+{
+    int offset = usbcam_mjpg_huffman_offset(mjpg, mjpg_size);
+    unsigned int jpg_size = mjpg_size + (offset >= 0 ? sizeof(usbcam_huffman) : 0);
+    if (!jpg)
+        return jpg_size;
+    if (jpg_size > jpg_capacity)
+        return 0;
+
+    if (offset < 0)
+    {
+        if (jpg != mjpg)
+            memcpy(jpg, mjpg, mjpg_size);
+        return jpg_size;
+    }
+
+    // squeeze huffman table inbetween (moving the tail first if we are working in place)
+    if (jpg == mjpg)
+    {
+        memmove(jpg+offset+sizeof(usbcam_huffman), mjpg+offset, mjpg_size-offset);
+    }
+    else
+    {
+        memcpy(jpg, mjpg, offset);
+        memcpy(jpg+offset+sizeof(usbcam_huffman), mjpg+offset, mjpg_size-offset);
+    }
+    memcpy(jpg+offset, usbcam_huffman, sizeof(usbcam_huffman));
+    return jpg_size;
+}
+
+//
+// Recording (see §RECORDING)
+//
+
+#define usbcam_avi_header_size 224 // everything up to the first frame chunk
+#define usbcam_avi_movi_offset 220 // where idx1 offsets count from
+#define usbcam_max_record_file_size (2047ull*1024*1024) // RIFF sizes are 32 bit, and some readers treat them as signed
+#define usbcam_default_record_file_size (1024ull*1024*1024)
+
+struct usbcam_record_entry_t // what the writer thread needs to know about a frame
+{
+    unsigned int       size; // bytes of mjpg data, without the Huffman table
+    int                huffman_offset; // where to insert the table, or -1
+    long long          timestamp_ns;
+    unsigned int       sequence;
+    unsigned int       skip; // the rest of the ring is unused, the record is at the start
+};
+
+struct usbcam_index_entry_t
+{
+    unsigned int offset; // of the chunk, from the movi list
+    unsigned int size; // of the chunk data
+    long long    timestamp_ns;
+    unsigned int sequence;
+};
+
+struct usbcam_recorder_t
+{
+    usbcam_recorder_opt_t opt;
+    int                   fd;
+    int                   file_number;
+    unsigned long long    file_size; // bytes written to the current file
+    unsigned int          max_frame_size;
+
+    // frames the writer thread hasn't written yet (a ring of usbcam_record_entry_t + data)
+    unsigned char        *ring;
+    unsigned int          ring_size;
+    unsigned int          ring_head; // where the next record goes
+    unsigned int          ring_tail; // the oldest record
+    unsigned int          ring_used;
+    int                   quit;
+    int                   error; // set by the writer thread, returned by the next usbcam_record
+    unsigned long long    dropped;
+    pthread_t             thread;
+    pthread_mutex_t       mutex;
+    pthread_cond_t        cond;
+
+    // frames in the current file
+    usbcam_index_entry_t *index;
+    unsigned int          index_count;
+    unsigned int          index_capacity;
+};
+
+static inline void usbcam_put_u16(unsigned char *p, unsigned int x) { p[0] = x & 0xff; p[1] = (x >> 8) & 0xff; }
+static inline void usbcam_put_u32(unsigned char *p, unsigned int x) { usbcam_put_u16(p, x & 0xffff); usbcam_put_u16(p+2, x >> 16); }
+static inline void usbcam_put_u64(unsigned char *p, unsigned long long x) { usbcam_put_u32(p, (unsigned int)x); usbcam_put_u32(p+4, (unsigned int)(x >> 32)); }
+static inline void usbcam_put_fourcc(unsigned char *p, const char *s) { memcpy(p, s, 4); }
+
+int usbcam_write_all(int fd, iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        usbcam_check(n >= 0, -errno, "Failed to write recording (%d): %s", errno, strerror(errno));
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (unsigned char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// The RIFF/AVI headers, with the sizes and frame rate as they are now
+void usbcam_avi_header(usbcam_recorder_t *rec, unsigned char *h)
+{
+    unsigned int frames = rec->index_count;
+    unsigned int movi_size = (unsigned int)(rec->file_size - usbcam_avi_movi_offset); // "movi" and the frames
+    unsigned int us_per_frame = 0;
+    if (frames > 1)
+        us_per_frame = (unsigned int)((rec->index[frames-1].timestamp_ns - rec->index[0].timestamp_ns) / 1000 / (frames-1));
+    if (us_per_frame == 0)
+        us_per_frame = 33333;
+
+    memset(h, 0, usbcam_avi_header_size);
+    usbcam_put_fourcc(h+0, "RIFF"); // size is patched when the file is done
+    usbcam_put_fourcc(h+8, "AVI ");
+    usbcam_put_fourcc(h+12, "LIST"); usbcam_put_u32(h+16, 192); usbcam_put_fourcc(h+20, "hdrl");
+
+    usbcam_put_fourcc(h+24, "avih"); usbcam_put_u32(h+28, 56);
+    usbcam_put_u32(h+32, us_per_frame);
+    usbcam_put_u32(h+44, 0x10); // AVIF_HASINDEX
+    usbcam_put_u32(h+48, frames);
+    usbcam_put_u32(h+56, 1); // streams
+    usbcam_put_u32(h+60, rec->max_frame_size);
+    usbcam_put_u32(h+64, rec->opt.width);
+    usbcam_put_u32(h+68, rec->opt.height);
+
+    usbcam_put_fourcc(h+88, "LIST"); usbcam_put_u32(h+92, 116); usbcam_put_fourcc(h+96, "strl");
+    usbcam_put_fourcc(h+100, "strh"); usbcam_put_u32(h+104, 56);
+    usbcam_put_fourcc(h+108, "vids");
+    usbcam_put_fourcc(h+112, "MJPG");
+    usbcam_put_u32(h+128, us_per_frame); // scale
+    usbcam_put_u32(h+132, 1000000); // rate, so frames per second is rate/scale
+    usbcam_put_u32(h+140, frames); // length
+    usbcam_put_u32(h+144, rec->max_frame_size);
+    usbcam_put_u32(h+148, 0xffffffff); // quality
+    usbcam_put_u16(h+160, rec->opt.width);
+    usbcam_put_u16(h+162, rec->opt.height);
+
+    usbcam_put_fourcc(h+164, "strf"); usbcam_put_u32(h+168, 40);
+    usbcam_put_u32(h+172, 40);
+    usbcam_put_u32(h+176, rec->opt.width);
+    usbcam_put_u32(h+180, rec->opt.height);
+    usbcam_put_u16(h+184, 1); // planes
+    usbcam_put_u16(h+186, 24); // bits per pixel
+    usbcam_put_fourcc(h+188, "MJPG");
+    usbcam_put_u32(h+192, rec->opt.width*rec->opt.height*3);
+
+    usbcam_put_fourcc(h+212, "LIST"); usbcam_put_u32(h+216, movi_size);
+    usbcam_put_fourcc(h+220, "movi");
+}
+
+int usbcam_recorder_start_file(usbcam_recorder_t *rec)
+{
+    char path[1024];
+    if (strchr(rec->opt.path, '%'))
+        snprintf(path, sizeof(path), rec->opt.path, rec->file_number);
+    else
+        snprintf(path, sizeof(path), "%s", rec->opt.path);
+    rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    usbcam_check(rec->fd >= 0, -errno, "Failed to create %s (%d): %s", path, errno, strerror(errno));
+
+    // reserve the whole file up front so that the filesystem doesn't
+    // allocate blocks as we go (not every filesystem can)
+    if (rec->opt.preallocate && fallocate(rec->fd, 0, 0, (off_t)rec->opt.max_file_size) != 0)
+        usbcam_debug("Could not preallocate %s (%d): %s", path, errno, strerror(errno));
+
+    rec->file_size = usbcam_avi_header_size;
+    rec->index_count = 0;
+    unsigned char header[usbcam_avi_header_size];
+    usbcam_avi_header(rec, header);
+    iovec iov = { header, sizeof(header) };
+    return usbcam_write_all(rec->fd, &iov, 1);
+}
+
+// Writes the index and the frame timestamps, and fixes up the headers
+int usbcam_recorder_finish_file(usbcam_recorder_t *rec)
+{
+    if (rec->fd < 0)
+        return 0;
+    int r = 0;
+    unsigned int n = rec->index_count;
+    size_t size = 8 + 16*n + 8 + 16*n;
+    unsigned char *tail = (unsigned char*)malloc(size);
+    if (!tail)
+    {
+        usbcam_warn("Failed to allocate memory for the index");
+        r = -ENOMEM;
+    }
+    else
+    {
+        // idx1, which players use to seek
+        unsigned char *p = tail;
+        usbcam_put_fourcc(p, "idx1"); usbcam_put_u32(p+4, 16*n); p += 8;
+        for (unsigned int i = 0; i < n; i++, p += 16)
+        {
+            usbcam_put_fourcc(p, "00dc");
+            usbcam_put_u32(p+4, 0x10); // AVIIF_KEYFRAME
+            usbcam_put_u32(p+8, rec->index[i].offset);
+            usbcam_put_u32(p+12, rec->index[i].size);
+        }
+
+        // usbt has the capture time and driver sequence number of each
+        // frame, which are lost in the constant frame rate of an AVI
+        usbcam_put_fourcc(p, "usbt"); usbcam_put_u32(p+4, 16*n); p += 8;
+        for (unsigned int i = 0; i < n; i++, p += 16)
+        {
+            usbcam_put_u64(p, (unsigned long long)rec->index[i].timestamp_ns);
+            usbcam_put_u32(p+8, rec->index[i].sequence);
+            usbcam_put_u32(p+12, 0);
+        }
+
+        unsigned char header[usbcam_avi_header_size];
+        usbcam_avi_header(rec, header);
+        usbcam_put_u32(header+4, (unsigned int)(rec->file_size + size - 8));
+        iovec iov = { tail, size };
+        r = usbcam_write_all(rec->fd, &iov, 1);
+        if (r == 0 && pwrite(rec->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header))
+            r = -errno;
+        if (r == 0 && ftruncate(rec->fd, (off_t)(rec->file_size + size)) != 0) // give back what we preallocated
+            r = -errno;
+        free(tail);
+    }
+    close(rec->fd);
+    rec->fd = -1;
+    rec->file_number++;
+    return r;
+}
+
+int usbcam_recorder_write(usbcam_recorder_t *rec, usbcam_record_entry_t *entry, unsigned char *data)
+{
+    unsigned int table_size;
+    const unsigned char *table = usbcam_mjpg_huffman(&table_size);
+    unsigned int size = entry->size + (entry->huffman_offset >= 0 ? table_size : 0);
+    unsigned int padded = size + (size & 1); // chunks are word aligned
+
+    // start a new file if this frame and its index entries don't fit
+    unsigned long long tail = 8 + 16ull*(rec->index_count+1) + 8 + 16ull*(rec->index_count+1);
+    if (rec->index_count > 0 && rec->file_size + 8 + padded + tail > rec->opt.max_file_size)
+    {
+        usbcam_check(strchr(rec->opt.path, '%'), -EFBIG, "Recording is full (put %%d in the path to rotate)");
+        usbcam_try(usbcam_recorder_finish_file(rec));
+        usbcam_try(usbcam_recorder_start_file(rec));
+    }
+
+    if (rec->index_count == rec->index_capacity)
+    {
+        unsigned int capacity = rec->index_capacity ? 2*rec->index_capacity : 1024;
+        usbcam_index_entry_t *index = (usbcam_index_entry_t*)realloc(rec->index, capacity*sizeof(usbcam_index_entry_t));
+        usbcam_check(index, -ENOMEM, "Failed to allocate memory for the index");
+        rec->index = index;
+        rec->index_capacity = capacity;
+    }
+
+    unsigned char chunk[8];
+    usbcam_put_fourcc(chunk, "00dc");
+    usbcam_put_u32(chunk+4, size);
+    unsigned char pad = 0;
+    iovec iov[5];
+    int count = 0;
+    iov[count].iov_base = chunk; iov[count++].iov_len = 8;
+    if (entry->huffman_offset >= 0)
+    {
+        iov[count].iov_base = data; iov[count++].iov_len = entry->huffman_offset;
+        iov[count].iov_base = (void*)table; iov[count++].iov_len = table_size;
+        iov[count].iov_base = data + entry->huffman_offset; iov[count++].iov_len = entry->size - entry->huffman_offset;
+    }
+    else
+    {
+        iov[count].iov_base = data; iov[count++].iov_len = entry->size;
+    }
+    if (size & 1)
+    {
+        iov[count].iov_base = &pad; iov[count++].iov_len = 1;
+    }
+    usbcam_try(usbcam_write_all(rec->fd, iov, count));
+
+    usbcam_index_entry_t *e = &rec->index[rec->index_count++];
+    e->offset = (unsigned int)(rec->file_size - usbcam_avi_movi_offset);
+    e->size = size;
+    e->timestamp_ns = entry->timestamp_ns;
+    e->sequence = entry->sequence;
+    rec->file_size += 8 + padded;
+    if (size > rec->max_frame_size)
+        rec->max_frame_size = size;
+    return 0;
+}
+
+void *usbcam_recorder_thread(void *arg)
+{
+    usbcam_recorder_t *rec = (usbcam_recorder_t*)arg;
+    pthread_mutex_lock(&rec->mutex);
+    for (;;)
+    {
+        while (!rec->ring_used && !rec->quit)
+            pthread_cond_wait(&rec->cond, &rec->mutex);
+        if (!rec->ring_used)
+            break;
+
+        // the record stays in the ring (so the producer won't touch it) until it's written
+        // (a gap at the end too small for a marker is skipped as well)
+        unsigned int at = rec->ring_tail;
+        unsigned int skipped = 0;
+        usbcam_record_entry_t entry;
+        if (rec->ring_size - at < sizeof(entry))
+            skipped = rec->ring_size - at;
+        else
+        {
+            memcpy(&entry, rec->ring + at, sizeof(entry));
+            skipped = entry.skip;
+        }
+        if (skipped || at == rec->ring_size)
+            at = 0;
+        memcpy(&entry, rec->ring + at, sizeof(entry));
+        pthread_mutex_unlock(&rec->mutex);
+
+        int r = rec->error ? 0 : usbcam_recorder_write(rec, &entry, rec->ring + at + sizeof(entry));
+
+        pthread_mutex_lock(&rec->mutex);
+        if (r < 0)
+            rec->error = r;
+        unsigned int record_size = (sizeof(entry) + entry.size + 7) & ~7u;
+        rec->ring_tail = at + record_size;
+        rec->ring_used -= record_size + skipped;
+        if (rec->ring_used == 0)
+            rec->ring_head = rec->ring_tail = 0;
+    }
+    pthread_mutex_unlock(&rec->mutex);
+    return NULL;
+}
+
+usbcam_recorder_t *usbcam_recorder_open(usbcam_recorder_opt_t opt)
+{
+    if (!opt.path)
+    {
+        usbcam_warn("You need to give the recording a path");
+        return NULL;
+    }
+    if (opt.max_file_size == 0)
+        opt.max_file_size = usbcam_default_record_file_size;
+    if (opt.max_file_size > usbcam_max_record_file_size)
+        opt.max_file_size = usbcam_max_record_file_size;
+    if (opt.buffer_size == 0)
+        opt.buffer_size = 32*1024*1024;
+
+    usbcam_recorder_t *rec = (usbcam_recorder_t*)calloc(1, sizeof(usbcam_recorder_t));
+    if (!rec)
+    {
+        usbcam_warn("Failed to allocate recorder");
+        return NULL;
+    }
+    rec->opt = opt;
+    rec->fd = -1;
+    rec->ring_size = (opt.buffer_size + 7) & ~7u;
+    rec->ring = (unsigned char*)malloc(rec->ring_size);
+    if (!rec->ring || usbcam_recorder_start_file(rec) < 0)
+    {
+        if (!rec->ring)
+            usbcam_warn("Failed to allocate recording buffer");
+        if (rec->fd >= 0)
+            close(rec->fd);
+        free(rec->ring);
+        free(rec);
+        return NULL;
+    }
+    pthread_mutex_init(&rec->mutex, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+    if (pthread_create(&rec->thread, NULL, usbcam_recorder_thread, rec) != 0)
+    {
+        usbcam_warn("Failed to start recording thread");
+        pthread_mutex_destroy(&rec->mutex);
+        pthread_cond_destroy(&rec->cond);
+        close(rec->fd);
+        free(rec->ring);
+        free(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+int usbcam_record(usbcam_recorder_t *rec, const unsigned char *data, unsigned int size, long long timestamp_ns, unsigned int sequence)
+{
+    usbcam_record_entry_t entry;
+    entry.size = size;
+    entry.huffman_offset = usbcam_mjpg_huffman_offset(data, size);
+    entry.timestamp_ns = timestamp_ns;
+    entry.sequence = sequence;
+    entry.skip = 0;
+    unsigned int record_size = (sizeof(entry) + size + 7) & ~7u;
+
+    pthread_mutex_lock(&rec->mutex);
+    int r = rec->error;
+    if (r == 0)
+    {
+        // records are contiguous; if this one doesn't fit before the end, the end is skipped
+        unsigned int at = rec->ring_head;
+        unsigned int skip = 0;
+        if (at + record_size > rec->ring_size)
+        {
+            skip = rec->ring_size - at;
+            at = 0;
+        }
+        if (rec->ring_used + skip + record_size > rec->ring_size)
+        {
+            // the disk can't keep up; drop the frame rather than block the camera
+            rec->dropped++;
+            r = -ENOBUFS;
+        }
+        else
+        {
+            if (skip >= sizeof(entry))
+            {
+                usbcam_record_entry_t marker = {0};
+                marker.skip = skip;
+                memcpy(rec->ring + rec->ring_head, &marker, sizeof(marker));
+            }
+            memcpy(rec->ring + at, &entry, sizeof(entry));
+            memcpy(rec->ring + at + sizeof(entry), data, size);
+            rec->ring_head = at + record_size;
+            rec->ring_used += skip + record_size;
+            pthread_cond_broadcast(&rec->cond);
+        }
+    }
+    pthread_mutex_unlock(&rec->mutex);
+    return r;
+}
+
+int usbcam_record_frame(usbcam_recorder_t *rec, const usbcam_frame_t *frame)
+{
+    return usbcam_record(rec, frame->data, frame->size, usbcam_timestamp_ns(frame), frame->sequence);
+}
+
+unsigned long long usbcam_recorder_dropped(usbcam_recorder_t *rec)
+{
+    pthread_mutex_lock(&rec->mutex);
+    unsigned long long dropped = rec->dropped;
+    pthread_mutex_unlock(&rec->mutex);
+    return dropped;
+}
+
+int usbcam_recorder_close(usbcam_recorder_t *rec)
+{
+    if (!rec)
+        return 0;
+    pthread_mutex_lock(&rec->mutex);
+    rec->quit = 1;
+    pthread_cond_broadcast(&rec->cond);
+    pthread_mutex_unlock(&rec->mutex);
+    pthread_join(rec->thread, NULL);
+
+    int r = rec->error;
+    int finish = usbcam_recorder_finish_file(rec);
+    if (r == 0)
+        r = finish;
+    pthread_mutex_destroy(&rec->mutex);
+    pthread_cond_destroy(&rec->cond);
+    free(rec->index);
+    free(rec->ring);
+    free(rec);
+    return r;
 }
@@ -1,5 +1,9 @@
-// vdb - Version 3
+// vdb - Version 7
 // Changelog
+// (7) Compressed keyframes and differences from them, parsed once per frame (VDB_DELTA)
+// (6) Several browsers at once, each sent the newest frame when ready for one (VDB_THREADS)
+// (5) Threads and a ring of send buffers in place of processes on Linux (VDB_THREADS)
+// (4) JPEG images, decoded by the browser (vdb_imageJPEG)
 // (3) Float and int sliders and checkboxes
 // (2) Message passing from browser to vdb
 // (1) Works on unix and windows
@@ -14,6 +18,7 @@
 //         vdb_end();
 //     }
 int  vdb_begin(); // Returns true if vdb is not already busy sending data
+                  // (with VDB_THREADS: if a ring slot is free)
 void vdb_end();
 
 // LOOP MODE - Run a block of code at a specified framerate until
@@ -58,6 +63,12 @@ void vdb_circle(float x, float y, float r);
 // render it as an image of RGB values, each one byte.
 void vdb_imageRGB8(const void *data, int w, int h);
 
+// This will send a complete JPEG file of (size) bytes as it is, to be
+// decoded by the browser and rendered like vdb_imageRGB8. Frames from
+// MJPEG cameras often omit the Huffman tables, which browsers need;
+// see usbcam_mjpg_to_jpg.
+void vdb_imageJPEG(const void *data, int size);
+
 // These functions let you modify variables in a vdb_begin or vdb_loop block.
 // You can build a simple graphical user interface with sliders and checkboxes.
 void vdb_slider1f(const char *in_label, float *x, float min_value, float max_value);
@@ -99,6 +110,13 @@ void *vdb_push_bytes(const void *data, int count);
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#ifdef VDB_THREADS
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
 #endif
 #include <stdio.h>
 #include <stdint.h>
@@ -113,6 +131,45 @@ void *vdb_push_bytes(const void *data, int count);
 #define VDB_WORK_BUFFER_SIZE (32*1024*1024)
 #endif
 
+// On unix, vdb runs its network code in forked processes, and hands
+// draw commands over through two work buffers in shared memory, for
+// one browser at a time. If you define VDB_THREADS before #including
+// vdb (Linux only, link -pthread), it runs in a thread of your process
+// instead, serving up to VDB_MAX_CLIENTS browsers, from a ring of this
+// many work buffers. These start empty and grow as commands come in,
+// up to VDB_WORK_BUFFER_SIZE. Each browser is sent the newest frame
+// whenever it is done with the last one, so slow ones just see fewer
+// frames. vdb_begin has to skip a frame only while every slot is
+// either the newest frame or still being sent to someone.
+#ifndef VDB_RING_SLOTS
+#define VDB_RING_SLOTS 8
+#endif
+
+#ifndef VDB_MAX_CLIENTS
+#define VDB_MAX_CLIENTS 8
+#endif
+
+// With VDB_THREADS you can also define VDB_DELTA, to have frames sent
+// compressed, and where they can be, as differences from the last
+// keyframe: commands and parts of images that did not change are then
+// referred to instead of sent again. Every VDB_KEYFRAME_INTERVAL'th
+// frame is a keyframe, and a browser is sent the keyframe before the
+// first difference from it that it gets.
+#ifndef VDB_KEYFRAME_INTERVAL
+#define VDB_KEYFRAME_INTERVAL 60
+#endif
+
+#ifdef VDB_THREADS
+#if !defined(__linux__)
+#error "[vdb] VDB_THREADS needs epoll, i.e. Linux"
+#endif
+#if VDB_RING_SLOTS < 2 || VDB_RING_SLOTS > 32
+#error "[vdb] VDB_RING_SLOTS must be between 2 and 32"
+#endif
+#elif defined(VDB_DELTA)
+#error "[vdb] VDB_DELTA needs VDB_THREADS"
+#endif
+
 // Messages received from the browser are stored in a buffer that
 // is allocated once on the first vdb_begin call, and stays a fixed
 // size is given below in number-of-bytes. If you are sending large
@@ -141,6 +198,15 @@ typedef struct
     char chars[VDB_LABEL_LENGTH+1];
 } vdb_label_t;
 
+#ifdef VDB_THREADS
+typedef struct
+{
+    char *data;
+    int capacity;
+    int used;
+} vdb_slot_t;
+#endif
+
 #define VDB_MAX_VAR_COUNT 1024
 typedef struct
 {
@@ -161,6 +227,16 @@ typedef struct
     volatile HANDLE send_semaphore;
     volatile LONG busy;
     volatile int bytes_to_send;
+    #elif defined(VDB_THREADS)
+    // The main thread takes a slot from ring_free to fill, then swaps it
+    // into ring_pending and signals wakeup. The network thread takes it
+    // from there, and puts slots back in ring_free when it is done with
+    // them. Neither waits for the other.
+    vdb_slot_t ring[VDB_RING_SLOTS];
+    int work_slot; // only used by the main thread, -1 if none
+    unsigned int ring_free; // bit i set if ring[i] is free
+    int ring_pending; // -1 if none
+    int wakeup; // eventfd
     #else
     int bytes_to_send;
     pid_t recv_pid;
@@ -177,8 +253,10 @@ typedef struct
     int critical_error;
     int has_connection;
     int work_buffer_used;
+    #ifndef VDB_THREADS
     char swapbuffer1[VDB_WORK_BUFFER_SIZE];
     char swapbuffer2[VDB_WORK_BUFFER_SIZE];
+    #endif
     char *work_buffer;
     char *send_buffer;
 
@@ -255,6 +333,7 @@ int tcp_sendall(const void *data, int size);
 #define tcp_cleanup() WSACleanup()
 #define tcp_close(s) closesocket(s)
 #define tcp_socket_t SOCKET
+#define MSG_NOSIGNAL 0
 
 #else
 
@@ -271,6 +350,9 @@ int tcp_sendall(const void *data, int size);
 #define tcp_cleanup()
 #define tcp_close(s) close(s)
 #define tcp_socket_t int
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 #endif
 
@@ -438,7 +520,8 @@ int tcp_close_client()
 
 int tcp_send(const void *data, int size, int *sent_bytes)
 {
-    *sent_bytes = send(tcp_client_socket, (const char*)data, size, 0);
+    // A client going away must not SIGPIPE the process we are running in
+    *sent_bytes = send(tcp_client_socket, (const char*)data, size, MSG_NOSIGNAL);
     if (*sent_bytes >= 0) return 1;
     else return 0;
 }
@@ -1405,6 +1488,8 @@ int vdb_signal_data_sent()  { vdb_shared->busy = 0; return 1; }
 int vdb_poll_data_sent()    { return (InterlockedCompareExchange(&vdb_shared->busy, 1, 0) == 0); }
 int vdb_signal_data_ready() { vdb_shared->busy = 0; ReleaseSemaphore(vdb_shared->send_semaphore, 1, 0); return 1; } // @ mfence, writefence
 void vdb_sleep(int ms)      { Sleep(ms); }
+#elif defined(VDB_THREADS)
+void vdb_sleep(int ms)      { usleep(ms*1000); }
 #else
 int vdb_wait_data_ready()   { int val = 0; return  read(vdb_shared->ready[0], &val, sizeof(val)) == sizeof(val); }
 int vdb_poll_data_sent()    { int val = 0; return   read(vdb_shared->done[0], &val, sizeof(val)) == sizeof(val); }
@@ -1413,6 +1498,7 @@ int vdb_signal_data_sent()  { int one = 1; return  write(vdb_shared->done[1], &o
 void vdb_sleep(int ms)      { usleep(ms*1000); }
 #endif
 
+#ifndef VDB_THREADS
 int vdb_send_thread()
 {
     vdb_shared_t *vs = vdb_shared;
@@ -1452,6 +1538,7 @@ int vdb_send_thread()
 #ifdef VDB_WINDOWS
 DWORD WINAPI vdb_win_send_thread(void *vdata) { (void)(vdata); return vdb_send_thread(); }
 #endif
+#endif // VDB_THREADS
 
 int vdb_strcmpn(const char *a, const char *b, int len)
 {
@@ -1484,6 +1571,7 @@ int vdb_is_websockets_request(const char *str, int len)
     return 0;
 }
 
+#ifndef VDB_THREADS
 int vdb_recv_thread()
 {
     vdb_shared_t *vs = vdb_shared;
@@ -1670,17 +1758,592 @@ int vdb_recv_thread()
 #ifdef VDB_WINDOWS
 DWORD WINAPI vdb_win_recv_thread(void *vdata) { (void)(vdata); return vdb_recv_thread(); }
 #endif
+#endif // VDB_THREADS
 
 // End auto-include vdb_network_threads.c
 
+// Begin auto-include vdb_broadcast.c
+#ifdef VDB_THREADS
+// With VDB_THREADS a single network thread serves every browser, over
+// nonblocking sockets and epoll. Frames are not copied per client: each
+// one is sent its own header and payload straight from the ring slot,
+// and a client that is slow to take them gets only the newest one when
+// it is done with the last, so it doesn't hold up the others.
+
+#define vdb_client_request   0 // waiting for the whole HTTP request
+#define vdb_client_page      1 // sending the HTML page, then closing
+#define vdb_client_upgrade   2 // sending the WebSockets handshake
+#define vdb_client_websocket 3 // sending frames, receiving messages
+
+typedef struct
+{
+    int fd; // -1 if not in use
+    int state;
+    char *recv_buffer; // VDB_RECV_BUFFER_SIZE (+1 for vdb_parse_message)
+    int received;
+    char reply[1024];
+    struct iovec out[2]; // the rest of what we are sending
+    int out_slot; // ring slot being sent, -1 if none
+    unsigned int sent_frame; // the newest frame it has been sent
+    unsigned int key_frame; // the keyframe it has, with VDB_DELTA
+    int polling_out; // whether epoll waits for room to send
+} vdb_client_t;
+
+// These belong to the network thread
+static vdb_client_t vdb_clients[VDB_MAX_CLIENTS];
+static int vdb_epoll = -1;
+static int vdb_latest_slot = -1; // kept until a newer one comes in
+static unsigned int vdb_latest_frame = 0;
+static int vdb_slot_users[VDB_RING_SLOTS]; // clients sending each slot
+static unsigned char vdb_slot_header[VDB_RING_SLOTS][16];
+static int vdb_slot_header_len[VDB_RING_SLOTS];
+static char *vdb_slot_payload[VDB_RING_SLOTS]; // what we send of each slot
+static int vdb_slot_payload_len[VDB_RING_SLOTS];
+#ifdef VDB_DELTA
+static int vdb_key_slot = -1; // also kept until a newer one comes in
+static unsigned int vdb_key_frame = 0;
+static unsigned int vdb_slot_key[VDB_RING_SLOTS]; // the keyframe each slot needs
+static unsigned char *vdb_slot_packed[VDB_RING_SLOTS];
+static int vdb_slot_packed_capacity[VDB_RING_SLOTS];
+#else
+#define vdb_key_slot -1
+#endif
+
+void vdb_release_slot(int slot)
+{
+    if (slot >= 0 && slot != vdb_latest_slot && slot != vdb_key_slot && vdb_slot_users[slot] == 0)
+        __atomic_fetch_or(&vdb_shared->ring_free, 1u << slot, __ATOMIC_RELEASE);
+}
+
+void vdb_close_client(vdb_client_t *c)
+{
+    vdb_log("Closing client %d\n", (int)(c - vdb_clients));
+    if (c->state == vdb_client_websocket)
+        vdb_shared->has_connection--;
+    if (c->out_slot >= 0)
+    {
+        vdb_slot_users[c->out_slot]--;
+        vdb_release_slot(c->out_slot);
+    }
+    close(c->fd); // which also removes it from epoll
+    free(c->recv_buffer);
+    c->fd = -1;
+}
+
+// Sends as much of c->out as the socket takes, and then whatever comes
+// next: the newest frame for a websocket client. Returns false if the
+// client should be closed.
+int vdb_write_client(vdb_client_t *c)
+{
+    for (;;)
+    {
+        while (c->out[0].iov_len + c->out[1].iov_len > 0)
+        {
+            struct msghdr msg = {0};
+            ssize_t sent;
+            int i;
+            msg.msg_iov = c->out;
+            msg.msg_iovlen = 2;
+            sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (sent < 0)
+                return 0;
+            for (i = 0; i < 2; i++)
+            {
+                size_t n = (size_t)sent < c->out[i].iov_len ? (size_t)sent : c->out[i].iov_len;
+                c->out[i].iov_base = (char*)c->out[i].iov_base + n;
+                c->out[i].iov_len -= n;
+                sent -= n;
+            }
+        }
+        if (c->out[0].iov_len + c->out[1].iov_len > 0)
+            break;
+
+        if (c->state == vdb_client_page)
+            return 0; // we said 'Connection: Closed'
+        if (c->state == vdb_client_upgrade)
+        {
+            c->state = vdb_client_websocket;
+            vdb_shared->has_connection++;
+        }
+        if (c->out_slot >= 0)
+        {
+            vdb_slot_users[c->out_slot]--;
+            vdb_release_slot(c->out_slot);
+            c->out_slot = -1;
+        }
+        if (c->state != vdb_client_websocket || vdb_latest_slot < 0 || c->sent_frame == vdb_latest_frame)
+            break;
+
+        // Skipping any frames that came and went while we were sending the last
+        c->out_slot = vdb_latest_slot;
+        #ifdef VDB_DELTA
+        if (vdb_slot_key[c->out_slot] != c->key_frame)
+            c->out_slot = vdb_key_slot; // which it needs first
+        c->key_frame = vdb_slot_key[c->out_slot];
+        #endif
+        if (c->out_slot == vdb_latest_slot)
+            c->sent_frame = vdb_latest_frame;
+        vdb_slot_users[c->out_slot]++;
+        c->out[0].iov_base = vdb_slot_header[c->out_slot];
+        c->out[0].iov_len = vdb_slot_header_len[c->out_slot];
+        c->out[1].iov_base = vdb_slot_payload[c->out_slot];
+        c->out[1].iov_len = vdb_slot_payload_len[c->out_slot];
+    }
+
+    // Only ask epoll about room to send while we have something to send
+    {
+        int want_out = c->out[0].iov_len + c->out[1].iov_len > 0;
+        if (want_out != c->polling_out)
+        {
+            struct epoll_event event = {0};
+            event.events = want_out ? EPOLLIN|EPOLLOUT : EPOLLIN;
+            event.data.ptr = c;
+            if (epoll_ctl(vdb_epoll, EPOLL_CTL_MOD, c->fd, &event) != 0)
+                return 0;
+            c->polling_out = want_out;
+        }
+    }
+    return 1;
+}
+
+// Returns false if the client should be closed
+int vdb_read_client(vdb_client_t *c)
+{
+    int n = (int)recv(c->fd, c->recv_buffer + c->received, VDB_RECV_BUFFER_SIZE - c->received, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 1;
+    if (n <= 0)
+    {
+        vdb_log("Connection went down\n");
+        return 0;
+    }
+    c->received += n;
+
+    if (c->state == vdb_client_request)
+    {
+        c->recv_buffer[c->received] = 0;
+        if (!strstr(c->recv_buffer, "\r\n\r\n"))
+            return c->received < VDB_RECV_BUFFER_SIZE; // wait for the rest of it
+        if (!vdb_is_http_request(c->recv_buffer, c->received))
+        {
+            vdb_log("Got an invalid HTTP request while waiting for handshake\n");
+            return 0;
+        }
+
+        // If it was not a websocket HTTP request we will send the HTML page
+        if (!vdb_is_websockets_request(c->recv_buffer, c->received))
+        {
+            const char *content = get_vdb_html_page();
+            int len = sprintf(c->reply,
+                "HTTP/1.1 200 OK\r\n"
+                "Content-Length: %d\r\n"
+                "Content-Type: text/html\r\n"
+                "Connection: Closed\r\n\r\n",
+                (int)strlen(content));
+            vdb_log("Sending HTML page.\n");
+            c->out[0].iov_base = c->reply;
+            c->out[0].iov_len = len;
+            c->out[1].iov_base = (void*)content;
+            c->out[1].iov_len = strlen(content);
+            c->state = vdb_client_page;
+        }
+
+        // Otherwise we will set up the Websockets connection
+        else
+        {
+            char *response;
+            int response_len;
+            if (!vdb_generate_handshake(c->recv_buffer, c->received, &response, &response_len) ||
+                response_len > (int)sizeof(c->reply))
+            {
+                vdb_log("Failed to generate WebSockets handshake key\n");
+                return 0;
+            }
+            vdb_log("Sending WebSockets handshake\n");
+            memcpy(c->reply, response, response_len);
+            c->out[0].iov_base = c->reply;
+            c->out[0].iov_len = response_len;
+            c->state = vdb_client_upgrade;
+        }
+        c->received = 0;
+        return vdb_write_client(c);
+    }
+
+    if (c->state == vdb_client_websocket)
+    {
+        vdb_msg_t msg;
+        int parsed = vdb_parse_message(c->recv_buffer, c->received, &msg);
+        c->received = 0; // @ INCOMPLETE: Assemble frames
+        if (!parsed)
+        {
+            vdb_log("Got a bad message\n");
+            return 1;
+        }
+        if (!msg.fin)
+        {
+            vdb_log("Got an incomplete message (%d): '%s'\n", msg.length, msg.payload);
+            return 1;
+        }
+        if (msg.opcode == 0x8) // closing handshake
+        {
+            vdb_log("Client voluntarily disconnected\n");
+            return 0;
+        }
+        if (!vdb_handle_message(msg, &vdb_shared->status))
+            vdb_log("Handled a bad message\n");
+        return 1;
+    }
+
+    c->received = 0; // nothing is expected before the handshake is sent
+    return 1;
+}
+
+void vdb_accept_clients()
+{
+    for (;;)
+    {
+        vdb_client_t *c = 0;
+        struct epoll_event event = {0};
+        int i;
+        int fd = accept(tcp_listen_socket, 0, 0);
+        if (fd < 0 && errno == EINTR)
+            continue;
+        if (fd < 0)
+            return;
+        for (i = 0; i < VDB_MAX_CLIENTS; i++)
+            if (vdb_clients[i].fd < 0)
+                c = &vdb_clients[i];
+        if (!c || fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+        {
+            vdb_log("Turning away a client (more than %d?)\n", VDB_MAX_CLIENTS);
+            close(fd);
+            continue;
+        }
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->state = vdb_client_request;
+        c->out_slot = -1;
+        c->recv_buffer = (char*)malloc(VDB_RECV_BUFFER_SIZE + 1);
+        event.events = EPOLLIN;
+        event.data.ptr = c;
+        if (!c->recv_buffer || epoll_ctl(vdb_epoll, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            vdb_close_client(c);
+            continue;
+        }
+        vdb_log("Accepted client %d\n", (int)(c - vdb_clients));
+    }
+}
+
+#ifdef VDB_DELTA
+// Frames are packed as a sequence of literal runs and matches, like an
+// LZ4 block, but with 32 bit match distances, which may reach back past
+// the start of the frame into the keyframe it is a difference from:
+//   token:     literal count << 4 | (match length - 6), (15: more to come)
+//   [count]    255, 255, ..., n: the rest of the literal count
+//   literals
+//   distance   4 bytes little endian, counting back from here
+//   [length]   the rest of the match length, like the literal count
+// The stream ends once it has made the whole frame, after the literals.
+// Matches are at least 6 bytes, which pays for the token, the distance
+// and the byte a long literal count may need, so that packing can only
+// grow a frame by the literal counts (see vdb_pack_bound).
+// A packed frame starts with a 12 byte header:
+//   'v' 'd' 'b' kind ('k' keyframe, 'd' difference from one)
+//   keyframe number  4 bytes little endian
+//   unpacked size    4 bytes little endian
+#define VDB_PACK_HEADER_SIZE 12
+#define VDB_PACK_HASH_BITS 16
+#define VDB_PACK_MIN_MATCH 6
+
+static int vdb_pack_hash[1 << VDB_PACK_HASH_BITS];
+
+uint32_t vdb_pack_read32(const unsigned char *p) { uint32_t x; memcpy(&x, p, 4); return x; }
+int vdb_pack_hash_of(uint32_t x) { return (int)((x*2654435761u) >> (32 - VDB_PACK_HASH_BITS)); }
+
+unsigned char *vdb_pack_length(unsigned char *out, int n)
+{
+    while (n >= 255)
+    {
+        *out++ = 255;
+        n -= 255;
+    }
+    *out++ = (unsigned char)n;
+    return out;
+}
+
+unsigned char *vdb_pack_sequence(unsigned char *out, const unsigned char *literals, int count, uint32_t distance, int length)
+{
+    int m = length - VDB_PACK_MIN_MATCH; // only used if distance > 0
+    *out++ = (unsigned char)(((count < 15 ? count : 15) << 4) | (distance ? (m < 15 ? m : 15) : 0));
+    if (count >= 15)
+        out = vdb_pack_length(out, count - 15);
+    memcpy(out, literals, count);
+    out += count;
+    if (distance)
+    {
+        *out++ = (unsigned char)(distance >>  0);
+        *out++ = (unsigned char)(distance >>  8);
+        *out++ = (unsigned char)(distance >> 16);
+        *out++ = (unsigned char)(distance >> 24);
+        if (m >= 15)
+            out = vdb_pack_length(out, m - 15);
+    }
+    return out;
+}
+
+// The most it takes to pack n bytes, header included
+int vdb_pack_bound(int n) { return VDB_PACK_HEADER_SIZE + n + n/255 + 16; }
+
+// Packs n bytes of src into dst, with matches into dict (dict_n bytes,
+// 0 for a keyframe) as well as src itself. Returns the packed size.
+int vdb_pack(const unsigned char *src, int n, const unsigned char *dict, int dict_n, unsigned char *dst)
+{
+    unsigned char *out = dst;
+    int anchor = 0;
+    int i = 0;
+    for (i = 0; i < (1 << VDB_PACK_HASH_BITS); i++)
+        vdb_pack_hash[i] = -1;
+    for (i = 0; i + 4 <= dict_n; i++)
+        vdb_pack_hash[vdb_pack_hash_of(vdb_pack_read32(dict + i))] = i;
+
+    // Positions below dict_n are in dict, the rest are in src
+    i = 0;
+    while (i + 4 <= n)
+    {
+        uint32_t x = vdb_pack_read32(src + i);
+        int h = vdb_pack_hash_of(x);
+        int from = vdb_pack_hash[h];
+        int length = 0;
+        vdb_pack_hash[h] = dict_n + i;
+
+        // Most of a near-identical frame is at the same place as before
+        if (i + 4 <= dict_n && vdb_pack_read32(dict + i) == x)
+            from = i;
+
+        if (from >= 0)
+        {
+            const unsigned char *a = from < dict_n ? dict + from : src + (from - dict_n);
+            int limit = from < dict_n ? dict_n - from : n; // matches don't run off the end of dict
+            if (limit > n - i)
+                limit = n - i;
+            while (length < limit && a[length] == src[i + length])
+                length++;
+        }
+        if (length < VDB_PACK_MIN_MATCH)
+        {
+            i++;
+            continue;
+        }
+        out = vdb_pack_sequence(out, src + anchor, i - anchor, (uint32_t)(dict_n + i - from), length);
+        i += length;
+        anchor = i;
+    }
+    out = vdb_pack_sequence(out, src + anchor, n - anchor, 0, 0);
+    return (int)(out - dst);
+}
+#endif
+
+// Takes the newest frame from the main thread, if there is one, and
+// starts sending it to the clients that are not sending anything
+void vdb_take_latest()
+{
+    unsigned char *frame;
+    int frame_len;
+    int previous;
+    int slot;
+    int i;
+    uint64_t count;
+    if (read(vdb_shared->wakeup, &count, sizeof(count)) != sizeof(count))
+        return;
+    slot = __atomic_exchange_n(&vdb_shared->ring_pending, -1, __ATOMIC_ACQ_REL);
+    if (slot < 0)
+        return;
+    previous = vdb_latest_slot;
+    vdb_latest_slot = slot;
+    vdb_latest_frame++;
+
+    #ifdef VDB_DELTA
+    {
+        vdb_slot_t *raw = &vdb_shared->ring[slot];
+        int is_key = vdb_key_slot < 0 || vdb_latest_frame - vdb_key_frame >= VDB_KEYFRAME_INTERVAL;
+        unsigned char *packed;
+        int bound = vdb_pack_bound(raw->used);
+        if (bound > vdb_slot_packed_capacity[slot])
+        {
+            free(vdb_slot_packed[slot]);
+            vdb_slot_packed[slot] = (unsigned char*)malloc(bound);
+            vdb_slot_packed_capacity[slot] = vdb_slot_packed[slot] ? bound : 0;
+        }
+        packed = vdb_slot_packed[slot];
+        if (!packed)
+        {
+            // Can't send it, but can't leave the old frame here either
+            vdb_latest_slot = previous;
+            vdb_latest_frame--;
+            vdb_release_slot(slot);
+            return;
+        }
+        if (is_key)
+        {
+            int previous_key = vdb_key_slot;
+            vdb_key_slot = slot;
+            vdb_key_frame = vdb_latest_frame;
+            vdb_release_slot(previous_key);
+        }
+        vdb_slot_key[slot] = vdb_key_frame;
+        packed[0] = 'v';
+        packed[1] = 'd';
+        packed[2] = 'b';
+        packed[3] = is_key ? 'k' : 'd';
+        memcpy(packed + 4, &vdb_key_frame, 4); // @ assuming little endian, like the commands
+        memcpy(packed + 8, &raw->used, 4);
+        vdb_slot_payload_len[slot] = VDB_PACK_HEADER_SIZE + vdb_pack(
+            (const unsigned char*)raw->data, raw->used,
+            is_key ? 0 : (const unsigned char*)vdb_shared->ring[vdb_key_slot].data,
+            is_key ? 0 : vdb_shared->ring[vdb_key_slot].used,
+            packed + VDB_PACK_HEADER_SIZE);
+        vdb_slot_payload[slot] = (char*)packed;
+    }
+    #else
+    vdb_slot_payload[slot] = vdb_shared->ring[slot].data;
+    vdb_slot_payload_len[slot] = vdb_shared->ring[slot].used;
+    #endif
+    vdb_release_slot(previous);
+
+    // send frame header (0x2 indicating binary data)
+    vdb_form_frame(vdb_slot_payload_len[slot], 0x2, &frame, &frame_len);
+    memcpy(vdb_slot_header[slot], frame, frame_len);
+    vdb_slot_header_len[slot] = frame_len;
+
+    for (i = 0; i < VDB_MAX_CLIENTS; i++)
+    {
+        vdb_client_t *c = &vdb_clients[i];
+        if (c->fd >= 0 && c->state == vdb_client_websocket && c->out_slot < 0)
+            if (!vdb_write_client(c))
+                vdb_close_client(c);
+    }
+}
+
+int vdb_network_thread()
+{
+    vdb_shared_t *vs = vdb_shared;
+    struct epoll_event events[16];
+    int i;
+    vdb_log("Created network thread\n");
+    for (i = 0; i < VDB_MAX_CLIENTS; i++)
+        vdb_clients[i].fd = -1;
+
+    vdb_epoll = epoll_create1(EPOLL_CLOEXEC);
+    vdb_critical(vdb_epoll != -1);
+    {
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.ptr = &vs->wakeup;
+        vdb_critical(epoll_ctl(vdb_epoll, EPOLL_CTL_ADD, vs->wakeup, &event) == 0);
+    }
+
+    vdb_log("Creating listen socket\n");
+    while (!tcp_listen(VDB_LISTEN_PORT))
+    {
+        vdb_log("Failed to create socket on port %d\n", VDB_LISTEN_PORT);
+        vdb_sleep(1000);
+    }
+    vdb_log_once("Visualization is live at host:%d\n", VDB_LISTEN_PORT);
+    {
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.ptr = &tcp_listen_socket;
+        vdb_critical(fcntl(tcp_listen_socket, F_SETFL, O_NONBLOCK) == 0);
+        vdb_critical(epoll_ctl(vdb_epoll, EPOLL_CTL_ADD, tcp_listen_socket, &event) == 0);
+    }
+
+    while (!vs->critical_error)
+    {
+        int n = epoll_wait(vdb_epoll, events, sizeof(events)/sizeof(events[0]), -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        vdb_critical(n >= 0);
+        for (i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &tcp_listen_socket)
+            {
+                vdb_accept_clients();
+            }
+            else if (ptr == &vs->wakeup)
+            {
+                vdb_take_latest();
+            }
+            else
+            {
+                vdb_client_t *c = (vdb_client_t*)ptr;
+                int ok = 1;
+                if (c->fd < 0)
+                    continue; // closed by an earlier event
+                if (events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+                    ok = vdb_read_client(c);
+                if (ok && c->fd >= 0 && (events[i].events & EPOLLOUT))
+                    ok = vdb_write_client(c);
+                if (!ok)
+                    vdb_close_client(c);
+            }
+        }
+    }
+    return 0;
+}
+
+void *vdb_pthread_network_thread(void *vdata) { (void)(vdata); vdb_network_thread(); return 0; }
+#endif // VDB_THREADS
+// End auto-include vdb_broadcast.c
+
+
 // Begin auto-include vdb_push_buffer.c
+void vdb_rebase_submission(char *old_buffer, char *new_buffer, int used); // vdb_draw_commands.c
+
+// Returns true if there is room for 'count' more bytes in the work
+// buffer, after growing it if it can (see VDB_RING_SLOTS).
+int vdb_reserve(int count)
+{
+    vdb_shared_t *vs = vdb_shared;
+    int needed = vs->work_buffer_used + count;
+    #ifdef VDB_THREADS
+    vdb_slot_t *slot = &vs->ring[vs->work_slot];
+    if (needed > slot->capacity && needed <= VDB_WORK_BUFFER_SIZE)
+    {
+        int capacity = slot->capacity ? 2*slot->capacity : 64*1024;
+        char *data;
+        while (capacity < needed)
+            capacity *= 2;
+        if (capacity > VDB_WORK_BUFFER_SIZE)
+            capacity = VDB_WORK_BUFFER_SIZE;
+        data = (char*)malloc(capacity);
+        if (!data)
+            return 0;
+        memcpy(data, slot->data, vs->work_buffer_used);
+        vdb_rebase_submission(slot->data, data, vs->work_buffer_used);
+        free(slot->data);
+        slot->data = data;
+        slot->capacity = capacity;
+        vs->work_buffer = data;
+    }
+    return needed <= slot->capacity;
+    #else
+    return needed <= VDB_WORK_BUFFER_SIZE;
+    #endif
+}
+
 // Reserve 'count' number of bytes in the work buffer and optionally
 // initialize their values to 'data', if 'data' is not NULL. Returns
 // a pointer to the beginning of the reserved memory if there was
 // space left, NULL otherwise.
 void *vdb_push_bytes(const void *data, int count)
 {
-    if (vdb_shared->work_buffer_used + count <= VDB_WORK_BUFFER_SIZE)
+    if (vdb_reserve(count))
     {
         const char *src = (const char*)data;
               char *dst = vdb_shared->work_buffer + vdb_shared->work_buffer_used;
@@ -1697,7 +2360,7 @@ void *vdb_push_bytes(const void *data, int count)
 // types. I'm sorry that this is a macro; specialized functions for
 // common types are given below.
 #define _vdb_push_type(VALUE, TYPE)                                                  \
-    if (vdb_shared->work_buffer_used + sizeof(TYPE) <= VDB_WORK_BUFFER_SIZE)         \
+    if (vdb_reserve(sizeof(TYPE)))                                                   \
     {                                                                                \
         TYPE *ptr = (TYPE*)(vdb_shared->work_buffer + vdb_shared->work_buffer_used); \
         vdb_shared->work_buffer_used += sizeof(TYPE);                                \
@@ -1723,6 +2386,7 @@ float    *vdb_push_r32(float x)    { _vdb_push_type(x, float);    }
 #define vdb_mode_fill_rect      5
 #define vdb_mode_circle         6
 #define vdb_mode_image_rgb8     7
+#define vdb_mode_image_jpeg     8
 #define vdb_mode_slider         254
 
 static unsigned char vdb_current_color_mode = 0;
@@ -1762,6 +2426,23 @@ void vdb_begin_submission()
     vdb_nice_points = vdb_push_u08(0);
 }
 
+// This function is called when the work buffer moves while it holds
+// 'used' bytes of commands (see vdb_reserve), so that the pointers
+// above follow it.
+void vdb_rebase_submission(char *old_buffer, char *new_buffer, int used)
+{
+    #define vdb_rebase(PTR, TYPE) \
+        if ((char*)(PTR) >= old_buffer && (char*)(PTR) < old_buffer + used) \
+            PTR = (TYPE*)(new_buffer + ((char*)(PTR) - old_buffer));
+    if (!old_buffer)
+        return;
+    vdb_rebase(vdb_point_size, float);
+    vdb_rebase(vdb_line_size, float);
+    vdb_rebase(vdb_alpha_value, float);
+    vdb_rebase(vdb_nice_points, unsigned char);
+    #undef vdb_rebase
+}
+
 // This function is automatically called on vdb_end, right before
 // the workload is sent off the the network thread.
 void vdb_end_submission()
@@ -1909,6 +2590,14 @@ void vdb_imageRGB8(const void *data, int w, int h)
     vdb_push_bytes(data, w*h*3);
 }
 
+void vdb_imageJPEG(const void *data, int size)
+{
+    vdb_push_u08(vdb_mode_image_jpeg);
+    vdb_push_style();
+    vdb_push_u32(size);
+    vdb_push_bytes(data, size);
+}
+
 void vdb_slider1f(const char *in_label, float *x, float min_value, float max_value)
 {
     int i = 0;
@@ -1982,7 +2671,7 @@ int vdb_mouse_click(float *x, float *y)
 // End auto-include vdb_draw_commands.c
 
 // Begin auto-include vdb_begin_end.c
-#ifdef VDB_UNIX
+#if defined(VDB_UNIX) && !defined(VDB_THREADS)
 void vdb_unix_atexit()
 {
     if (vdb_shared)
@@ -1993,11 +2682,45 @@ void vdb_unix_atexit()
 }
 #endif
 
+#ifdef VDB_THREADS
+// Makes a free ring slot the work buffer, if there is one
+int vdb_take_slot()
+{
+    vdb_shared_t *vs = vdb_shared;
+    if (vs->work_slot < 0)
+    {
+        unsigned int free_slots = __atomic_load_n(&vs->ring_free, __ATOMIC_ACQUIRE);
+        if (!free_slots)
+            return 0;
+        vs->work_slot = __builtin_ctz(free_slots);
+        __atomic_fetch_and(&vs->ring_free, ~(1u << vs->work_slot), __ATOMIC_RELAXED);
+    }
+    vs->work_buffer = vs->ring[vs->work_slot].data;
+    return 1;
+}
+
+// Hands the work buffer to the network thread as the newest frame
+void vdb_give_slot()
+{
+    vdb_shared_t *vs = vdb_shared;
+    uint64_t one = 1;
+    int unsent;
+    vs->ring[vs->work_slot].used = vs->work_buffer_used;
+    vs->work_buffer_used = 0;
+    unsent = __atomic_exchange_n(&vs->ring_pending, vs->work_slot, __ATOMIC_ACQ_REL);
+    if (unsent >= 0) // the network thread never got to it, and now it won't
+        __atomic_fetch_or(&vs->ring_free, 1u << unsent, __ATOMIC_RELEASE);
+    vs->work_slot = -1;
+    if (write(vs->wakeup, &one, sizeof(one)) != sizeof(one))
+        vdb_log("Failed to wake up network thread\n");
+}
+#endif
+
 int vdb_begin()
 {
     if (!vdb_shared)
     {
-        #ifdef VDB_UNIX
+        #if defined(VDB_UNIX) && !defined(VDB_THREADS)
         vdb_shared = (vdb_shared_t*)mmap(NULL, sizeof(vdb_shared_t),
                                          PROT_READ|PROT_WRITE,
                                          MAP_SHARED|MAP_ANONYMOUS, -1, 0);
@@ -2013,7 +2736,7 @@ int vdb_begin()
             return 0;
         }
 
-        #ifdef VDB_UNIX
+        #if defined(VDB_UNIX) && !defined(VDB_THREADS)
         atexit(vdb_unix_atexit); // We want to terminate any child processes when we terminate
 
         vdb_critical(pipe(vdb_shared->ready) != -1);
@@ -2030,13 +2753,27 @@ int vdb_begin()
         }
         vdb_signal_data_sent(); // Needed for first vdb_end call
 
+        #elif defined(VDB_THREADS)
+        {
+            pthread_t thread;
+            vdb_shared->work_slot = -1;
+            vdb_shared->ring_free = (VDB_RING_SLOTS == 32) ? 0xFFFFFFFF : (1u << VDB_RING_SLOTS) - 1;
+            vdb_shared->ring_pending = -1;
+            vdb_shared->wakeup = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+            vdb_critical(vdb_shared->wakeup != -1);
+            vdb_critical(pthread_create(&thread, 0, vdb_pthread_network_thread, NULL) == 0);
+            pthread_detach(thread);
+        }
+
         #else
         vdb_shared->send_semaphore = CreateSemaphore(0, 0, 1, 0);
         CreateThread(0, 0, vdb_win_recv_thread, NULL, 0, 0);
         #endif
 
+        #ifndef VDB_THREADS
         vdb_shared->work_buffer = vdb_shared->swapbuffer1;
         vdb_shared->send_buffer = vdb_shared->swapbuffer2;
+        #endif
         // Remaining parameters should be initialized to zero by calloc or mmap
     }
     if (vdb_shared->critical_error)
@@ -2048,6 +2785,12 @@ int vdb_begin()
     {
         return 0;
     }
+    #ifdef VDB_THREADS
+    if (!vdb_take_slot())
+    {
+        return 0;
+    }
+    #endif
     vdb_shared->work_buffer_used = 0;
     vdb_begin_submission();
     return 1;
@@ -2056,6 +2799,13 @@ int vdb_begin()
 void vdb_end()
 {
     vdb_shared_t *vs = vdb_shared;
+    #ifdef VDB_THREADS
+    if (vs->work_slot >= 0)
+    {
+        vdb_end_submission();
+        vdb_give_slot();
+    }
+    #else
     if (vdb_poll_data_sent()) // Check if send_thread has finished sending data
     {
         vdb_end_submission();
@@ -2069,6 +2819,7 @@ void vdb_end()
         // Notify sending thread that data is available
         vdb_signal_data_ready();
     }
+    #endif
 }
 
 int vdb_loop(int fps)
@@ -2215,6 +2966,10 @@ const char *vdb_html_page =
 "var tex_view0_width = 0;\n"
 "var tex_view0_height = 0;\n"
 "\n"
+"var jpeg_source = null; // the message whose JPEG we last started decoding\n"
+"var jpeg_decoding = false;\n"
+"var jpeg_pending = null; // the latest JPEG to arrive while decoding\n"
+"\n"
 "var vdb_max_variables = 1024;\n"
 "var vdb_variables_label = new Array(vdb_max_variables);\n"
 "var vdb_variables_value = new Array(vdb_max_variables);\n"
@@ -2390,6 +3145,122 @@ const char *vdb_html_page =
 "    vdb_variables_step[registered_i] = step;\n"
 "}\n"
 "\n"
+"// Decodes off the main thread and uploads to tex_view0 when done. If\n"
+"// JPEGs arrive faster than we decode, only the latest one is kept.\n"
+"function decodeJPEG(blob)\n"
+"{\n"
+"    if (jpeg_decoding)\n"
+"    {\n"
+"        jpeg_pending = blob;\n"
+"        return;\n"
+"    }\n"
+"    jpeg_decoding = true;\n"
+"    var done = function()\n"
+"    {\n"
+"        jpeg_decoding = false;\n"
+"        if (jpeg_pending != null)\n"
+"        {\n"
+"            var next = jpeg_pending;\n"
+"            jpeg_pending = null;\n"
+"            decodeJPEG(next);\n"
+"        }\n"
+"    };\n"
+"    createImageBitmap(blob).then(function(bitmap)\n"
+"    {\n"
+"        gl.bindTexture(gl.TEXTURE_2D, tex_view0);\n"
+"        if (tex_view0_width != bitmap.width || tex_view0_height != bitmap.height)\n"
+"        {\n"
+"            tex_view0_width = bitmap.width;\n"
+"            tex_view0_height = bitmap.height;\n"
+"            gl.texImage2D(gl.TEXTURE_2D, 0, gl.RGB, gl.RGB, gl.UNSIGNED_BYTE, bitmap);\n"
+"        }\n"
+"        else\n"
+"        {\n"
+"            gl.texSubImage2D(gl.TEXTURE_2D, 0, 0, 0, gl.RGB, gl.UNSIGNED_BYTE, bitmap);\n"
+"        }\n"
+"        gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_S, gl.CLAMP_TO_EDGE);\n"
+"        gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_WRAP_T, gl.CLAMP_TO_EDGE);\n"
+"        gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MAG_FILTER, gl.NEAREST);\n"
+"        gl.texParameteri(gl.TEXTURE_2D, gl.TEXTURE_MIN_FILTER, gl.NEAREST);\n"
+"        gl.bindTexture(gl.TEXTURE_2D, null);\n"
+"        bitmap.close();\n"
+"        if (jpeg_source === parsed_data)\n"
+"            tex_view0_active = true; // commands are not parsed again to see it\n"
+"        done();\n"
+"    }, function(error)\n"
+"    {\n"
+"        console.log('Could not decode JPEG: ' + error);\n"
+"        done();\n"
+"    });\n"
+"}\n"
+"\n"
+"// With VDB_DELTA the commands come packed (see vdb_pack), and maybe as\n"
+"// differences from a keyframe that we have to hold on to.\n"
+"var key_frame = -1;\n"
+"var key_commands = null;\n"
+"\n"
+"function isPacked(data)\n"
+"{\n"
+"    var bytes = new Uint8Array(data, 0, Math.min(data.byteLength, 4));\n"
+"    return bytes.length == 4 && bytes[0] == 118 && bytes[1] == 100 && bytes[2] == 98; // 'vdb'\n"
+"}\n"
+"\n"
+"// Returns the unpacked commands, or null if we don't have the keyframe\n"
+"function unpackCommands(data)\n"
+"{\n"
+"    var bytes = new Uint8Array(data);\n"
+"    var view = new DataView(data);\n"
+"    var kind = bytes[3];\n"
+"    var frame = view.getUint32(4, true);\n"
+"    var size = view.getUint32(8, true);\n"
+"    var dict = new Uint8Array(0);\n"
+"    if (kind == 100) // 'd'\n"
+"    {\n"
+"        if (frame != key_frame)\n"
+"            return null;\n"
+"        dict = key_commands;\n"
+"    }\n"
+"\n"
+"    var out = new Uint8Array(size);\n"
+"    var i = 12;\n"
+"    var pos = 0;\n"
+"    for (;;)\n"
+"    {\n"
+"        var token = bytes[i++];\n"
+"        var count = token >> 4;\n"
+"        var b = 255;\n"
+"        if (count == 15)\n"
+"            while (b == 255) { b = bytes[i++]; count += b; }\n"
+"        out.set(bytes.subarray(i, i + count), pos);\n"
+"        i += count;\n"
+"        pos += count;\n"
+"        if (pos >= size || i >= bytes.length)\n"
+"            break;\n"
+"\n"
+"        var distance = view.getUint32(i, true); i += 4;\n"
+"        var length = token & 15;\n"
+"        b = 255;\n"
+"        if (length == 15)\n"
+"            while (b == 255) { b = bytes[i++]; length += b; }\n"
+"        length += 6; // VDB_PACK_MIN_MATCH\n"
+"        var from = pos - distance;\n"
+"        if (from < 0) // in the keyframe\n"
+"            out.set(dict.subarray(dict.length + from, dict.length + from + length), pos);\n"
+"        else if (from + length <= pos)\n"
+"            out.copyWithin(pos, from, from + length);\n"
+"        else\n"
+"            for (var k = 0; k < length; k++) out[pos + k] = out[from + k];\n"
+"        pos += length;\n"
+"    }\n"
+"\n"
+"    if (kind == 107) // 'k'\n"
+"    {\n"
+"        key_frame = frame;\n"
+"        key_commands = out;\n"
+"    }\n"
+"    return out.buffer;\n"
+"}\n"
+"\n"
 "function parseCommands(commands)\n"
 "{\n"
 "    tex_view0_active = false;\n"
@@ -2499,6 +3370,22 @@ const char *vdb_html_page =
 "            tex_view0_active = true;\n"
 "            data = null;\n"
 "        }\n"
+"        else if (mode == 8) // image_jpeg\n"
+"        {\n"
+"            var size = view.getUint32(offset, little_endian); offset += 4;\n"
+"\n"
+"            // We are called every frame with the same message, but only\n"
+"            // want to decode each JPEG once.\n"
+"            if (jpeg_source !== commands)\n"
+"            {\n"
+"                jpeg_source = commands;\n"
+"                decodeJPEG(new Blob([new Uint8Array(commands, offset, size)], {type: 'image/jpeg'}));\n"
+"            }\n"
+"            offset += size;\n"
+"\n"
+"            // Keep showing the last decoded JPEG until the next one is ready\n"
+"            tex_view0_active = tex_view0_width > 0;\n"
+"        }\n"
 "        else if (mode == 254) // slider (both int and float)\n"
 "        {\n"
 "            var label = new Uint8Array(commands, offset, 16); offset += 16;\n"
@@ -2543,6 +3430,11 @@ const char *vdb_html_page =
 "    return count;\n"
 "}\n"
 "\n"
+"var parsed_data = null;\n"
+"var parsed_width = 0;\n"
+"var parsed_height = 0;\n"
+"var parsed_elements = 0;\n"
+"\n"
 "function draw()\n"
 "{\n"
 "    // Resize framebuffer resolution to match size of displayed window\n"
@@ -2552,9 +3444,15 @@ const char *vdb_html_page =
 "        cvs.height = cvs.clientHeight;\n"
 "    }\n"
 "\n"
-"    var num_elements = 0;\n"
-"    if (cmd_data != null)\n"
-"        num_elements = parseCommands(cmd_data);\n"
+"    // Only parse new commands, or for a new canvas size\n"
+"    if (cmd_data != null && (cmd_data !== parsed_data || cvs.width != parsed_width || cvs.height != parsed_height))\n"
+"    {\n"
+"        parsed_elements = parseCommands(cmd_data);\n"
+"        parsed_data = cmd_data;\n"
+"        parsed_width = cvs.width;\n"
+"        parsed_height = cvs.height;\n"
+"    }\n"
+"    var num_elements = cmd_data != null ? parsed_elements : 0;\n"
 "\n"
 "    gl.enable(gl.BLEND);\n"
 "    gl.blendEquation(gl.FUNC_ADD);\n"
@@ -2635,6 +3533,12 @@ const char *vdb_html_page =
 "            ws.onclose = function()\n"
 "            {\n"
 "                tex_view0_active = false;\n"
+"                tex_view0_width = 0;\n"
+"                tex_view0_height = 0;\n"
+"                jpeg_source = null;\n"
+"                jpeg_pending = null;\n"
+"                key_frame = -1;\n"
+"                key_commands = null;\n"
 "                cmd_data = null;\n"
 "                ws = null;\n"
 "                has_connection = false;\n"
@@ -2657,7 +3561,14 @@ const char *vdb_html_page =
 "                }\n"
 "                var mbps = (10.0*stats_bps/(1024.0*1024.0)).toPrecision(2);\n"
 "                html_status.innerHTML = 'Connected to ' + connection_address + ' (' + mbps + ' mbps)';\n"
-"                cmd_data = e.data;\n"
+"                if (!isPacked(e.data))\n"
+"                    cmd_data = e.data;\n"
+"                else\n"
+"                {\n"
+"                    var commands = unpackCommands(e.data);\n"
+"                    if (commands != null)\n"
+"                        cmd_data = commands;\n"
+"                }\n"
 "            }\n"
 "        }\n"
 "    }, 250);\n"